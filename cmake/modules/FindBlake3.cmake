@@ -0,0 +1,47 @@
+#[=======================================================================[.rst:
+FindBlake3
+----------
+
+Find libblake3
+
+IMPORTED targets
+^^^^^^^^^^^^^^^^
+
+This module defines the following :prop_tgt:`IMPORTED` target:
+
+``Blake3::Blake3``
+
+Result variables
+^^^^^^^^^^^^^^^^
+
+This module will set the following variables if found:
+
+``Blake3_INCLUDE_DIRS``
+  where to find blake3.h
+``Blake3_LIBRARIES``
+  the libraries to link against to use libblake3
+``Blake3_FOUND``
+  TRUE if found
+
+#]=======================================================================]
+
+find_path(Blake3_INCLUDE_DIR NAMES blake3.h)
+mark_as_advanced(Blake3_INCLUDE_DIR)
+
+find_library(Blake3_LIBRARY NAMES blake3)
+mark_as_advanced(Blake3_LIBRARY)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(Blake3
+    REQUIRED_VARS Blake3_INCLUDE_DIR Blake3_LIBRARY)
+
+if(Blake3_FOUND)
+    set(Blake3_INCLUDE_DIRS ${Blake3_INCLUDE_DIR})
+    set(Blake3_LIBRARIES ${Blake3_LIBRARY})
+    if(NOT TARGET Blake3::Blake3)
+        add_library(Blake3::Blake3 UNKNOWN IMPORTED)
+        set_target_properties(Blake3::Blake3 PROPERTIES
+            IMPORTED_LOCATION             "${Blake3_LIBRARY}"
+            INTERFACE_INCLUDE_DIRECTORIES "${Blake3_INCLUDE_DIR}")
+    endif()
+endif()
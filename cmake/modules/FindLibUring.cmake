@@ -0,0 +1,47 @@
+#[=======================================================================[.rst:
+FindLibUring
+------------
+
+Find liburing, the io_uring userspace library
+
+IMPORTED targets
+^^^^^^^^^^^^^^^^
+
+This module defines the following :prop_tgt:`IMPORTED` target:
+
+``LibUring::LibUring``
+
+Result variables
+^^^^^^^^^^^^^^^^
+
+This module will set the following variables if found:
+
+``LibUring_INCLUDE_DIRS``
+  where to find liburing.h
+``LibUring_LIBRARIES``
+  the libraries to link against to use liburing
+``LibUring_FOUND``
+  TRUE if found
+
+#]=======================================================================]
+
+find_path(LibUring_INCLUDE_DIR NAMES liburing.h)
+mark_as_advanced(LibUring_INCLUDE_DIR)
+
+find_library(LibUring_LIBRARY NAMES uring)
+mark_as_advanced(LibUring_LIBRARY)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(LibUring
+    REQUIRED_VARS LibUring_INCLUDE_DIR LibUring_LIBRARY)
+
+if(LibUring_FOUND)
+    set(LibUring_INCLUDE_DIRS ${LibUring_INCLUDE_DIR})
+    set(LibUring_LIBRARIES ${LibUring_LIBRARY})
+    if(NOT TARGET LibUring::LibUring)
+        add_library(LibUring::LibUring UNKNOWN IMPORTED)
+        set_target_properties(LibUring::LibUring PROPERTIES
+            IMPORTED_LOCATION             "${LibUring_LIBRARY}"
+            INTERFACE_INCLUDE_DIRECTORIES "${LibUring_INCLUDE_DIR}")
+    endif()
+endif()
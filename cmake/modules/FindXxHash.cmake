@@ -0,0 +1,47 @@
+#[=======================================================================[.rst:
+FindXxHash
+----------
+
+Find libxxhash
+
+IMPORTED targets
+^^^^^^^^^^^^^^^^
+
+This module defines the following :prop_tgt:`IMPORTED` target:
+
+``XxHash::XxHash``
+
+Result variables
+^^^^^^^^^^^^^^^^
+
+This module will set the following variables if found:
+
+``XxHash_INCLUDE_DIRS``
+  where to find xxhash.h
+``XxHash_LIBRARIES``
+  the libraries to link against to use libxxhash
+``XxHash_FOUND``
+  TRUE if found
+
+#]=======================================================================]
+
+find_path(XxHash_INCLUDE_DIR NAMES xxhash.h)
+mark_as_advanced(XxHash_INCLUDE_DIR)
+
+find_library(XxHash_LIBRARY NAMES xxhash)
+mark_as_advanced(XxHash_LIBRARY)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(XxHash
+    REQUIRED_VARS XxHash_INCLUDE_DIR XxHash_LIBRARY)
+
+if(XxHash_FOUND)
+    set(XxHash_INCLUDE_DIRS ${XxHash_INCLUDE_DIR})
+    set(XxHash_LIBRARIES ${XxHash_LIBRARY})
+    if(NOT TARGET XxHash::XxHash)
+        add_library(XxHash::XxHash UNKNOWN IMPORTED)
+        set_target_properties(XxHash::XxHash PROPERTIES
+            IMPORTED_LOCATION             "${XxHash_LIBRARY}"
+            INTERFACE_INCLUDE_DIRECTORIES "${XxHash_INCLUDE_DIR}")
+    endif()
+endif()
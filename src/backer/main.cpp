@@ -2,8 +2,18 @@
 #include "katla/core/posix-file.h"
 
 #include "libbacker/backer.h"
+#include "libbacker/duplicate-finder.h"
 #include "libbacker/file-group-set.h"
+#include "libbacker/file-chunk-report.h"
+#include "libbacker/file-deduplicator.h"
+#include "libbacker/file-hash-reader.h"
+#include "libbacker/hasher.h"
+#include "libbacker/read-scheduler.h"
+#include "libbacker/file-index-compare.h"
 #include "libbacker/file-index-database.h"
+#include "libbacker/file-index-diff.h"
+#include "libbacker/file-index-snapshot.h"
+#include "libbacker/file-sync.h"
 
 #include "cxxopts.hpp"
 
@@ -15,6 +25,7 @@
 #include <filesystem>
 
 #include <cstdio>
+#include <cstdlib>
 #include <cstdint>
 #include <cstddef>
 
@@ -24,15 +35,135 @@ namespace fs = std::filesystem;
 
 
 
+namespace {
+    backer::IoOptions parseIoOptions(cxxopts::ParseResult& optionsResult)
+    {
+        backer::IoOptions ioOptions;
+        if (optionsResult.count("io-backend")) {
+            ioOptions.backend = backer::FileHashReader::parseBackend(optionsResult["io-backend"].as<std::string>());
+        }
+        if (optionsResult.count("buffer-size")) {
+            ioOptions.bufferSize = optionsResult["buffer-size"].as<size_t>();
+            if (ioOptions.bufferSize == 0) {
+                throw std::runtime_error("--buffer-size has to be at least 1 byte");
+            }
+        }
+        if (optionsResult.count("queue-depth")) {
+            ioOptions.queueDepth = optionsResult["queue-depth"].as<unsigned>();
+            if (ioOptions.queueDepth == 0) {
+                throw std::runtime_error("--queue-depth has to be at least 1");
+            }
+        }
+        if (optionsResult.count("multi-buffer-threshold")) {
+            ioOptions.multiBufferThreshold = optionsResult["multi-buffer-threshold"].as<uint64_t>();
+        }
+        if (optionsResult.count("read-order")) {
+            ioOptions.readOrder = backer::ReadScheduler::parseOrder(optionsResult["read-order"].as<std::string>());
+        }
+        if (optionsResult.count("rotational-jobs")) {
+            ioOptions.rotationalJobs = optionsResult["rotational-jobs"].as<int>();
+        }
+        ioOptions.hashCache = optionsResult.count("hash-cache") > 0;
+
+        return ioOptions;
+    }
+
+    backer::HashAlgorithm parseHashAlgorithm(cxxopts::ParseResult& optionsResult)
+    {
+        if (!optionsResult.count("hash")) {
+            return backer::HashAlgorithm::Sha256;
+        }
+
+        auto algorithm = backer::Hasher::parseAlgorithm(optionsResult["hash"].as<std::string>());
+        if (!backer::Hasher::isAvailable(algorithm)) {
+            throw std::runtime_error(katla::format("Backer was built without {} support", backer::Hasher::algorithmName(algorithm)));
+        }
+
+        return algorithm;
+    }
+
+    backer::FileIndexOptions parseFileIndexOptions(cxxopts::ParseResult& optionsResult)
+    {
+        backer::FileIndexOptions fileIndexOptions;
+        if (optionsResult.count("jobs")) {
+            fileIndexOptions.jobs = optionsResult["jobs"].as<int>();
+        }
+        fileIndexOptions.update = optionsResult.count("update") > 0;
+        fileIndexOptions.io = parseIoOptions(optionsResult);
+        fileIndexOptions.hashAlgorithm = parseHashAlgorithm(optionsResult);
+        if (optionsResult.count("pipeline-memory")) {
+            fileIndexOptions.pipelineMemoryLimit = optionsResult["pipeline-memory"].as<size_t>() * 1024 * 1024;
+        }
+        fileIndexOptions.chunking = optionsResult.count("chunking") > 0;
+        if (optionsResult.count("chunk-size")) {
+            auto averageSize = optionsResult["chunk-size"].as<size_t>() * 1024;
+            fileIndexOptions.chunkingOptions = {averageSize / 4, averageSize, averageSize * 4};
+        }
+
+        return fileIndexOptions;
+    }
+
+    // Every tree gets its own index in the user's cache directory, named after the hash of its absolute path
+    std::string cachedFileIndexPath(const std::string& path)
+    {
+        fs::path cacheDirectory;
+        if (auto cacheHome = std::getenv("XDG_CACHE_HOME"); cacheHome && *cacheHome) {
+            cacheDirectory = cacheHome;
+        } else if (auto home = std::getenv("HOME"); home && *home) {
+            cacheDirectory = fs::path(home) / ".cache";
+        } else {
+            cacheDirectory = fs::temp_directory_path();
+        }
+        cacheDirectory /= "backer";
+        fs::create_directories(cacheDirectory);
+
+        auto treePath = fs::canonical(path).string();
+        auto hasher = backer::Hasher::create(backer::HashAlgorithm::Sha256);
+        hasher->update(reinterpret_cast<const std::byte*>(treePath.data()), treePath.size());
+        return (cacheDirectory / katla::format("{}.db.sqlite", backer::Backer::formatHash(hasher->final()))).string();
+    }
+
+    // A directory is compared through its cached index, which is brought up to date first. The index is kept out of
+    // the tree, so read-only trees work and the index isn't hashed as part of its own tree.
+    std::string fileIndexOf(const std::string& path, backer::FileIndexOptions options)
+    {
+        if (!fs::is_directory(path)) {
+            return path;
+        }
+
+        auto fileIndexPath = cachedFileIndexPath(path);
+        options.update = true;
+        backer::FileIndexDatabase::create(fileIndexPath, path, options);
+        return fileIndexPath;
+    }
+}
+
 int main(int argc, char* argv[])
-{
+try {
     cxxopts::Options options("Backer", "Backup toolkit");
 
     options.add_options()
             ("h,help", "Print help")
             ("s,source", "Source path", cxxopts::value<std::string>())
-            ("c,command", "Specify command, options are: {list}", cxxopts::value<std::string>())
+            ("c,command", "Specify command, options are: {list, create-file-index, compare, diff, export-snapshot, sync, chunk-report, duplicates, dedupe}", cxxopts::value<std::string>())
             ("o,output", "Output file", cxxopts::value<std::string>())
+            ("u,update", "Update an existing file index, only hashing changed files")
+            ("j,jobs", "Number of hashing threads, defaults to all hardware threads", cxxopts::value<int>())
+            ("hash", "Hash algorithm: sha256 (default), xxh3-128 or blake3", cxxopts::value<std::string>())
+            ("io-backend", "How files are read for hashing: auto, blocking or io_uring", cxxopts::value<std::string>())
+            ("buffer-size", "Size of a single read when hashing files", cxxopts::value<size_t>())
+            ("queue-depth", "Maximum number of reads in flight per hashing thread", cxxopts::value<unsigned>())
+            ("pipeline-memory", "MiB of files queued between hashing and writing the file index, excluding the scanned tree", cxxopts::value<size_t>())
+            ("multi-buffer-threshold", "Files up to this size are hashed in multi-buffer batches with sha256, 0 disables", cxxopts::value<uint64_t>())
+            ("read-order", "Order files are read in: auto, scan, inode or extent. Auto uses extent order on spinning disks only", cxxopts::value<std::string>())
+            ("rotational-jobs", "Number of hashing threads per spinning disk, other devices use all jobs", cxxopts::value<int>())
+            ("chunking", "Store the content-defined chunks of every file in the file index")
+            ("chunk-size", "Average chunk size in KiB, chunks are a quarter to four times as large", cxxopts::value<size_t>())
+            ("hash-cache", "Reuse file hashes stored in user.backer.* extended attributes and store new ones")
+            ("no-verify", "Don't hash files copied by sync to check them against the source index")
+            ("dedupe-mode", "How dedupe shares the content of duplicates: reflink (default) or hardlink", cxxopts::value<std::string>())
+            ("no-lockstep", "Fully hash groups of two potential duplicates instead of comparing them block by block")
+            ("sample-size", "Bytes read at the head, middle and tail of a file before fully hashing duplicates", cxxopts::value<size_t>())
             ("a,args", "last tmp", cxxopts::value<std::vector<std::string>>());
     options.parse_positional({"command", "args"});
 
@@ -57,12 +188,11 @@ int main(int argc, char* argv[])
         }
 
         fileGroupSet = backer::FileGroupSet::create(".");
-        auto fileMap = fileGroupSet.fileMap();
-        for (auto& pair : fileMap) {
-            for(auto& file : pair.second) {
-                katla::printInfo("{}", file.absolutePath);
+        fileGroupSet.forEachGroup([&](const backer::FileGroupKey&, gsl::span<const backer::FileReference> files) {
+            for(auto& file : files) {
+                katla::printInfo("{}", fileGroupSet.tree(file).absolutePath(file.node));
             }
-        }
+        });
 
         return EXIT_SUCCESS;
     }
@@ -79,61 +209,198 @@ int main(int argc, char* argv[])
             path = optionsResult["source"].as<std::string>();
         }
 
-        auto fileIndexPath = katla::format("{}/file-index.db.sqlite", path);
+        auto fileIndexPath = katla::format("{}/{}", path, backer::DefaultFileIndexName);
         if (optionsResult.count("output")) {
             fileIndexPath = optionsResult["output"].as<std::string>();
         }
 
-        auto fileIndex = backer::FileIndexDatabase::create(fileIndexPath, path);
+        auto fileIndex = backer::FileIndexDatabase::create(fileIndexPath, path, parseFileIndexOptions(optionsResult));
 
         return EXIT_SUCCESS;
     }
 
-    
-    if(argc == 3) {
-//        katla::print(stdout, "Comparing src {} to dest {}\n", argv[1], argv[2]);
-//
-//        fileMap = backer::Backer::groupPotentialDuplicateFile(argv[1]);
-//        backer::Backer::walkFiles(argv[2], fileMap, false, true);
-    }
+    if (command == "compare" || command == "diff") {
+        std::vector<std::string> paths;
+        if (optionsResult.count("source")) {
+            paths.push_back(optionsResult["source"].as<std::string>());
+        }
+        if (optionsResult.count("args")) {
+            for (auto& argument : optionsResult["args"].as<std::vector<std::string>>()) {
+                paths.push_back(argument);
+            }
+        }
+        if (paths.size() != 2) {
+            katla::printError("{} needs a source and a destination, each a file index or a directory", command);
+            return EXIT_FAILURE;
+        }
 
-    backer::CountResult result {};
-    result.nrOfFiles = fileGroupSet.countFiles();
+        auto fileIndexOptions = parseFileIndexOptions(optionsResult);
+        auto srcIndexPath = fileIndexOf(paths[0], fileIndexOptions);
+        auto destIndexPath = fileIndexOf(paths[1], fileIndexOptions);
+
+        if (command == "diff") {
+            auto diff = backer::FileIndexDiff::diff(srcIndexPath, destIndexPath);
+            for (auto& change : diff.changes) {
+                katla::print(stdout, "{}: {}{}\n",
+                             backer::FileIndexDiff::changeTypeName(change.type),
+                             change.path,
+                             change.entryType == backer::FileSystemEntryType::Dir ? "/" : "");
+            }
+
+            katla::print(stdout, "Nr of changes: {}\n", diff.changes.size());
+            katla::print(stdout, "Nr of directories read: {}, identical subtrees skipped: {}\n",
+                         diff.nrOfDirectoriesVisited, diff.nrOfDirectoriesSkipped);
+            return EXIT_SUCCESS;
+        }
 
-    auto fileMap = fileGroupSet.fileMap();
+        auto comparison = backer::FileIndexCompare::compare(srcIndexPath, destIndexPath);
 
+        for (auto& file : comparison.onlyAtSrc) {
+            katla::print(stdout, "Only at src: {}\n", file);
+        }
+        for (auto& file : comparison.onlyAtDest) {
+            katla::print(stdout, "Only at dest: {}\n", file);
+        }
 
-    // Calculate md5 hashes of files in a group
-    // - Use that md5 in the key to create an unique group
-    std::map<std::string, std::vector<backer::FileSystemEntry>> uniqueGroup;
-    int fileNr = 0;
-    for (auto& pair : fileMap) {
-        auto&& fileGroup = pair.second;
+        katla::print(stdout, "Nr of files only at src: {}\n", comparison.onlyAtSrc.size());
+        katla::print(stdout, "Nr of files only at dest: {}\n", comparison.onlyAtDest.size());
+        katla::print(stdout, "Nr of files at both: {}\n", comparison.atBoth.size());
 
-        for (auto& file : fileGroup) {
-            katla::print(stdout, "[{}/{}] {}\n", fileNr, result.nrOfFiles, file.absolutePath);
-            fileNr++;
+        return EXIT_SUCCESS;
+    }
+
+    if (command == "export-snapshot") {
+        std::string path = ".";
+        if (optionsResult.count("args")) {
+            auto arguments = optionsResult["args"].as<std::vector<std::string>>();
+            if (arguments.size()) {
+                path = arguments.front();
+            }
+        }
+        if (optionsResult.count("source")) {
+            path = optionsResult["source"].as<std::string>();
+        }
+
+        // Next to the index by default, where indexes stored in a tree leave it out of the tree's own index
+        auto fileIndexPath = fileIndexOf(path, parseFileIndexOptions(optionsResult));
+        auto snapshotPath = katla::format("{}.snapshot", fileIndexPath);
+        if (optionsResult.count("output")) {
+            snapshotPath = optionsResult["output"].as<std::string>();
+        }
+
+        backer::FileIndexSnapshot::create(fileIndexPath, snapshotPath);
+        katla::print(stdout, "Exported {} files to {}\n", backer::FileIndexSnapshot::open(snapshotPath).size(), snapshotPath);
+        return EXIT_SUCCESS;
+    }
 
-            if (fileGroup.size() < 2) {
-                uniqueGroup[pair.first] = fileGroup;
-                continue;
+    if (command == "sync") {
+        std::vector<std::string> paths;
+        if (optionsResult.count("source")) {
+            paths.push_back(optionsResult["source"].as<std::string>());
+        }
+        if (optionsResult.count("args")) {
+            for (auto& argument : optionsResult["args"].as<std::vector<std::string>>()) {
+                paths.push_back(argument);
             }
+        }
+        if (paths.size() != 2 || !fs::is_directory(paths[0])) {
+            katla::printError("{} needs a source and a destination directory", command);
+            return EXIT_FAILURE;
+        }
+
+        fs::create_directories(paths[1]);
+
+        auto fileIndexOptions = parseFileIndexOptions(optionsResult);
+        auto srcIndexPath = fileIndexOf(paths[0], fileIndexOptions);
+        auto destIndexPath = fileIndexOf(paths[1], fileIndexOptions);
 
-            file.hash = backer::Backer::sha256(file.absolutePath);
-            std::string newKey = katla::format("{}-{}", pair.first, backer::Backer::formatHash(file.hash));
-            if (uniqueGroup.find(newKey) == uniqueGroup.end()) {
-                uniqueGroup[newKey] = {};
+        backer::FileSyncOptions fileSyncOptions;
+        fileSyncOptions.jobs = fileIndexOptions.jobs;
+        fileSyncOptions.verify = optionsResult.count("no-verify") == 0;
+
+        backer::FileSync fileSync(fileSyncOptions);
+        fileSync.sync(paths[0], srcIndexPath, paths[1], destIndexPath);
+        fileSync.printStatistics();
+
+        return fileSync.statistics().nrOfFailed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (command == "chunk-report") {
+        std::vector<std::string> paths;
+        if (optionsResult.count("source")) {
+            paths.push_back(optionsResult["source"].as<std::string>());
+        }
+        if (optionsResult.count("args")) {
+            for (auto& argument : optionsResult["args"].as<std::vector<std::string>>()) {
+                paths.push_back(argument);
             }
-            uniqueGroup[newKey].push_back(file);
         }
+        if (paths.empty()) {
+            katla::printError("{} needs one or more file indexes or directories", command);
+            return EXIT_FAILURE;
+        }
+
+        auto fileIndexOptions = parseFileIndexOptions(optionsResult);
+        fileIndexOptions.chunking = true;
+
+        std::vector<std::string> indexPaths;
+        for (auto& path : paths) {
+            indexPaths.push_back(fileIndexOf(path, fileIndexOptions));
+        }
+
+        backer::FileChunkReporter::print(backer::FileChunkReporter::create(indexPaths));
+        return EXIT_SUCCESS;
     }
 
-    std::map<std::string, backer::FileSystemEntry> onlyAtSrc;
+    if (command != "duplicates" && command != "dedupe") {
+        katla::printError("Unknown command: {}", command);
+        katla::print(stdout, options.help());
+        return EXIT_FAILURE;
+    }
+
+    std::string path = ".";
+    if (optionsResult.count("args")) {
+        auto arguments = optionsResult["args"].as<std::vector<std::string>>();
+        if (arguments.size()) {
+            path = arguments.front();
+        }
+    }
+    if (optionsResult.count("source")) {
+        path = optionsResult["source"].as<std::string>();
+    }
+
+    backer::DuplicateFinderOptions duplicateFinderOptions;
+    if (optionsResult.count("jobs")) {
+        duplicateFinderOptions.jobs = optionsResult["jobs"].as<int>();
+    }
+    if (optionsResult.count("sample-size")) {
+        duplicateFinderOptions.sampleSize = optionsResult["sample-size"].as<size_t>();
+    }
+    duplicateFinderOptions.lockstepCompare = optionsResult.count("no-lockstep") == 0;
+    duplicateFinderOptions.io = parseIoOptions(optionsResult);
+    duplicateFinderOptions.hashAlgorithm = parseHashAlgorithm(optionsResult);
+
+    // A wrong mode is reported before the tree is scanned and hashed
+    auto dedupeMode = backer::DedupeMode::Reflink;
+    if (optionsResult.count("dedupe-mode")) {
+        dedupeMode = backer::FileDeduplicator::parseMode(optionsResult["dedupe-mode"].as<std::string>());
+    }
+
+    fileGroupSet = backer::FileGroupSet::create(path, duplicateFinderOptions.jobs);
+
+    backer::CountResult result {};
+    result.nrOfFiles = fileGroupSet.countFiles();
+
+    auto files = fileGroupSet.entries();
+
+    // Group files by size, then by a sample of their content and only fully hash files that still collide
+    backer::DuplicateFinder duplicateFinder(duplicateFinderOptions);
+    auto uniqueGroup = duplicateFinder.group(std::move(files));
 
+    std::map<std::string, backer::FileSystemEntry> onlyAtSrc;
 
-    for (auto& pair : uniqueGroup) {
-        auto&& fileGroup = pair.second;
 
+    for (auto& fileGroup : uniqueGroup) {
         bool noDest = true;
         for (auto& file : fileGroup) {
             if (file.isInDest) {
@@ -152,18 +419,30 @@ int main(int argc, char* argv[])
         }
     }
 
-    for (auto& pair : uniqueGroup) {
-        auto fileGroup = pair.second;
+    for (auto& fileGroup : uniqueGroup) {
+        // Hard links share their content instead of duplicating it
+        if (backer::DuplicateFinder::nrOfInodes(fileGroup) < 2) {
+            continue;
+        }
 
         for(auto& file : fileGroup) {
-            if (fileGroup.size() > 2) {
-                result.duplicates++;
-                katla::print(stdout, "Duplicates: {}-{}\n", backer::Backer::formatHash(file.hash), file.absolutePath);
-            }
+            result.duplicates++;
+            katla::print(stdout, "Duplicates: {}-{}\n", backer::Backer::formatHash(file.hash, duplicateFinderOptions.hashAlgorithm), file.absolutePath);
+        }
+    }
+
+    size_t nrOfHardLinks = 0;
+    for (auto& hardLinkGroup : duplicateFinder.hardLinkGroups()) {
+        for (auto& file : hardLinkGroup) {
+            nrOfHardLinks++;
+            katla::print(stdout, "Hard links: {}-{}\n", file.inode, file.absolutePath);
         }
     }
 
-    backer::Backer::writeToFile("only-at-src.txt", onlyAtSrc);
+    // The list is only kept when asked for, a run doesn't leave files behind in the working directory
+    if (optionsResult.count("output")) {
+        backer::Backer::writeToFile(optionsResult["output"].as<std::string>(), onlyAtSrc);
+    }
 
     for (auto& pair : onlyAtSrc) {
         katla::print(stdout, "Only at src: {}\n", pair.first);
@@ -173,4 +452,28 @@ int main(int argc, char* argv[])
     katla::print(stdout, "Nr of files only at src: {}\n", onlyAtSrc.size());
     katla::print(stdout, "Nr of files at both: {}\n", result.atBoth);
     katla::print(stdout, "Nr of files have duplicates: {}\n", result.duplicates);
+    katla::print(stdout, "Nr of hard linked files: {}\n", nrOfHardLinks);
+
+    duplicateFinder.printStatistics();
+
+    if (command == "dedupe") {
+        std::vector<std::vector<backer::FileSystemEntry>> duplicateGroups;
+        for (auto& fileGroup : uniqueGroup) {
+            if (backer::DuplicateFinder::nrOfInodes(fileGroup) >= 2) {
+                duplicateGroups.push_back(std::move(fileGroup));
+            }
+        }
+
+        backer::FileDeduplicator deduplicator(dedupeMode);
+        deduplicator.deduplicate(duplicateGroups);
+        deduplicator.printStatistics();
+
+        return deduplicator.statistics().nrOfFailed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+} catch (const std::exception& exception) {
+    // Bad options and failures of a command end the run with their message instead of an abort
+    katla::printError("{}", exception.what());
+    return EXIT_FAILURE;
 }
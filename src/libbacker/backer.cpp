@@ -1,105 +1,135 @@
 #include "backer.h"
 
+#include "file-tree.h"
+#include "sha256-multi-buffer.h"
+
 #include "katla/core/posix-file.h"
 
 #include <filesystem>
-#include <openssl/sha.h>
+
+#include <algorithm>
+#include <cassert>
 
 namespace backer {
 
     namespace fs = std::filesystem;
 
-    std::vector<std::byte> Backer::sha256(std::string path) {
+    std::vector<std::byte> Backer::sha256(std::string path, size_t readBufferSize) {
+        return hashFile(path, HashAlgorithm::Sha256, readBufferSize);
+    }
+
+    std::vector<std::byte> Backer::sha256(std::vector<std::vector<std::byte>> hashes) {
+        return hashOfHashes(hashes, HashAlgorithm::Sha256);
+    }
+
+    std::vector<std::vector<std::byte>> Backer::sha256Files(const std::vector<std::string>& paths) {
+        std::vector<std::vector<std::byte>> contents(paths.size());
+
+        for (size_t i = 0; i < paths.size(); i++) {
+            katla::PosixFile file;
+            auto openResult = file.open(paths[i], katla::PosixFile::OpenFlags::ReadOnly);
+            if (!openResult) {
+                throw std::runtime_error(katla::format("Failed opening file {} for hashing: {}", paths[i], openResult.error().message()));
+            }
+
+            auto fileSizeResult = file.size();
+            if (!fileSizeResult) {
+                throw std::runtime_error(katla::format("Failed reading file size of {}!", paths[i]));
+            }
+
+            // Read until the end of the file, it may have grown since its size was read
+            auto& content = contents[i];
+            size_t readSize = fileSizeResult.value() + 1;
+            while (true) {
+                size_t offset = content.size();
+                content.resize(offset + readSize);
+
+                auto readResult = file.read(gsl::span<std::byte>(content.data() + offset, readSize));
+                if (!readResult) {
+                    throw std::runtime_error(katla::format("Failed reading file {}!", paths[i]));
+                }
+
+                content.resize(offset + readResult.value());
+                if (readResult.value() < readSize) {
+                    break;
+                }
+            }
+        }
+
+        std::vector<gsl::span<const std::byte>> messages;
+        messages.reserve(contents.size());
+        for (auto& content : contents) {
+            messages.push_back(gsl::span<const std::byte>(content.data(), content.size()));
+        }
+
+        return Sha256MultiBuffer::hash(messages);
+    }
+
+    std::vector<std::byte> Backer::hashFile(std::string path, HashAlgorithm algorithm, size_t readBufferSize) {
+        assert(readBufferSize > 0);
 
         katla::PosixFile file;
         auto openResult = file.open(path, katla::PosixFile::OpenFlags::ReadOnly);
         if (!openResult) {
-            throw new std::runtime_error("Failed opening file for reading md5!");
+            throw std::runtime_error(katla::format("Failed opening file {} for hashing: {}", path, openResult.error().message()));
         }
 
-        constexpr int readBufferSize = 32768;
-        std::vector<std::byte> readBuffer(readBufferSize);
-
-        SHA256_CTX ctx;
-        if (!SHA256_Init(&ctx)) {
-            throw new std::runtime_error("Failed initiaizing md5 context!");
-        }
+        auto hasher = Hasher::create(algorithm);
 
         auto fileSizeResult = file.size();
         if (!fileSizeResult) {
-            throw new std::runtime_error("Failed reading file size!");
+            throw std::runtime_error(katla::format("Failed reading file size of {}!", path));
         }
 
+        // Small files don't need the full buffer
+        readBufferSize = std::min<size_t>(readBufferSize, fileSizeResult.value() + 1);
+        std::vector<std::byte> readBuffer(readBufferSize);
+
         int nrOfIter = (fileSizeResult.value() / readBufferSize) + 1;
         for (int i = 0; i < nrOfIter; i++) {
             auto readSpan = gsl::span<std::byte>(readBuffer.data(), readBuffer.size());
             auto readResult = file.read(readSpan);
 
             if (!readResult) {
-                throw new std::runtime_error("Failed reading file!");
+                throw std::runtime_error(katla::format("Failed reading file {}!", path));
             }
 
-            SHA256_Update(&ctx, reinterpret_cast<const unsigned char *>(readBuffer.data()), readResult.value());
+            hasher->update(readBuffer.data(), readResult.value());
         }
 
-        std::vector<std::byte> result(SHA256_DIGEST_LENGTH);
-        SHA256_Final(reinterpret_cast<unsigned char *>(result.data()), &ctx);
-
-        return result;
+        return hasher->final();
     }
 
-    std::vector<std::byte> Backer::sha256(std::vector<std::vector<std::byte>> hashes) {
-
-        SHA256_CTX ctx;
-        if (!SHA256_Init(&ctx)) {
-            throw new std::runtime_error("Failed initiaizing md5 context!");
-        }
+    std::vector<std::byte> Backer::hashOfHashes(const std::vector<std::vector<std::byte>>& hashes, HashAlgorithm algorithm) {
+        auto hasher = Hasher::create(algorithm);
 
         for (auto& hash : hashes) {
-            SHA256_Update(&ctx, reinterpret_cast<const unsigned char *>(hash.data()), hash.size());
+            hasher->update(hash.data(), hash.size());
         }
 
-        std::vector<std::byte> result(SHA256_DIGEST_LENGTH);
-        SHA256_Final(reinterpret_cast<unsigned char *>(result.data()), &ctx);
-
-        return result;
+        return hasher->final();
     }
 
     void Backer::walkFiles(std::string path,
                            std::map<std::string, std::vector<FileSystemEntry>> &fileMap,
                            bool addNewFiles,
                            bool isInDest) {
-        fs::recursive_directory_iterator dirIter(path);
-        for (auto &entry : dirIter) {
-            if (entry.is_symlink() || entry.is_other()) {
-                continue;
-            }
-
-            if (entry.is_regular_file()) {
-                FileSystemEntry fileData{};
-                fileData.name = entry.path().filename().string();
-                fileData.relativePath = entry.path().string();
-
-                auto absolutePathResult = katla::PosixFile::absolutePath(entry.path().string());
-                if (!absolutePathResult) {
-                    throw std::runtime_error(absolutePathResult.error().message());
-                }
+        auto tree = FileTree::create(path);
 
-                fileData.absolutePath = absolutePathResult.value();
+        tree.forEachFile([&](NodeIndex index) {
+            FileSystemEntry fileData = tree.entry(index);
+            fileData.relativePath = (fs::path(path) / fileData.relativePath).string();
+            fileData.isInDest = isInDest;
 
-                fileData.size = entry.file_size();
-                fileData.isInDest = isInDest;
+            std::string key = katla::format("{}-{}", fileData.name, fileData.size);
 
-                std::string key = katla::format("{}-{}", fileData.name, fileData.size);
-
-                auto findIt = fileMap.find(key);
-                if (findIt != fileMap.end()) {
-                    findIt->second.push_back(fileData);
-                } else if (addNewFiles) {
-                    fileMap[key] = std::vector<FileSystemEntry>{fileData};
-                }
+            auto findIt = fileMap.find(key);
+            if (findIt != fileMap.end()) {
+                findIt->second.push_back(fileData);
+            } else if (addNewFiles) {
+                fileMap[key] = std::vector<FileSystemEntry>{fileData};
             }
-        }
+        });
     }
 
     std::string Backer::formatHash(const std::vector<std::byte> &hash) {
@@ -112,6 +142,23 @@ namespace backer {
         return ss.str();
     }
 
+    std::string Backer::formatHash(const Digest& digest, HashAlgorithm algorithm) {
+        return formatHash(Hasher::fromDigest(digest, algorithm));
+    }
+
+    std::vector<std::byte> Backer::parseHash(const std::string& hash) {
+        if (hash.size() % 2 != 0) {
+            throw std::runtime_error(katla::format("Invalid hash: {}", hash));
+        }
+
+        std::vector<std::byte> result(hash.size() / 2);
+        for (size_t i = 0; i < result.size(); i++) {
+            result[i] = static_cast<std::byte>(std::stoul(hash.substr(i * 2, 2), nullptr, 16));
+        }
+
+        return result;
+    }
+
     void Backer::writeToFile(std::string filePath, std::map<std::string, FileSystemEntry> &fileData) {
         katla::PosixFile file;
         auto result = file.create(filePath,
@@ -20,6 +20,7 @@
 #include "katla/core/core.h"
 
 #include "file-group-set.h"
+#include "hasher.h"
 
 #include <cstddef>
 #include <cstdint>
@@ -46,10 +47,19 @@ class Backer {
 
 
 
-    static std::vector<std::byte> sha256(std::string path);
+    static std::vector<std::byte> sha256(std::string path, size_t readBufferSize = 32768);
     static std::vector<std::byte> sha256(std::vector<std::vector<std::byte>> hashes);
+    // Reads all files completely and hashes them together in multi-buffer lanes, meant for many small files.
+    // Returns one hash per path, in path order.
+    static std::vector<std::vector<std::byte>> sha256Files(const std::vector<std::string>& paths);
+
+    static std::vector<std::byte> hashFile(std::string path, HashAlgorithm algorithm, size_t readBufferSize = 32768);
+    // Hash of a directory, computed over the hashes of its children
+    static std::vector<std::byte> hashOfHashes(const std::vector<std::vector<std::byte>>& hashes, HashAlgorithm algorithm);
 
     static std::string formatHash(const std::vector<std::byte>& hash);
+    static std::string formatHash(const Digest& digest, HashAlgorithm algorithm);
+    static std::vector<std::byte> parseHash(const std::string& hash);
     static void writeToFile(std::string filePath, std::map<std::string, FileSystemEntry>& fileData);
 };
 
@@ -0,0 +1,126 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+namespace backer {
+
+// Hands items from one pipeline stage to the next. Every item has a cost, usually its size in bytes, and a
+// producer blocks while the queued items would exceed the capacity so a fast stage can't run away from a slow one.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) :
+        m_capacity(capacity)
+    {
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    // Blocks while the queue is full, an item costing more than the capacity is only accepted by an empty queue.
+    // Returns false when the queue was closed, the item is dropped then.
+    bool push(T item, size_t cost = 1)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_notFull.wait(lock, [&]() {
+            return m_closed || m_items.empty() || m_cost + cost <= m_capacity;
+        });
+
+        if (m_closed) {
+            return false;
+        }
+
+        m_items.emplace_back(std::move(item), cost);
+        m_cost += cost;
+        m_notEmpty.notify_one();
+        return true;
+    }
+
+    // Blocks until an item is available, returns nothing once the queue is closed and drained
+    std::optional<T> pop()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_notEmpty.wait(lock, [&]() {
+            return m_closed || !m_items.empty();
+        });
+
+        return popLocked();
+    }
+
+    // Like pop, but also returns nothing when no item arrived within the timeout, drained() tells both apart
+    std::optional<T> pop(std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_notEmpty.wait_for(lock, timeout, [&]() {
+            return m_closed || !m_items.empty();
+        });
+
+        return popLocked();
+    }
+
+    // Closed and no items left
+    bool drained()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_closed && m_items.empty();
+    }
+
+    // No more items are accepted, consumers still receive the queued ones
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_notFull.notify_all();
+        m_notEmpty.notify_all();
+    }
+
+private:
+    std::optional<T> popLocked()
+    {
+        if (m_items.empty()) {
+            return std::nullopt;
+        }
+
+        auto entry = std::move(m_items.front());
+        m_items.pop_front();
+        m_cost -= entry.second;
+        m_notFull.notify_all();
+        return std::move(entry.first);
+    }
+
+    size_t m_capacity;
+    size_t m_cost { 0 };
+    bool m_closed { false };
+    std::deque<std::pair<T, size_t>> m_items;
+
+    std::mutex m_mutex;
+    std::condition_variable m_notFull;
+    std::condition_variable m_notEmpty;
+};
+
+} // namespace backer
+
+#endif
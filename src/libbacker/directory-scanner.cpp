@@ -0,0 +1,402 @@
+#include "directory-scanner.h"
+
+#include "file-index-reader.h"
+#include "worker-pool.h"
+
+#include "katla/core/posix-file.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace backer {
+
+    namespace fs = std::filesystem;
+
+    namespace {
+        constexpr size_t DirentBufferSize = 64 * 1024;
+
+        // Queued directories keep the descriptor they were opened with relative to their parent. Beyond this
+        // many, directories are opened by path once a worker gets to them.
+        constexpr int MaxQueuedDescriptors = 512;
+
+        constexpr int OpenDirectoryFlags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+
+        // Children of one directory, moved into the tree once the scan is done. While scanning the firstChild
+        // of a directory node holds the index of its own listing.
+        struct DirectoryListing
+        {
+            std::vector<FileNode> nodes;
+            std::string names;
+        };
+
+        struct DirectoryTask
+        {
+            FileNode* node { nullptr };
+            std::string path;
+            int fd { -1 };
+            bool isRoot { false };
+        };
+
+        struct WorkerQueue
+        {
+            std::mutex mutex;
+            std::deque<DirectoryTask> tasks;
+        };
+
+        struct DescriptorGuard
+        {
+            int fd;
+
+            ~DescriptorGuard() {
+                ::close(fd);
+            }
+        };
+
+        void applyStat(const struct stat& statResult, FileNode& entry)
+        {
+            entry.modificationTime = static_cast<int64_t>(statResult.st_mtim.tv_sec) * 1000000000 + statResult.st_mtim.tv_nsec;
+            entry.changeTime = static_cast<int64_t>(statResult.st_ctim.tv_sec) * 1000000000 + statResult.st_ctim.tv_nsec;
+            entry.device = statResult.st_dev;
+            entry.inode = statResult.st_ino;
+        }
+
+        bool isDotOrDotDot(const char* name)
+        {
+            return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+        }
+
+        std::string appendPath(const std::string& parent, const std::string& name)
+        {
+            if (!parent.empty() && parent.back() == '/') {
+                return parent + name;
+            }
+            return parent + "/" + name;
+        }
+
+        class ScanState {
+        public:
+            explicit ScanState(size_t nrOfWorkers)
+            {
+                for (size_t i = 0; i < nrOfWorkers; i++) {
+                    m_queues.push_back(std::make_unique<WorkerQueue>());
+                }
+            }
+
+            ~ScanState()
+            {
+                // Only left over when a worker failed
+                for (auto& queue : m_queues) {
+                    for (auto& task : queue->tasks) {
+                        if (task.fd >= 0) {
+                            ::close(task.fd);
+                        }
+                    }
+                }
+            }
+
+            void push(size_t workerIndex, DirectoryTask task)
+            {
+                m_pendingTasks++;
+
+                auto& queue = *m_queues[workerIndex];
+                std::lock_guard<std::mutex> guard(queue.mutex);
+                queue.tasks.push_back(std::move(task));
+            }
+
+            // Own work is taken newest first to stay depth first, stolen work oldest first since it tends to be
+            // closest to the root and so spawns the most work
+            bool pop(size_t workerIndex, DirectoryTask& task)
+            {
+                {
+                    auto& queue = *m_queues[workerIndex];
+                    std::lock_guard<std::mutex> guard(queue.mutex);
+                    if (!queue.tasks.empty()) {
+                        task = std::move(queue.tasks.back());
+                        queue.tasks.pop_back();
+                        return true;
+                    }
+                }
+
+                for (size_t i = 1; i < m_queues.size(); i++) {
+                    auto& queue = *m_queues[(workerIndex + i) % m_queues.size()];
+                    std::lock_guard<std::mutex> guard(queue.mutex);
+                    if (!queue.tasks.empty()) {
+                        task = std::move(queue.tasks.front());
+                        queue.tasks.pop_front();
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            void taskDone() {
+                m_pendingTasks--;
+            }
+
+            bool done() const {
+                return m_pendingTasks == 0 || m_failed;
+            }
+
+            void fail() {
+                m_failed = true;
+            }
+
+            // References stay valid while listings are added
+            DirectoryListing& addListing(uint32_t& listingIndex)
+            {
+                std::lock_guard<std::mutex> guard(m_listingsMutex);
+                listingIndex = static_cast<uint32_t>(m_listings.size());
+                return m_listings.emplace_back();
+            }
+
+            std::deque<DirectoryListing>& listings() {
+                return m_listings;
+            }
+
+            std::atomic<int> queuedDescriptors {0};
+
+        private:
+            std::mutex m_listingsMutex;
+            std::deque<DirectoryListing> m_listings;
+            std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+            std::atomic<size_t> m_pendingTasks {0};
+            std::atomic<bool> m_failed {false};
+        };
+
+        void scanDirectory(DirectoryTask task, size_t workerIndex, ScanState& state, std::vector<char>& buffer)
+        {
+            int fd = task.fd;
+            if (fd < 0) {
+                fd = ::open(task.path.c_str(), OpenDirectoryFlags | O_NOFOLLOW);
+                if (fd < 0) {
+                    throw std::runtime_error(katla::format("Failed opening directory {}: {}", task.path, std::strerror(errno)));
+                }
+            } else {
+                state.queuedDescriptors--;
+            }
+
+            DescriptorGuard fdGuard {fd};
+
+            uint32_t listingIndex = 0;
+            auto& listing = state.addListing(listingIndex);
+            task.node->firstChild = listingIndex;
+
+            while (true) {
+                long bytesRead = ::syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+                if (bytesRead < 0) {
+                    throw std::runtime_error(katla::format("Failed reading directory {}: {}", task.path, std::strerror(errno)));
+                }
+                if (bytesRead == 0) {
+                    break;
+                }
+
+                for (long offset = 0; offset < bytesRead;) {
+                    auto dirent = reinterpret_cast<const struct dirent64*>(buffer.data() + offset);
+                    offset += dirent->d_reclen;
+
+                    if (isDotOrDotDot(dirent->d_name)) {
+                        continue;
+                    }
+
+                    // A file-index in the root, along with its SQLite log files, is not part of the tree it indexes
+                    if (task.isRoot && FileIndexReader::isIndexFile(dirent->d_name)) {
+                        continue;
+                    }
+
+                    // Symlinks and special files are skipped without a stat when the file system reports the type
+                    if (dirent->d_type != DT_REG && dirent->d_type != DT_DIR && dirent->d_type != DT_UNKNOWN) {
+                        continue;
+                    }
+
+                    struct stat statResult {};
+                    if (::fstatat(fd, dirent->d_name, &statResult, AT_SYMLINK_NOFOLLOW) != 0) {
+                        // Removed while scanning
+                        if (errno == ENOENT) {
+                            continue;
+                        }
+                        throw std::runtime_error(katla::format("Failed reading stat of {}/{}: {}", task.path, dirent->d_name, std::strerror(errno)));
+                    }
+
+                    if (!S_ISREG(statResult.st_mode) && !S_ISDIR(statResult.st_mode)) {
+                        continue;
+                    }
+
+                    FileNode child {};
+                    child.nameOffset = listing.names.size();
+                    child.nameLength = static_cast<uint16_t>(std::strlen(dirent->d_name));
+                    listing.names.append(dirent->d_name, child.nameLength);
+                    applyStat(statResult, child);
+
+                    if (S_ISREG(statResult.st_mode)) {
+                        child.type = FileSystemEntryType::File;
+                        child.size = static_cast<uint64_t>(statResult.st_size);
+                        child.hardLinked = statResult.st_nlink > 1;
+                    } else {
+                        child.type = FileSystemEntryType::Dir;
+                    }
+
+                    listing.nodes.push_back(child);
+                }
+            }
+
+            // The listing is complete, so its nodes stay where they are for the tasks
+            for (auto& child : listing.nodes) {
+                if (child.type != FileSystemEntryType::Dir) {
+                    continue;
+                }
+
+                std::string name = listing.names.substr(child.nameOffset, child.nameLength);
+
+                int childFd = -1;
+                if (state.queuedDescriptors < MaxQueuedDescriptors) {
+                    childFd = ::openat(fd, name.c_str(), OpenDirectoryFlags | O_NOFOLLOW);
+                    if (childFd >= 0) {
+                        state.queuedDescriptors++;
+                    }
+                }
+
+                state.push(workerIndex, {&child, appendPath(task.path, name), childFd});
+            }
+        }
+
+        // Moves the listings into the tree, every listing ends up as one block of children
+        FileTree buildTree(FileNode root, const std::string& rootName, const std::string& rootPath, std::deque<DirectoryListing>& listings)
+        {
+            size_t nrOfNodes = 1;
+            size_t nameBytes = rootName.size();
+            for (auto& listing : listings) {
+                nrOfNodes += listing.nodes.size();
+                nameBytes += listing.names.size();
+            }
+
+            FileTree tree;
+            tree.reserve(nrOfNodes, nameBytes);
+            tree.setRootPath(rootPath);
+
+            uint32_t rootListing = root.firstChild;
+            root.firstChild = 0;
+            tree.addNode(root, rootName);
+
+            std::vector<std::pair<NodeIndex, uint32_t>> stack = {{FileTree::root(), rootListing}};
+            std::vector<std::pair<NodeIndex, uint32_t>> childDirs;
+            while (!stack.empty()) {
+                auto [parent, listingIndex] = stack.back();
+                stack.pop_back();
+
+                auto& listing = listings[listingIndex];
+                auto firstChild = static_cast<NodeIndex>(tree.size());
+
+                childDirs.clear();
+                for (auto child : listing.nodes) {
+                    uint32_t childListing = child.firstChild;
+                    child.parent = parent;
+                    child.firstChild = 0;
+
+                    auto childIndex = tree.addNode(child, std::string_view(listing.names).substr(child.nameOffset, child.nameLength));
+                    if (child.type == FileSystemEntryType::Dir) {
+                        childDirs.push_back({childIndex, childListing});
+                    }
+                }
+
+                tree.node(parent).firstChild = firstChild;
+                tree.node(parent).childCount = static_cast<uint32_t>(listing.nodes.size());
+
+                // Depth first, in listing order
+                stack.insert(stack.end(), childDirs.rbegin(), childDirs.rend());
+
+                std::vector<FileNode>().swap(listing.nodes);
+                std::string().swap(listing.names);
+            }
+
+            // Children come after their parent, so going backwards every directory is complete before it is added
+            for (NodeIndex i = static_cast<NodeIndex>(tree.size()) - 1; i > FileTree::root(); i--) {
+                auto& node = tree.node(i);
+                tree.node(node.parent).size += node.size;
+            }
+
+            return tree;
+        }
+    }
+
+    DirectoryScanner::DirectoryScanner(int jobs) :
+        m_jobs(jobs)
+    {
+    }
+
+    FileTree DirectoryScanner::scan(const std::string& path)
+    {
+        auto absolutePathResult = katla::PosixFile::absolutePath(path);
+        if (!absolutePathResult) {
+            throw std::runtime_error(absolutePathResult.error().message());
+        }
+
+        std::string rootPath = absolutePathResult.value();
+
+        FileNode root {};
+        root.type = FileSystemEntryType::Dir;
+
+        // The root itself may be a symlink to a directory
+        int rootFd = ::open(rootPath.c_str(), OpenDirectoryFlags);
+        if (rootFd < 0) {
+            throw std::runtime_error(katla::format("Failed opening directory {}: {}", rootPath, std::strerror(errno)));
+        }
+
+        struct stat statResult {};
+        if (::fstat(rootFd, &statResult) != 0) {
+            ::close(rootFd);
+            throw std::runtime_error(katla::format("Failed reading stat of {}: {}", rootPath, std::strerror(errno)));
+        }
+        applyStat(statResult, root);
+
+        WorkerPool workerPool(m_jobs);
+        ScanState state(workerPool.nrOfThreads());
+
+        state.queuedDescriptors++;
+        state.push(0, {&root, rootPath, rootFd, true});
+
+        workerPool.forEach(workerPool.nrOfThreads(), [&](size_t workerIndex) {
+            std::vector<char> buffer(DirentBufferSize);
+            int idleRounds = 0;
+
+            while (!state.done()) {
+                DirectoryTask task;
+                if (!state.pop(workerIndex, task)) {
+                    // Back off while other workers are still listing directories that may produce more work
+                    if (++idleRounds < 64) {
+                        std::this_thread::yield();
+                    } else {
+                        std::this_thread::sleep_for(std::chrono::microseconds(50));
+                    }
+                    continue;
+                }
+
+                idleRounds = 0;
+                try {
+                    scanDirectory(task, workerIndex, state, buffer);
+                } catch (...) {
+                    state.fail();
+                    throw;
+                }
+                state.taskDone();
+            }
+        });
+
+        return buildTree(root, fs::path(path).filename().string(), rootPath, state.listings());
+    }
+
+} // namespace backer
@@ -0,0 +1,46 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIRECTORY_SCANNER_H
+#define DIRECTORY_SCANNER_H
+
+#include "katla/core/core.h"
+
+#include "file-tree.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace backer {
+
+// Walks a directory tree with getdents64 and fstatat relative to the directory descriptor. Directories are
+// spread over a pool of workers that steal from each other, paths are built by appending to the parent path.
+// Symlinks, special files and a file-index in the root are skipped.
+class DirectoryScanner {
+public:
+    explicit DirectoryScanner(int jobs = 0);
+
+    // Children of a directory keep the order the file system lists them in
+    FileTree scan(const std::string& path);
+
+private:
+    int m_jobs;
+};
+
+} // namespace backer
+
+#endif
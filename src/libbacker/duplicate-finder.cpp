@@ -0,0 +1,535 @@
+#include "duplicate-finder.h"
+
+#include "backer.h"
+#include "bounded-queue.h"
+#include "file-descriptor.h"
+#include "read-scheduler.h"
+#include "worker-pool.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace backer {
+
+    namespace {
+        // Reads up to count bytes at offset, only returns less at the end of the file
+        size_t readAt(int fd, std::byte* buffer, size_t count, uint64_t offset, const std::string& path)
+        {
+            size_t bytesRead = 0;
+            while (bytesRead < count) {
+                ssize_t readResult = ::pread(fd, buffer + bytesRead, count - bytesRead, offset + bytesRead);
+                if (readResult < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (readResult < 0) {
+                    throw std::runtime_error(katla::format("Failed reading {}: {}", path, std::strerror(errno)));
+                }
+                if (readResult == 0) {
+                    break;
+                }
+                bytesRead += readResult;
+            }
+
+            return bytesRead;
+        }
+
+        struct FreeDeleter
+        {
+            void operator()(std::byte* data) const {
+                std::free(data);
+            }
+        };
+
+        constexpr size_t BufferAlignment = 4096;
+
+        std::unique_ptr<std::byte, FreeDeleter> allocateAligned(size_t size)
+        {
+            auto data = static_cast<std::byte*>(std::aligned_alloc(BufferAlignment, size));
+            if (!data) {
+                throw std::bad_alloc();
+            }
+            return std::unique_ptr<std::byte, FreeDeleter>(data);
+        }
+
+        // Reads a file block by block on its own thread into two buffers, so the next block is already being
+        // read while the caller compares the current one
+        class BlockReader
+        {
+        public:
+            struct Block
+            {
+                std::byte* data;
+                size_t size;
+                std::exception_ptr error;
+            };
+
+            BlockReader(const std::string& path, size_t blockSize) :
+                m_path(path),
+                m_file(path, O_RDONLY),
+                m_blockSize(blockSize),
+                m_free(2),
+                m_filled(2)
+            {
+                ::posix_fadvise(m_file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+                for (auto& buffer : m_buffers) {
+                    buffer = allocateAligned(blockSize);
+                    m_free.push(buffer.get());
+                }
+
+                m_thread = std::thread([this]() {
+                    run();
+                });
+            }
+
+            ~BlockReader() {
+                m_free.close();
+                m_filled.close();
+                m_thread.join();
+            }
+
+            BlockReader(const BlockReader&) = delete;
+            BlockReader& operator=(const BlockReader&) = delete;
+
+            // Blocks until the next block is read, a block shorter than the block size is the last one
+            Block next()
+            {
+                auto block = m_filled.pop();
+                if (!block) {
+                    throw std::runtime_error(katla::format("Reading {} stopped early", m_path));
+                }
+                if (block->error) {
+                    std::rethrow_exception(block->error);
+                }
+                return *block;
+            }
+
+            // Hands the buffer of a block back to the reader thread
+            void release(const Block& block)
+            {
+                m_free.push(block.data);
+            }
+
+        private:
+            void run()
+            {
+                uint64_t offset = 0;
+                while (auto buffer = m_free.pop()) {
+                    Block block { *buffer, 0, nullptr };
+                    try {
+                        block.size = readAt(m_file.fd, block.data, m_blockSize, offset, m_path);
+                    } catch (...) {
+                        block.error = std::current_exception();
+                    }
+                    offset += block.size;
+
+                    if (!m_filled.push(block) || block.error || block.size < m_blockSize) {
+                        return;
+                    }
+                }
+            }
+
+            std::string m_path;
+            FileDescriptor m_file;
+            size_t m_blockSize;
+            std::unique_ptr<std::byte, FreeDeleter> m_buffers[2];
+            BoundedQueue<std::byte*> m_free;
+            BoundedQueue<Block> m_filled;
+            std::thread m_thread;
+        };
+    }
+
+    DuplicateFinder::DuplicateFinder(DuplicateFinderOptions options) :
+        m_options(options)
+    {
+    }
+
+    std::vector<std::vector<FileSystemEntry>> DuplicateFinder::group(std::vector<FileSystemEntry> files)
+    {
+        m_statistics = {};
+        m_hardLinkGroups.clear();
+        for (auto& file : files) {
+            m_statistics.totalBytes += file.size;
+        }
+
+        // Only the first path of a hard linked inode goes through the stages, the other paths join its group at the end
+        std::unordered_map<InodeId, size_t, InodeIdHash> firstLinks;
+        std::unordered_map<size_t, std::vector<FileSystemEntry>> hardLinks;
+        size_t nrOfFiles = 0;
+        for (size_t i = 0; i < files.size(); i++) {
+            if (files[i].hardLinked) {
+                auto [it, inserted] = firstLinks.emplace(files[i].inodeId(), nrOfFiles);
+                if (!inserted) {
+                    m_statistics.hardLinkBytesAvoided += files[i].size;
+                    hardLinks[it->second].push_back(std::move(files[i]));
+                    continue;
+                }
+            }
+
+            if (i != nrOfFiles) {
+                files[nrOfFiles] = std::move(files[i]);
+            }
+            nrOfFiles++;
+        }
+        files.resize(nrOfFiles);
+
+        std::vector<Group> groups;
+
+        auto candidates = groupBySize(files, groups);
+        candidates = groupBySample(files, candidates, groups);
+        candidates = groupByHash(files, candidates);
+
+        groups.insert(groups.end(), candidates.begin(), candidates.end());
+
+        std::vector<std::vector<FileSystemEntry>> result;
+        result.reserve(groups.size());
+        for (auto& group : groups) {
+            std::vector<FileSystemEntry> entries;
+            entries.reserve(group.size());
+            for (auto idx : group) {
+                auto links = hardLinks.find(idx);
+                if (links != hardLinks.end()) {
+                    for (auto& link : links->second) {
+                        link.hash = files[idx].hash;
+                    }
+
+                    std::vector<FileSystemEntry> hardLinkGroup = {files[idx]};
+                    hardLinkGroup.insert(hardLinkGroup.end(), links->second.begin(), links->second.end());
+                    m_hardLinkGroups.push_back(std::move(hardLinkGroup));
+
+                    entries.insert(entries.end(), std::make_move_iterator(links->second.begin()), std::make_move_iterator(links->second.end()));
+                }
+
+                entries.push_back(std::move(files[idx]));
+            }
+            result.push_back(std::move(entries));
+        }
+
+        return result;
+    }
+
+    size_t DuplicateFinder::nrOfInodes(const std::vector<FileSystemEntry>& group)
+    {
+        std::unordered_set<InodeId, InodeIdHash> inodes;
+        for (auto& file : group) {
+            inodes.insert(file.inodeId());
+        }
+        return inodes.size();
+    }
+
+    std::vector<DuplicateFinder::Group> DuplicateFinder::groupBySize(std::vector<FileSystemEntry>& files, std::vector<Group>& uniqueGroups)
+    {
+        std::map<uint64_t, Group> sizeGroups;
+        for (size_t i = 0; i < files.size(); i++) {
+            sizeGroups[files[i].size].push_back(i);
+        }
+
+        std::vector<Group> candidates;
+        for (auto& pair : sizeGroups) {
+            // Empty files are always identical
+            if (pair.second.size() < 2 || pair.first == 0) {
+                m_statistics.sizeStageBytesAvoided += pair.first * pair.second.size();
+
+                // They are never read, but get the hash of empty content like every other reported file
+                if (pair.first == 0) {
+                    auto emptyHash = Hasher::toDigest(Hasher::create(m_options.hashAlgorithm)->final());
+                    for (auto idx : pair.second) {
+                        files[idx].hash = emptyHash;
+                    }
+                    uniqueGroups.push_back(std::move(pair.second));
+                    continue;
+                }
+
+                for (auto idx : pair.second) {
+                    uniqueGroups.push_back({idx});
+                }
+                continue;
+            }
+
+            candidates.push_back(std::move(pair.second));
+        }
+
+        return candidates;
+    }
+
+    std::vector<DuplicateFinder::Group> DuplicateFinder::groupBySample(const std::vector<FileSystemEntry>& files, const std::vector<Group>& candidates, std::vector<Group>& uniqueGroups)
+    {
+        // Small files are covered completely by their samples, those go straight to the full hash stage
+        std::vector<size_t> filesToSample;
+        for (auto& group : candidates) {
+            for (auto idx : group) {
+                if (files[idx].size > 3 * m_options.sampleSize) {
+                    filesToSample.push_back(idx);
+                }
+            }
+        }
+
+        std::vector<std::vector<std::byte>> sampleHashes(files.size());
+
+        orderReads(files, filesToSample);
+
+        WorkerPool workerPool(readJobs(files, filesToSample));
+        workerPool.forEach(filesToSample.size(), [&](size_t i) {
+            auto& file = files[filesToSample[i]];
+            sampleHashes[filesToSample[i]] = sampleHash(file.absolutePath, file.size, m_options.sampleSize, m_options.hashAlgorithm);
+        });
+
+        m_statistics.sampleStageBytesRead += filesToSample.size() * 3 * m_options.sampleSize;
+
+        std::vector<Group> result;
+        for (auto& group : candidates) {
+            std::map<std::vector<std::byte>, Group> sampleGroups;
+            for (auto idx : group) {
+                sampleGroups[sampleHashes[idx]].push_back(idx);
+            }
+
+            for (auto& pair : sampleGroups) {
+                if (pair.second.size() > 1) {
+                    result.push_back(std::move(pair.second));
+                    continue;
+                }
+
+                auto idx = pair.second.front();
+                m_statistics.sampleStageBytesAvoided += files[idx].size - 3 * m_options.sampleSize;
+                uniqueGroups.push_back({idx});
+            }
+        }
+
+        return result;
+    }
+
+    std::vector<DuplicateFinder::Group> DuplicateFinder::groupByHash(std::vector<FileSystemEntry>& files, const std::vector<Group>& candidates)
+    {
+        // Pairs are compared block by block so reading stops at the first difference
+        std::vector<const Group*> pairs;
+        std::vector<size_t> filesToHash;
+        for (auto& group : candidates) {
+            if (compareInLockstep(files, group)) {
+                pairs.push_back(&group);
+                continue;
+            }
+            filesToHash.insert(filesToHash.end(), group.begin(), group.end());
+        }
+
+        std::atomic<size_t> fileNr {0};
+        size_t totalCount = filesToHash.size() + pairs.size();
+
+        std::vector<char> pairIdentical(pairs.size(), false);
+        std::atomic<uint64_t> lockstepBytesRead {0};
+
+        std::vector<size_t> pairFiles;
+        for (auto pair : pairs) {
+            pairFiles.insert(pairFiles.end(), pair->begin(), pair->end());
+        }
+
+        WorkerPool workerPool(readJobs(files, pairFiles));
+        workerPool.forEach(pairs.size(), [&](size_t i) {
+            auto& file = files[pairs[i]->at(0)];
+            auto& otherFile = files[pairs[i]->at(1)];
+            katla::print(stdout, "[{}/{}] {} <> {}\n", ++fileNr, totalCount, file.absolutePath, otherFile.absolutePath);
+
+            uint64_t bytesRead = 0;
+            auto hash = compareAndHash(file.absolutePath, otherFile.absolutePath, m_options.lockstepBlockSize, m_options.hashAlgorithm, bytesRead);
+            lockstepBytesRead += bytesRead;
+
+            if (hash) {
+                file.hash = Hasher::toDigest(*hash);
+                otherFile.hash = file.hash;
+                pairIdentical[i] = true;
+            }
+        });
+
+        orderReads(files, filesToHash);
+
+        std::vector<FileHashRequest> requests;
+        requests.reserve(filesToHash.size());
+        for (auto idx : filesToHash) {
+            requests.push_back({files[idx].absolutePath, files[idx].size, files[idx].device});
+        }
+
+        auto fileHashReader = FileHashReader::create(m_options.jobs, m_options.io, m_options.hashAlgorithm);
+        auto hashes = fileHashReader->hash(requests, [&](size_t i, const std::vector<std::byte>&) {
+            katla::print(stdout, "[{}/{}] {}\n", ++fileNr, totalCount, files[filesToHash[i]].absolutePath);
+        });
+
+        for (size_t i = 0; i < filesToHash.size(); i++) {
+            files[filesToHash[i]].hash = Hasher::toDigest(hashes[i]);
+        }
+        fileHashReader->printStatistics();
+
+        std::vector<Group> result;
+
+        uint64_t pairBytes = 0;
+        for (size_t i = 0; i < pairs.size(); i++) {
+            auto& pair = *pairs[i];
+            pairBytes += files[pair[0]].size + files[pair[1]].size;
+
+            if (pairIdentical[i]) {
+                result.push_back(pair);
+            } else {
+                result.push_back({pair[0]});
+                result.push_back({pair[1]});
+            }
+        }
+
+        m_statistics.lockstepBytesRead += lockstepBytesRead;
+        if (pairBytes > lockstepBytesRead) {
+            m_statistics.lockstepBytesAvoided += pairBytes - lockstepBytesRead;
+        }
+
+        for (auto& group : candidates) {
+            if (compareInLockstep(files, group)) {
+                continue;
+            }
+
+            std::map<Digest, Group> hashGroups;
+            for (auto idx : group) {
+                m_statistics.fullHashBytesRead += files[idx].size;
+                hashGroups[files[idx].hash].push_back(idx);
+            }
+
+            for (auto& pair : hashGroups) {
+                result.push_back(std::move(pair.second));
+            }
+        }
+
+        return result;
+    }
+
+    bool DuplicateFinder::compareInLockstep(const std::vector<FileSystemEntry>& files, const Group& group) const
+    {
+        // Cached hashes make comparing pairs free, and hashing them fills the cache for the next run
+        if (!m_options.lockstepCompare || m_options.io.hashCache || group.size() != 2) {
+            return false;
+        }
+
+        // Small files are cheaper to hash in a multi-buffer batch than to compare
+        return !FileHashReader::useMultiBuffer(m_options.io, m_options.hashAlgorithm, files[group.front()].size);
+    }
+
+    std::vector<std::byte> DuplicateFinder::sampleHash(const std::string& path, uint64_t size, size_t sampleSize, HashAlgorithm algorithm)
+    {
+        FileDescriptor file(path, O_RDONLY);
+
+        auto hasher = Hasher::create(algorithm);
+
+        std::vector<std::byte> readBuffer(sampleSize);
+
+        uint64_t offsets[] = {0, size / 2 - sampleSize / 2, size - sampleSize};
+        for (auto offset : offsets) {
+            size_t bytesRead = readAt(file.fd, readBuffer.data(), sampleSize, offset, path);
+            hasher->update(readBuffer.data(), bytesRead);
+        }
+
+        return hasher->final();
+    }
+
+    std::optional<std::vector<std::byte>> DuplicateFinder::compareAndHash(const std::string& path,
+                                                                          const std::string& otherPath,
+                                                                          size_t blockSize,
+                                                                          HashAlgorithm algorithm,
+                                                                          uint64_t& bytesRead)
+    {
+        blockSize = std::max(BufferAlignment, (blockSize + BufferAlignment - 1) / BufferAlignment * BufferAlignment);
+
+        BlockReader reader(path, blockSize);
+        BlockReader otherReader(otherPath, blockSize);
+
+        auto hasher = Hasher::create(algorithm);
+
+        while (true) {
+            auto block = reader.next();
+            auto otherBlock = otherReader.next();
+
+            bytesRead += block.size + otherBlock.size;
+
+            if (block.size != otherBlock.size || std::memcmp(block.data, otherBlock.data, block.size) != 0) {
+                return std::nullopt;
+            }
+
+            hasher->update(block.data, block.size);
+
+            bool lastBlock = block.size < blockSize;
+            reader.release(block);
+            otherReader.release(otherBlock);
+
+            if (lastBlock) {
+                break;
+            }
+        }
+
+        return hasher->final();
+    }
+
+    void DuplicateFinder::orderReads(const std::vector<FileSystemEntry>& files, std::vector<size_t>& indices) const
+    {
+        if (m_options.io.readOrder == ReadOrder::Scan) {
+            return;
+        }
+
+        std::vector<InodeId> inodes;
+        inodes.reserve(indices.size());
+        for (auto idx : indices) {
+            inodes.push_back(files[idx].inodeId());
+        }
+
+        auto order = ReadScheduler::schedule(m_options.io.readOrder, m_options.jobs, inodes, [&](size_t i) {
+            return files[indices[i]].absolutePath;
+        });
+
+        std::vector<size_t> orderedIndices;
+        orderedIndices.reserve(indices.size());
+        for (auto i : order) {
+            orderedIndices.push_back(indices[i]);
+        }
+        indices = std::move(orderedIndices);
+    }
+
+    int DuplicateFinder::readJobs(const std::vector<FileSystemEntry>& files, const std::vector<size_t>& indices) const
+    {
+        int jobs = m_options.jobs > 0 ? m_options.jobs : WorkerPool::defaultNrOfThreads();
+
+        std::unordered_set<uint64_t> devices;
+        for (auto idx : indices) {
+            devices.insert(files[idx].device);
+        }
+
+        for (auto device : devices) {
+            if (ReadScheduler::isRotationalDevice(device)) {
+                return std::min(jobs, std::max(1, m_options.io.rotationalJobs));
+            }
+        }
+
+        return jobs;
+    }
+
+    void DuplicateFinder::printStatistics() const
+    {
+        katla::print(stdout, "Total size of files: {} bytes\n", m_statistics.totalBytes);
+        katla::print(stdout, "Size stage avoided reading: {} bytes\n", m_statistics.sizeStageBytesAvoided);
+        katla::print(stdout,
+                     "Sample stage read: {} bytes, avoided reading: {} bytes\n",
+                     m_statistics.sampleStageBytesRead,
+                     m_statistics.sampleStageBytesAvoided);
+        katla::print(stdout, "Full hash stage read: {} bytes\n", m_statistics.fullHashBytesRead);
+        katla::print(stdout,
+                     "Lockstep compare read: {} bytes, avoided reading: {} bytes\n",
+                     m_statistics.lockstepBytesRead,
+                     m_statistics.lockstepBytesAvoided);
+        katla::print(stdout, "Hard links avoided reading: {} bytes\n", m_statistics.hardLinkBytesAvoided);
+    }
+
+} // namespace backer
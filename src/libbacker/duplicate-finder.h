@@ -0,0 +1,115 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DUPLICATE_FINDER_H
+#define DUPLICATE_FINDER_H
+
+#include "katla/core/core.h"
+
+#include "file-data.h"
+#include "file-hash-reader.h"
+#include "hasher.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace backer {
+
+struct DuplicateFinderOptions
+{
+    int jobs { 0 }; // Number of hashing threads, 0 uses all hardware threads
+    size_t sampleSize { 4096 }; // Bytes read at the head, middle and tail of a file in the sample stage
+    bool lockstepCompare { true }; // Compare groups of two files block by block instead of hashing both
+    size_t lockstepBlockSize { 1 << 20 };
+    IoOptions io;
+    HashAlgorithm hashAlgorithm { HashAlgorithm::Sha256 };
+};
+
+struct DuplicateFinderStatistics
+{
+    uint64_t totalBytes { 0 };
+    uint64_t sizeStageBytesAvoided { 0 }; // Files with a unique size are never read
+    uint64_t sampleStageBytesRead { 0 };
+    uint64_t sampleStageBytesAvoided { 0 }; // Remainder of files ruled out by their sample
+    uint64_t fullHashBytesRead { 0 };
+    uint64_t lockstepBytesRead { 0 };
+    uint64_t lockstepBytesAvoided { 0 }; // Remainder of file pairs that differed before their end
+    uint64_t hardLinkBytesAvoided { 0 }; // Paths to an inode that was already read through another path
+};
+
+// Groups files with identical content using increasingly expensive stages: first by size, then by a
+// hash of a few samples of the file and only then by a full hash of the files that still collide.
+class DuplicateFinder {
+public:
+    explicit DuplicateFinder(DuplicateFinderOptions options = {});
+
+    // Returns groups of files with identical content, files without duplicates end up in a group of their own.
+    // The hash of a file is only filled in when it had to be fully hashed. Hard links to the same inode are read
+    // once and always end up in the same group.
+    std::vector<std::vector<FileSystemEntry>> group(std::vector<FileSystemEntry> files);
+
+    // Paths linking to the same inode found by the last call to group
+    const std::vector<std::vector<FileSystemEntry>>& hardLinkGroups() const {
+        return m_hardLinkGroups;
+    }
+
+    // Number of distinct inodes in a group, a group of hard links alone holds no duplicate content
+    static size_t nrOfInodes(const std::vector<FileSystemEntry>& group);
+
+    const DuplicateFinderStatistics& statistics() const {
+        return m_statistics;
+    }
+
+    void printStatistics() const;
+
+    static std::vector<std::byte> sampleHash(const std::string& path, uint64_t size, size_t sampleSize, HashAlgorithm algorithm);
+
+    // Reads both files in parallel, each reader a block ahead of the comparison, and stops at the first differing
+    // block. Returns the hash of the content when both files are identical. The number of bytes read from both
+    // files is added to bytesRead.
+    static std::optional<std::vector<std::byte>> compareAndHash(const std::string& path,
+                                                                const std::string& otherPath,
+                                                                size_t blockSize,
+                                                                HashAlgorithm algorithm,
+                                                                uint64_t& bytesRead);
+
+private:
+    using Group = std::vector<size_t>;
+
+    std::vector<Group> groupBySize(std::vector<FileSystemEntry>& files, std::vector<Group>& uniqueGroups);
+    std::vector<Group> groupBySample(const std::vector<FileSystemEntry>& files, const std::vector<Group>& candidates, std::vector<Group>& uniqueGroups);
+    std::vector<Group> groupByHash(std::vector<FileSystemEntry>& files, const std::vector<Group>& candidates);
+
+    bool compareInLockstep(const std::vector<FileSystemEntry>& files, const Group& group) const;
+
+    // Sorts the files by where they are stored when the read order asks for it, see ReadScheduler
+    void orderReads(const std::vector<FileSystemEntry>& files, std::vector<size_t>& indices) const;
+
+    // Threads reading the files outside of a FileHashReader. As soon as one of the files is on a spinning disk all of
+    // them are read with IoOptions::rotationalJobs threads, a mix of devices is not split up like the readers do.
+    int readJobs(const std::vector<FileSystemEntry>& files, const std::vector<size_t>& indices) const;
+
+    DuplicateFinderOptions m_options;
+    DuplicateFinderStatistics m_statistics;
+    std::vector<std::vector<FileSystemEntry>> m_hardLinkGroups;
+};
+
+} // namespace backer
+
+#endif
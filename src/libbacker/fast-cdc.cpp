@@ -0,0 +1,232 @@
+#include "fast-cdc.h"
+
+#include "katla/core/posix-file.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <limits>
+
+namespace backer {
+
+    namespace {
+        constexpr size_t WindowSize = 64;
+        constexpr size_t Lanes = 4; // Unrolled in findCut
+        constexpr size_t LaneLength = 1024;
+        constexpr size_t NoCut = std::numeric_limits<size_t>::max();
+
+        // Random values for every byte, generated with splitmix64 so the table never changes between builds
+        constexpr std::array<uint64_t, 256> createGearTable()
+        {
+            std::array<uint64_t, 256> table {};
+            uint64_t state = 0x6261636b65722d31ull;
+            for (auto& value : table) {
+                state += 0x9e3779b97f4a7c15ull;
+                uint64_t z = state;
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+                value = z ^ (z >> 31);
+            }
+            return table;
+        }
+
+        constexpr std::array<uint64_t, 256> Gear = createGearTable();
+
+        inline uint64_t roll(uint64_t hash, std::byte value)
+        {
+            return (hash << 1) + Gear[static_cast<uint8_t>(value)];
+        }
+
+        // The low bits of the hash only depend on the last few bytes, masks use the high bits
+        uint64_t highBits(int count)
+        {
+            return count <= 0 ? 0 : ~uint64_t(0) << (64 - count);
+        }
+    }
+
+    FastCdc::FastCdc(ChunkingOptions options) :
+        m_options(options)
+    {
+        m_options.minSize = std::max(m_options.minSize, WindowSize);
+        m_options.averageSize = std::max(m_options.averageSize, m_options.minSize);
+        m_options.maxSize = std::max(m_options.maxSize, m_options.averageSize);
+
+        int averageBits = 0;
+        while ((size_t(2) << averageBits) <= m_options.averageSize) {
+            averageBits++;
+        }
+        m_options.averageSize = size_t(1) << averageBits;
+
+        m_strictMask = highBits(averageBits + 2);
+        m_looseMask = highBits(averageBits - 2);
+    }
+
+    std::string FastCdc::description() const
+    {
+        return katla::format("fastcdc-gear1 {} {} {}", m_options.minSize, m_options.averageSize, m_options.maxSize);
+    }
+
+    size_t FastCdc::nextChunkSerial(const std::byte* data, size_t size) const
+    {
+        if (size <= m_options.minSize) {
+            return size;
+        }
+
+        size_t end = std::min(size, m_options.maxSize);
+        uint64_t hash = 0;
+        for (size_t i = m_options.minSize - WindowSize; i < end; i++) {
+            hash = roll(hash, data[i]);
+            if (i < m_options.minSize) {
+                continue;
+            }
+
+            auto mask = (i < m_options.averageSize) ? m_strictMask : m_looseMask;
+            if ((hash & mask) == 0) {
+                return i + 1;
+            }
+        }
+
+        return end;
+    }
+
+    size_t FastCdc::nextChunk(const std::byte* data, size_t size) const
+    {
+        if (size <= m_options.minSize) {
+            return size;
+        }
+
+        // Each mask gets a stretch of its own, so the inner loop never has to choose
+        size_t end = std::min(size, m_options.maxSize);
+        size_t normalEnd = std::min(end, std::max(m_options.averageSize, m_options.minSize));
+
+        size_t cut = findCut(data, m_options.minSize, normalEnd, m_strictMask);
+        if (cut == NoCut) {
+            cut = findCut(data, normalEnd, end, m_looseMask);
+        }
+
+        return cut == NoCut ? end : cut + 1;
+    }
+
+    size_t FastCdc::findCut(const std::byte* data, size_t begin, size_t end, uint64_t mask) const
+    {
+        // Every lane hashes its own stretch of LaneLength bytes, starting with the window before it, so the lanes
+        // are independent chains the processor runs side by side. Only a block with a hit is searched again one
+        // byte at a time to find the earliest cut.
+        size_t position = begin;
+        for (; position + Lanes * LaneLength <= end; position += Lanes * LaneLength) {
+            const std::byte* lane0 = data + position;
+            const std::byte* lane1 = lane0 + LaneLength;
+            const std::byte* lane2 = lane1 + LaneLength;
+            const std::byte* lane3 = lane2 + LaneLength;
+
+            uint64_t hash0 = 0;
+            uint64_t hash1 = 0;
+            uint64_t hash2 = 0;
+            uint64_t hash3 = 0;
+            for (ptrdiff_t i = -static_cast<ptrdiff_t>(WindowSize); i < 0; i++) {
+                hash0 = roll(hash0, lane0[i]);
+                hash1 = roll(hash1, lane1[i]);
+                hash2 = roll(hash2, lane2[i]);
+                hash3 = roll(hash3, lane3[i]);
+            }
+
+            bool hit = false;
+            for (size_t i = 0; i < LaneLength; i++) {
+                hash0 = roll(hash0, lane0[i]);
+                hash1 = roll(hash1, lane1[i]);
+                hash2 = roll(hash2, lane2[i]);
+                hash3 = roll(hash3, lane3[i]);
+                hit |= ((hash0 & mask) == 0) | ((hash1 & mask) == 0) | ((hash2 & mask) == 0) | ((hash3 & mask) == 0);
+            }
+
+            if (hit) {
+                return findCutSerial(data, position, position + Lanes * LaneLength, mask);
+            }
+        }
+
+        // The remainder is too short to split over the lanes
+        return findCutSerial(data, position, end, mask);
+    }
+
+    size_t FastCdc::findCutSerial(const std::byte* data, size_t begin, size_t end, uint64_t mask) const
+    {
+        uint64_t hash = 0;
+        for (size_t i = begin - WindowSize; i < begin; i++) {
+            hash = roll(hash, data[i]);
+        }
+
+        for (size_t i = begin; i < end; i++) {
+            hash = roll(hash, data[i]);
+            if ((hash & mask) == 0) {
+                return i;
+            }
+        }
+
+        return NoCut;
+    }
+
+    std::vector<FileChunk> FastCdc::chunkFile(const std::string& path, HashAlgorithm algorithm, Digest& fileHash) const
+    {
+        katla::PosixFile file;
+        auto openResult = file.open(path, katla::PosixFile::OpenFlags::ReadOnly);
+        if (!openResult) {
+            throw std::runtime_error(katla::format("Failed opening file {} for chunking: {}", path, openResult.error().message()));
+        }
+
+        auto fileHasher = Hasher::create(algorithm);
+        std::vector<FileChunk> chunks;
+
+        // The buffer always holds a full chunk when the end of the file is not reached yet. It starts out one byte
+        // larger than the file, so the end is found with the first reads, and only grows when the file did.
+        const size_t maxBufferSize = 4 * m_options.maxSize;
+        auto fileSizeResult = file.size();
+        size_t bufferSize = fileSizeResult ? std::min<uint64_t>(fileSizeResult.value() + 1, maxBufferSize) : maxBufferSize;
+        std::vector<std::byte> buffer(bufferSize);
+        size_t begin = 0;
+        size_t end = 0;
+        bool endOfFile = false;
+        uint64_t offset = 0;
+
+        while (true) {
+            if (!endOfFile && end - begin < m_options.maxSize) {
+                std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+                end -= begin;
+                begin = 0;
+
+                if (end == buffer.size() && buffer.size() < maxBufferSize) {
+                    buffer.resize(maxBufferSize);
+                }
+
+                while (end < buffer.size()) {
+                    auto readResult = file.read(gsl::span<std::byte>(buffer.data() + end, buffer.size() - end));
+                    if (!readResult) {
+                        throw std::runtime_error(katla::format("Failed reading file {}!", path));
+                    }
+                    if (readResult.value() == 0) {
+                        endOfFile = true;
+                        break;
+                    }
+                    end += readResult.value();
+                }
+            }
+
+            if (begin == end) {
+                break;
+            }
+
+            size_t length = nextChunk(buffer.data() + begin, end - begin);
+
+            auto chunkHasher = Hasher::create(algorithm);
+            chunkHasher->update(buffer.data() + begin, length);
+            fileHasher->update(buffer.data() + begin, length);
+
+            chunks.push_back({offset, static_cast<uint32_t>(length), Hasher::toDigest(chunkHasher->final())});
+            offset += length;
+            begin += length;
+        }
+
+        fileHash = Hasher::toDigest(fileHasher->final());
+        return chunks;
+    }
+
+} // namespace backer
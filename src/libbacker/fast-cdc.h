@@ -0,0 +1,83 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FAST_CDC_H
+#define FAST_CDC_H
+
+#include "katla/core/core.h"
+
+#include "hasher.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace backer {
+
+struct ChunkingOptions
+{
+    size_t minSize { 16 * 1024 }; // At least 64 bytes, the window of the rolling hash
+    size_t averageSize { 64 * 1024 }; // Rounded down to a power of two
+    size_t maxSize { 256 * 1024 };
+};
+
+struct FileChunk
+{
+    uint64_t offset { 0 };
+    uint32_t length { 0 };
+    Digest hash {};
+};
+
+// Content-defined chunking with a gear hash, as in FastCDC. A chunk ends where the rolling hash of the last 64
+// bytes has all bits of a mask cleared, so an insertion only moves the boundaries close to it. Normalized chunking
+// uses a stricter mask before the average size and a looser one after it, which keeps chunk sizes close to the
+// average.
+class FastCdc {
+public:
+    explicit FastCdc(ChunkingOptions options = {});
+
+    const ChunkingOptions& options() const {
+        return m_options;
+    }
+
+    // Identifies the gear table and sizes, chunks of indexes with a different description never match
+    std::string description() const;
+
+    // Length of the chunk at the start of data, data ends the input when it is shorter than maxSize.
+    // The hash only depends on the last 64 bytes, so it is computed for several independent stretches of the
+    // data at once, which keeps more of the work in flight than a single chain of shifts and adds.
+    size_t nextChunk(const std::byte* data, size_t size) const;
+
+    // Same boundaries as nextChunk, one byte at a time
+    size_t nextChunkSerial(const std::byte* data, size_t size) const;
+
+    // Reads a file once, returning its chunks and the hash of the whole file
+    std::vector<FileChunk> chunkFile(const std::string& path, HashAlgorithm algorithm, Digest& fileHash) const;
+
+private:
+    // Position of the last byte of the first cut in [begin, end) of data, begin is at least the window size
+    size_t findCut(const std::byte* data, size_t begin, size_t end, uint64_t mask) const;
+    size_t findCutSerial(const std::byte* data, size_t begin, size_t end, uint64_t mask) const;
+
+    ChunkingOptions m_options;
+    uint64_t m_strictMask { 0 };
+    uint64_t m_looseMask { 0 };
+};
+
+} // namespace backer
+
+#endif
@@ -0,0 +1,144 @@
+#include "file-chunk-report.h"
+
+#include "file-index-reader.h"
+
+#include <unordered_map>
+#include <unordered_set>
+
+namespace backer {
+
+    namespace {
+        constexpr size_t MaxNrOfIndexes = 64;
+
+        struct ChunkUse
+        {
+            uint32_t length { 0 };
+            uint64_t indexes { 0 }; // Bit per index holding the chunk
+            size_t firstIndex { 0 };
+            int64_t firstFile { 0 };
+            bool inSeveralFiles { false };
+        };
+
+        FileIndexReader openChunked(const std::string& indexPath) {
+            auto reader = FileIndexReader::open(indexPath);
+            if (!reader.isComplete()) {
+                throw std::runtime_error(katla::format("File-index {} is incomplete, create it again before reporting its chunks", indexPath));
+            }
+            if (!reader.chunking()) {
+                throw std::runtime_error(katla::format("File-index {} has no chunks, create it with chunking", indexPath));
+            }
+
+            return reader;
+        }
+
+        uint64_t percentage(uint64_t part, uint64_t total) {
+            return total == 0 ? 0 : part * 100 / total;
+        }
+    }
+
+    FileChunkReport FileChunkReporter::create(const std::vector<std::string>& indexPaths) {
+        if (indexPaths.empty() || indexPaths.size() > MaxNrOfIndexes) {
+            throw std::runtime_error(katla::format("Chunk report needs 1 to {} indexes", MaxNrOfIndexes));
+        }
+
+        std::vector<FileIndexReader> readers;
+        for (auto& path : indexPaths) {
+            readers.push_back(openChunked(path));
+
+            auto& first = readers.front();
+            auto& reader = readers.back();
+            if (reader.hashAlgorithm() != first.hashAlgorithm() || reader.chunking() != first.chunking()) {
+                throw std::runtime_error(katla::format("File-index {} uses {} chunks of {} and {} uses {} chunks of {}, their chunks can't be compared",
+                                                       indexPaths.front(), first.hashAlgorithm(), first.chunking().value(),
+                                                       path, reader.hashAlgorithm(), reader.chunking().value()));
+            }
+        }
+
+        FileChunkReport report;
+        report.indexes.resize(indexPaths.size());
+
+        // Only distinct chunks are kept in memory, the chunks of the indexes are streamed twice
+        std::unordered_map<Digest, ChunkUse, DigestHash> chunks;
+        for (size_t i = 0; i < readers.size(); i++) {
+            auto& index = report.indexes[i];
+            index.path = indexPaths[i];
+
+            std::unordered_set<int64_t> files;
+            readers[i].readChunks([&](int64_t fileId, const FileChunk& chunk) {
+                files.insert(fileId);
+                index.nrOfChunks++;
+                index.totalBytes += chunk.length;
+
+                auto [it, inserted] = chunks.try_emplace(chunk.hash);
+                auto& use = it->second;
+                if (inserted) {
+                    use.length = chunk.length;
+                    use.firstIndex = i;
+                    use.firstFile = fileId;
+                    report.uniqueBytes += chunk.length;
+                } else if (use.firstIndex != i || use.firstFile != fileId) {
+                    use.inSeveralFiles = true;
+                }
+
+                if ((use.indexes & (uint64_t(1) << i)) == 0) {
+                    use.indexes |= uint64_t(1) << i;
+                    index.uniqueBytes += chunk.length;
+                }
+            });
+
+            index.nrOfFiles = files.size();
+            report.totalBytes += index.totalBytes;
+        }
+
+        for (auto& [hash, use] : chunks) {
+            if ((use.indexes & (use.indexes - 1)) == 0) {
+                continue;
+            }
+
+            for (size_t i = 0; i < readers.size(); i++) {
+                if (use.indexes & (uint64_t(1) << i)) {
+                    report.indexes[i].sharedBytes += use.length;
+                }
+            }
+        }
+
+        for (size_t i = 0; i < readers.size(); i++) {
+            std::unordered_set<int64_t> sharingFiles;
+            readers[i].readChunks([&](int64_t fileId, const FileChunk& chunk) {
+                if (chunks.at(chunk.hash).inSeveralFiles) {
+                    sharingFiles.insert(fileId);
+                }
+            });
+
+            report.indexes[i].nrOfSharingFiles = sharingFiles.size();
+        }
+
+        return report;
+    }
+
+    void FileChunkReporter::print(const FileChunkReport& report) {
+        for (auto& index : report.indexes) {
+            katla::print(stdout, "{}:\n", index.path);
+            katla::print(stdout, "  Files: {}, {} share content with other files\n", index.nrOfFiles, index.nrOfSharingFiles);
+            katla::print(stdout, "  Chunks: {}, {} bytes\n", index.nrOfChunks, index.totalBytes);
+            katla::print(stdout,
+                         "  Unique: {} bytes, {}% of the tree is duplicate content\n",
+                         index.uniqueBytes,
+                         percentage(index.totalBytes - index.uniqueBytes, index.totalBytes));
+            if (report.indexes.size() > 1) {
+                katla::print(stdout,
+                             "  Shared with other trees: {} bytes, {}% of its unique content\n",
+                             index.sharedBytes,
+                             percentage(index.sharedBytes, index.uniqueBytes));
+            }
+        }
+
+        katla::print(stdout,
+                     "Total: {} bytes, {} bytes unique, {} bytes ({}%) stored more than once\n",
+                     report.totalBytes,
+                     report.uniqueBytes,
+                     report.totalBytes - report.uniqueBytes,
+                     percentage(report.totalBytes - report.uniqueBytes, report.totalBytes));
+    }
+
+} // namespace backer
@@ -0,0 +1,58 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FILE_CHUNK_REPORT_H
+#define FILE_CHUNK_REPORT_H
+
+#include "katla/core/core.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace backer {
+
+struct FileChunkReportIndex
+{
+    std::string path;
+    size_t nrOfFiles { 0 }; // Files with at least one chunk
+    size_t nrOfChunks { 0 };
+    uint64_t totalBytes { 0 };
+    uint64_t uniqueBytes { 0 }; // Bytes left when every distinct chunk of the index is stored once
+    uint64_t sharedBytes { 0 }; // Bytes of the distinct chunks that other indexes hold as well
+    size_t nrOfSharingFiles { 0 }; // Files with a chunk that occurs in another file of any index
+};
+
+struct FileChunkReport
+{
+    std::vector<FileChunkReportIndex> indexes;
+    uint64_t totalBytes { 0 };
+    uint64_t uniqueBytes { 0 }; // Bytes left when every distinct chunk of all indexes is stored once
+};
+
+// Measures how much content files share below the file level, from the chunks stored in indexes created with
+// chunking. Chunks are matched by hash, so all indexes need the same hash algorithm and chunking options.
+class FileChunkReporter {
+public:
+    static FileChunkReport create(const std::vector<std::string>& indexPaths);
+
+    static void print(const FileChunkReport& report);
+};
+
+} // namespace backer
+
+#endif
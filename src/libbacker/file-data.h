@@ -19,28 +19,56 @@
 
 #include "katla/core/core.h"
 
+#include "hasher.h"
+
 #include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <string>
 #include <vector>
 #include <map>
-#include <optional>
 
 namespace backer {
 
-enum class FileSystemEntryType { File, Dir };
+enum class FileSystemEntryType : uint8_t { File, Dir };
+
+// A file system object, the inode number is only unique on its device
+struct InodeId
+{
+    uint64_t device { 0 };
+    uint64_t inode { 0 };
+
+    bool operator==(const InodeId& other) const {
+        return device == other.device && inode == other.inode;
+    }
+};
+
+struct InodeIdHash
+{
+    size_t operator()(const InodeId& id) const {
+        return std::hash<uint64_t>()(id.inode ^ (id.device * 0x9e3779b97f4a7c15ull));
+    }
+};
 
+// A single file detached from its FileTree, with its paths spelled out
 struct FileSystemEntry
 {
     std::string name;
     std::string relativePath;
     std::string absolutePath;
     uint64_t size { 0 };
-    std::vector<std::byte> hash;
+    int64_t modificationTime { 0 }; // ns since epoch
+    int64_t changeTime { 0 }; // ns since epoch
+    uint64_t device { 0 };
+    uint64_t inode { 0 };
+    Digest hash {};
 
     FileSystemEntryType type {FileSystemEntryType::File};
+    bool hardLinked { false }; // Other paths link to the same inode
 
-    std::optional<std::vector<FileSystemEntry>> children;
+    InodeId inodeId() const {
+        return {device, inode};
+    }
 
     bool isInDest { false }; // TODO remove
 };
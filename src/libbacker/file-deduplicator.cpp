@@ -0,0 +1,350 @@
+#include "file-deduplicator.h"
+
+#include "file-descriptor.h"
+
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace backer {
+
+    namespace fs = std::filesystem;
+
+    namespace {
+        // A request with its targets has to fit in a page
+        constexpr size_t MaxDedupeTargets = (4096 - sizeof(file_dedupe_range)) / sizeof(file_dedupe_range_info);
+
+        // Btrfs compares at most this much per call, other file systems cut longer ranges short as well
+        constexpr uint64_t MaxDedupeLength = 16 * 1024 * 1024;
+
+        // Extents asked for per FIEMAP call
+        constexpr size_t FiemapExtents = 64;
+
+        // Bytes of a file in extents it shares with other files, empty when the file system can't map extents
+        std::optional<uint64_t> sharedBytes(int fd)
+        {
+            std::vector<std::byte> buffer(sizeof(struct fiemap) + FiemapExtents * sizeof(struct fiemap_extent));
+            auto map = reinterpret_cast<struct fiemap*>(buffer.data());
+
+            uint64_t shared = 0;
+            uint64_t start = 0;
+            while (true) {
+                std::fill(buffer.begin(), buffer.end(), std::byte(0));
+                map->fm_start = start;
+                map->fm_length = FIEMAP_MAX_OFFSET - start;
+                map->fm_flags = FIEMAP_FLAG_SYNC;
+                map->fm_extent_count = FiemapExtents;
+                if (::ioctl(fd, FS_IOC_FIEMAP, map) != 0) {
+                    return std::nullopt;
+                }
+                if (map->fm_mapped_extents == 0) {
+                    return shared;
+                }
+
+                for (uint32_t i = 0; i < map->fm_mapped_extents; i++) {
+                    auto& extent = map->fm_extents[i];
+                    if (extent.fe_flags & FIEMAP_EXTENT_SHARED) {
+                        shared += extent.fe_length;
+                    }
+                    if (extent.fe_flags & FIEMAP_EXTENT_LAST) {
+                        return shared;
+                    }
+                }
+
+                auto& last = map->fm_extents[map->fm_mapped_extents - 1];
+                start = last.fe_logical + last.fe_length;
+            }
+        }
+
+        int64_t nanoseconds(const struct timespec& time)
+        {
+            return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+        }
+
+        // The file still has the stat it had when it was hashed, so it still has the hashed content
+        bool isUnchanged(const FileSystemEntry& file, const struct stat& status)
+        {
+            return static_cast<uint64_t>(status.st_size) == file.size &&
+                   status.st_ino == file.inode &&
+                   nanoseconds(status.st_mtim) == file.modificationTime &&
+                   nanoseconds(status.st_ctim) == file.changeTime;
+        }
+    }
+
+    FileDeduplicator::FileDeduplicator(DedupeMode mode) :
+        m_mode(mode)
+    {
+    }
+
+    void FileDeduplicator::deduplicate(const std::vector<std::vector<FileSystemEntry>>& groups)
+    {
+        m_statistics = {};
+
+        for (auto& group : groups) {
+            if (group.empty() || group.front().size == 0) {
+                continue;
+            }
+
+            auto& source = group.front();
+            std::unordered_set<InodeId, InodeIdHash> inodes = {source.inodeId()};
+
+            // Hard links to the source share its data already. Reflinks are made once per inode, hard links
+            // replace every path to it.
+            std::vector<const FileSystemEntry*> duplicates;
+            for (auto& file : group) {
+                if (file.inodeId() == source.inodeId()) {
+                    continue;
+                }
+                if (inodes.insert(file.inodeId()).second || m_mode == DedupeMode::Hardlink) {
+                    duplicates.push_back(&file);
+                }
+            }
+
+            if (duplicates.empty()) {
+                continue;
+            }
+
+            m_statistics.nrOfGroups++;
+            if (m_mode == DedupeMode::Reflink) {
+                reflink(source, duplicates);
+            } else {
+                hardlink(source, duplicates);
+            }
+        }
+    }
+
+    void FileDeduplicator::reflink(const FileSystemEntry& source, const std::vector<const FileSystemEntry*>& duplicates)
+    {
+        FileDescriptor src(::open(source.absolutePath.c_str(), O_RDONLY | O_CLOEXEC));
+        if (src.fd < 0) {
+            katla::printError("Failed opening {}: {}", source.absolutePath, std::strerror(errno));
+            m_statistics.nrOfFailed += duplicates.size();
+            return;
+        }
+
+        // Ranges past the end of a source that shrunk are rejected for the whole call, so it is checked up front
+        struct stat sourceStatus {};
+        if (::fstat(src.fd, &sourceStatus) != 0 || static_cast<uint64_t>(sourceStatus.st_size) != source.size) {
+            katla::printError("Skipping duplicates of {}, it changed since it was hashed", source.absolutePath);
+            m_statistics.nrOfSkipped += duplicates.size();
+            return;
+        }
+
+        for (size_t batchStart = 0; batchStart < duplicates.size(); batchStart += MaxDedupeTargets) {
+            size_t batchEnd = std::min(duplicates.size(), batchStart + MaxDedupeTargets);
+
+            // Only the owner or writers of a file may share its extents
+            std::vector<std::unique_ptr<FileDescriptor>> targets;
+            std::vector<const FileSystemEntry*> files;
+            for (size_t i = batchStart; i < batchEnd; i++) {
+                int fd = ::open(duplicates[i]->absolutePath.c_str(), O_RDWR | O_CLOEXEC);
+                if (fd < 0) {
+                    fd = ::open(duplicates[i]->absolutePath.c_str(), O_RDONLY | O_CLOEXEC);
+                }
+                if (fd < 0) {
+                    katla::printError("Failed opening {}: {}", duplicates[i]->absolutePath, std::strerror(errno));
+                    m_statistics.nrOfFailed++;
+                    continue;
+                }
+
+                targets.push_back(std::make_unique<FileDescriptor>(fd));
+                files.push_back(duplicates[i]);
+            }
+
+            // Only bytes that were not shared before count as reclaimed
+            std::vector<std::optional<uint64_t>> sharedBefore(targets.size());
+            for (size_t i = 0; i < targets.size(); i++) {
+                sharedBefore[i] = sharedBytes(targets[i]->fd);
+            }
+
+            // All targets of a batch go in a single call per range, targets that differ drop out
+            std::vector<size_t> active(targets.size());
+            for (size_t i = 0; i < active.size(); i++) {
+                active[i] = i;
+            }
+
+            std::vector<std::byte> request(sizeof(file_dedupe_range) + MaxDedupeTargets * sizeof(file_dedupe_range_info));
+            auto range = reinterpret_cast<file_dedupe_range*>(request.data());
+
+            for (uint64_t offset = 0; offset < source.size && !active.empty();) {
+                std::fill(request.begin(), request.end(), std::byte(0));
+                range->src_offset = offset;
+                range->src_length = std::min(MaxDedupeLength, source.size - offset);
+                range->dest_count = static_cast<uint16_t>(active.size());
+                for (size_t i = 0; i < active.size(); i++) {
+                    range->info[i].dest_fd = targets[active[i]]->fd;
+                    range->info[i].dest_offset = offset;
+                }
+
+                if (::ioctl(src.fd, FIDEDUPERANGE, range) != 0) {
+                    if (errno == EOPNOTSUPP || errno == ENOTTY) {
+                        katla::printError("Failed deduplicating {}, its file system does not support reflinks, use hardlink mode instead", source.absolutePath);
+                    } else {
+                        katla::printError("Failed deduplicating {}: {}", source.absolutePath, std::strerror(errno));
+                    }
+                    m_statistics.nrOfFailed += active.size();
+                    active.clear();
+                    break;
+                }
+
+                // A file system may dedupe less than asked for, the next call continues after the shortest range
+                // that was deduped so no target skips bytes
+                std::vector<size_t> remaining;
+                uint64_t bytesDeduped = range->src_length;
+                for (size_t i = 0; i < active.size(); i++) {
+                    auto& info = range->info[i];
+                    auto& file = *files[active[i]];
+                    if (info.status == FILE_DEDUPE_RANGE_SAME && info.bytes_deduped > 0) {
+                        bytesDeduped = std::min<uint64_t>(bytesDeduped, info.bytes_deduped);
+                        remaining.push_back(active[i]);
+                    } else if (info.status == FILE_DEDUPE_RANGE_SAME) {
+                        katla::printError("Failed deduplicating {}: no bytes deduped at offset {}", file.absolutePath, offset);
+                        m_statistics.nrOfFailed++;
+                    } else if (info.status == FILE_DEDUPE_RANGE_DIFFERS) {
+                        katla::printError("Skipping {}, it changed since it was hashed", file.absolutePath);
+                        m_statistics.nrOfSkipped++;
+                    } else {
+                        katla::printError("Failed deduplicating {}: {}", file.absolutePath, std::strerror(-info.status));
+                        m_statistics.nrOfFailed++;
+                    }
+                }
+                active = std::move(remaining);
+                offset += bytesDeduped;
+            }
+
+            for (auto i : active) {
+                katla::printInfo("Reflinked {} to {}", files[i]->absolutePath, source.absolutePath);
+                m_statistics.nrOfDeduplicated++;
+
+                auto sharedAfter = sharedBytes(targets[i]->fd);
+                if (sharedBefore[i] && sharedAfter && *sharedAfter > *sharedBefore[i]) {
+                    m_statistics.bytesReclaimed += *sharedAfter - *sharedBefore[i];
+                }
+            }
+        }
+    }
+
+    void FileDeduplicator::hardlink(const FileSystemEntry& source, const std::vector<const FileSystemEntry*>& duplicates)
+    {
+        struct stat sourceStatus {};
+        if (::lstat(source.absolutePath.c_str(), &sourceStatus) != 0 || !isUnchanged(source, sourceStatus)) {
+            katla::printError("Skipping duplicates of {}, it changed since it was hashed", source.absolutePath);
+            m_statistics.nrOfSkipped += duplicates.size();
+            return;
+        }
+
+        // The data of an inode is only freed once all of its links are replaced
+        struct InodeLinks
+        {
+            nlink_t nrOfLinks { 0 };
+            nlink_t nrOfReplaced { 0 };
+            uint64_t size { 0 };
+        };
+        std::unordered_map<InodeId, InodeLinks, InodeIdHash> inodeLinks;
+
+        // All paths are checked before any is replaced, replacing a link changes the stat of the other paths to its inode
+        std::vector<const FileSystemEntry*> candidates;
+        for (auto file : duplicates) {
+            struct stat status {};
+            if (::lstat(file->absolutePath.c_str(), &status) != 0) {
+                katla::printError("Failed reading status of {}: {}", file->absolutePath, std::strerror(errno));
+                m_statistics.nrOfFailed++;
+                continue;
+            }
+
+            if (!isUnchanged(*file, status)) {
+                katla::printError("Skipping {}, it changed since it was hashed", file->absolutePath);
+                m_statistics.nrOfSkipped++;
+                continue;
+            }
+
+            // A link can't cross file systems and would change the owner or mode of one of the paths
+            if (status.st_dev != sourceStatus.st_dev || status.st_mode != sourceStatus.st_mode ||
+                status.st_uid != sourceStatus.st_uid || status.st_gid != sourceStatus.st_gid) {
+                katla::printError("Skipping {}, it differs from {} in file system, owner or mode", file->absolutePath, source.absolutePath);
+                m_statistics.nrOfSkipped++;
+                continue;
+            }
+
+            candidates.push_back(file);
+            inodeLinks[file->inodeId()] = {status.st_nlink, 0, file->size};
+        }
+
+        for (auto file : candidates) {
+            // The duplicate is only replaced once the link is in place, it is never missing
+            auto path = fs::path(file->absolutePath);
+            auto temporary = (path.parent_path() / katla::format(".{}.backer-dedupe", path.filename().string())).string();
+            if (::link(source.absolutePath.c_str(), temporary.c_str()) != 0) {
+                katla::printError("Failed linking {} to {}: {}", file->absolutePath, source.absolutePath, std::strerror(errno));
+                m_statistics.nrOfFailed++;
+                continue;
+            }
+            // Only the link made here is removed, a file that was already at the temporary path is left alone
+            if (::rename(temporary.c_str(), path.c_str()) != 0) {
+                katla::printError("Failed linking {} to {}: {}", file->absolutePath, source.absolutePath, std::strerror(errno));
+                ::unlink(temporary.c_str());
+                m_statistics.nrOfFailed++;
+                continue;
+            }
+
+            katla::printInfo("Linked {} to {}", file->absolutePath, source.absolutePath);
+            m_statistics.nrOfDeduplicated++;
+            inodeLinks[file->inodeId()].nrOfReplaced++;
+        }
+
+        for (auto& [inode, links] : inodeLinks) {
+            if (links.nrOfReplaced == links.nrOfLinks) {
+                m_statistics.bytesReclaimed += links.size;
+            }
+        }
+    }
+
+    void FileDeduplicator::printStatistics() const
+    {
+        katla::print(stdout, "Nr of duplicate groups: {}\n", m_statistics.nrOfGroups);
+        katla::print(stdout,
+                     "Nr of files {}ed: {}, skipped: {}, failed: {}\n",
+                     modeName(m_mode),
+                     m_statistics.nrOfDeduplicated,
+                     m_statistics.nrOfSkipped,
+                     m_statistics.nrOfFailed);
+        katla::print(stdout, "Reclaimed: {} bytes\n", m_statistics.bytesReclaimed);
+    }
+
+    DedupeMode FileDeduplicator::parseMode(const std::string& name)
+    {
+        if (name == "reflink") {
+            return DedupeMode::Reflink;
+        }
+        if (name == "hardlink") {
+            return DedupeMode::Hardlink;
+        }
+
+        throw std::runtime_error(katla::format("Unknown dedupe mode: {}, options are reflink or hardlink", name));
+    }
+
+    std::string FileDeduplicator::modeName(DedupeMode mode)
+    {
+        switch (mode) {
+            case DedupeMode::Reflink:
+                return "reflink";
+            case DedupeMode::Hardlink:
+                return "hardlink";
+        }
+
+        return "unknown";
+    }
+
+} // namespace backer
@@ -0,0 +1,75 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FILE_DEDUPLICATOR_H
+#define FILE_DEDUPLICATOR_H
+
+#include "katla/core/core.h"
+
+#include "file-data.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace backer {
+
+// Reflink shares the extents of duplicates, which stay separate files that can change independently. Hardlink
+// replaces duplicates by links to a single inode, which also works on file systems without reflinks.
+enum class DedupeMode { Reflink, Hardlink };
+
+struct FileDeduplicatorStatistics
+{
+    size_t nrOfGroups { 0 }; // Groups with at least two inodes
+    size_t nrOfDeduplicated { 0 }; // Files now sharing the data of the first file of their group
+    size_t nrOfSkipped { 0 }; // Files that changed since they were hashed or differ in owner or mode
+    size_t nrOfFailed { 0 };
+    uint64_t bytesReclaimed { 0 }; // Reflink: bytes of duplicates that became shared, hardlink: size of freed inodes
+};
+
+// Removes the duplicate content of groups found by the DuplicateFinder, every other inode of a group is made to share
+// the data of the first file. In reflink mode the kernel compares the ranges while it locks them with
+// FIDEDUPERANGE, so a file that changed after it was hashed is never touched. Only bytes that were not shared before,
+// as reported by FIEMAP, are counted as reclaimed. In hardlink mode a file is only replaced while its stat still
+// matches the one it was hashed with.
+class FileDeduplicator {
+public:
+    explicit FileDeduplicator(DedupeMode mode);
+
+    void deduplicate(const std::vector<std::vector<FileSystemEntry>>& groups);
+
+    const FileDeduplicatorStatistics& statistics() const {
+        return m_statistics;
+    }
+
+    void printStatistics() const;
+
+    static DedupeMode parseMode(const std::string& name);
+    static std::string modeName(DedupeMode mode);
+
+private:
+    // Files of a group with the same inode as an earlier file are left out, they share its data already
+    void reflink(const FileSystemEntry& source, const std::vector<const FileSystemEntry*>& duplicates);
+    void hardlink(const FileSystemEntry& source, const std::vector<const FileSystemEntry*>& duplicates);
+
+    DedupeMode m_mode;
+    FileDeduplicatorStatistics m_statistics;
+};
+
+} // namespace backer
+
+#endif
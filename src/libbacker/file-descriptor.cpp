@@ -0,0 +1,34 @@
+#include "file-descriptor.h"
+
+#include "katla/core/core.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace backer {
+
+    FileDescriptor::FileDescriptor(const std::string& path, int flags, mode_t mode) :
+        fd(::open(path.c_str(), flags | O_CLOEXEC, mode))
+    {
+        if (fd < 0) {
+            throw std::runtime_error(katla::format("Failed opening {}: {}", path, std::strerror(errno)));
+        }
+    }
+
+    FileDescriptor::FileDescriptor(int fd) :
+        fd(fd)
+    {
+    }
+
+    FileDescriptor::~FileDescriptor()
+    {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+} // namespace backer
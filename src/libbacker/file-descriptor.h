@@ -0,0 +1,45 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FILE_DESCRIPTOR_H
+#define FILE_DESCRIPTOR_H
+
+#include <string>
+
+#include <sys/types.h>
+
+namespace backer {
+
+// Closes a raw file descriptor when it goes out of scope, for the calls that katla::PosixFile doesn't offer
+struct FileDescriptor
+{
+    // Opens the path close-on-exec, throws when it can't be opened
+    FileDescriptor(const std::string& path, int flags, mode_t mode = 0);
+
+    // Takes over an already opened descriptor, a negative one is kept as is so callers can report the error
+    explicit FileDescriptor(int fd);
+
+    ~FileDescriptor();
+
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+    int fd { -1 };
+};
+
+} // namespace backer
+
+#endif
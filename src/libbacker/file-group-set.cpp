@@ -1,67 +1,125 @@
 #include "file-group-set.h"
 
-#include "katla/core/posix-file.h"
+#include "worker-pool.h"
 
-#include <filesystem>
-#include <openssl/md5.h>
+#include <algorithm>
 
 namespace backer {
 
-    namespace fs = std::filesystem;
+    FileGroupKey FileGroupKey::create(std::string_view name, uint64_t size)
+    {
+        FileGroupKey key;
+        key.name = name;
+        key.size = size;
+        key.hash = std::hash<std::string_view>()(name) ^ (std::hash<uint64_t>()(size) * 0x9e3779b97f4a7c15ull);
+        return key;
+    }
 
     FileGroupSet::FileGroupSet() {
     }
 
-    FileGroupSet FileGroupSet::create(std::string path) {
+    FileGroupSet FileGroupSet::create(std::string path, int jobs) {
         FileGroupSet result;
-        result.addAndGroupPotentialDuplicateFile(path);
+        result.addAndGroupPotentialDuplicateFile(path, jobs);
         return result;
     }
 
-    void FileGroupSet::addAndGroupPotentialDuplicateFile(std::string path) {
-        fs::recursive_directory_iterator dirIter(path);
-        for (auto &entry : dirIter) {
-            if (entry.is_symlink() || entry.is_other()) {
-                continue;
+    void FileGroupSet::addAndGroupPotentialDuplicateFile(std::string path, int jobs) {
+        addTree(FileTree::create(path, jobs), jobs);
+    }
+
+    void FileGroupSet::addTree(FileTree tree, int jobs)
+    {
+        auto treeIndex = static_cast<uint32_t>(m_trees.size());
+        auto& addedTree = m_trees.emplace_back(std::move(tree));
+
+        std::vector<NodeIndex> files;
+        files.reserve(addedTree.nrOfFiles());
+        addedTree.forEachFile([&](NodeIndex index) {
+            files.push_back(index);
+        });
+
+        WorkerPool workerPool(jobs);
+
+        // Keys are made and partitioned by shard in parallel chunks, then every shard picks up its own files from
+        // each chunk so no locking is needed
+        constexpr size_t ChunkSize = 4096;
+        size_t nrOfChunks = (files.size() + ChunkSize - 1) / ChunkSize;
+        std::vector<FileGroupKey> keys(files.size());
+        std::vector<std::array<std::vector<size_t>, NrOfShards>> chunkShards(nrOfChunks);
+        workerPool.forEach(nrOfChunks, [&](size_t chunk) {
+            size_t end = std::min(files.size(), (chunk + 1) * ChunkSize);
+            for (size_t i = chunk * ChunkSize; i < end; i++) {
+                keys[i] = FileGroupKey::create(addedTree.name(files[i]), addedTree.node(files[i]).size);
+                chunkShards[chunk][keys[i].hash % NrOfShards].push_back(i);
+            }
+        });
+
+        workerPool.forEach(NrOfShards, [&](size_t shardIndex) {
+            auto& shard = m_shards[shardIndex];
+            for (auto& chunkShard : chunkShards) {
+                for (auto i : chunkShard[shardIndex]) {
+                    shard[keys[i]].push_back({treeIndex, files[i]});
+                }
             }
+        });
+    }
 
-            if (!entry.is_regular_file()) {
-                continue;
+    long FileGroupSet::countFiles() const
+    {
+        long fileCount = 0;
+        for (auto& shard : m_shards) {
+            for (auto& pair : shard) {
+                fileCount += pair.second.size();
             }
+        }
+
+        return fileCount;
+    }
 
-            FileSystemEntry fileData{};
-            fileData.name = entry.path().filename().string();
-            fileData.relativePath = fs::relative(entry.path(), path).string();
+    size_t FileGroupSet::nrOfGroups() const
+    {
+        size_t nrOfGroups = 0;
+        for (auto& shard : m_shards) {
+            nrOfGroups += shard.size();
+        }
+
+        return nrOfGroups;
+    }
 
-            auto absolutePathResult = katla::PosixFile::absolutePath(entry.path().string());
-            if (!absolutePathResult) {
-                throw std::runtime_error(absolutePathResult.error().message());
+    std::vector<FileSystemEntry> FileGroupSet::entries() const
+    {
+        std::vector<FileSystemEntry> result;
+        result.reserve(countFiles());
+        forEachGroup([&](const FileGroupKey&, gsl::span<const FileReference> files) {
+            for (auto& file : files) {
+                result.push_back(entry(file));
             }
+        });
 
-            fileData.absolutePath = absolutePathResult.value();
-            fileData.size = entry.file_size();
+        return result;
+    }
 
-            std::string key = katla::format("{}-{}", fileData.name, fileData.size);
+    gsl::span<const FileReference> FileGroupSet::group(std::string_view name, uint64_t size) const
+    {
+        auto key = FileGroupKey::create(name, size);
+        auto& shard = m_shards[key.hash % NrOfShards];
 
-            auto findIt = m_fileMap.find(key);
-            if (findIt != m_fileMap.end()) {
-                findIt->second.push_back(fileData);
-            } else {
-                m_fileMap[key] = std::vector<FileSystemEntry>{fileData};
-            }
+        auto findIt = shard.find(key);
+        if (findIt == shard.end()) {
+            return {};
         }
+
+        return gsl::span<const FileReference>(findIt->second.data(), findIt->second.size());
     }
 
-    long FileGroupSet::countFiles()
+    void FileGroupSet::forEachGroup(const std::function<void(const FileGroupKey& key, gsl::span<const FileReference> files)>& function) const
     {
-        long fileCount = 0;
-        for (auto& pair : m_fileMap) {
-            for(auto& file : pair.second) {
-                fileCount++;
+        for (auto& shard : m_shards) {
+            for (auto& pair : shard) {
+                function(pair.first, gsl::span<const FileReference>(pair.second.data(), pair.second.size()));
             }
         }
-
-        return fileCount;
     }
 
-} // namespace backer
\ No newline at end of file
+} // namespace backer
@@ -20,33 +20,94 @@
 #include "katla/core/core.h"
 
 #include "file-data.h"
+#include "file-tree.h"
 
+#include <array>
 #include <cstddef>
 #include <cstdint>
+#include <deque>
+#include <functional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
-#include <map>
 
 namespace backer {
 
+// Files with the same name and size are potential duplicates. The name points into the name arena of a tree
+// owned by the FileGroupSet, the hash is computed once when the key is made.
+struct FileGroupKey
+{
+    std::string_view name;
+    uint64_t size { 0 };
+    size_t hash { 0 };
+
+    static FileGroupKey create(std::string_view name, uint64_t size);
+
+    bool operator==(const FileGroupKey& other) const {
+        return size == other.size && name == other.name;
+    }
+};
+
+struct FileGroupKeyHash
+{
+    size_t operator()(const FileGroupKey& key) const {
+        return key.hash;
+    }
+};
+
+struct FileReference
+{
+    uint32_t tree { 0 };
+    NodeIndex node { 0 };
+};
+
 class FileGroupSet {
 public:
     FileGroupSet();
 
-    static FileGroupSet create(std::string path);
+    // Keys point into the trees of the set, a copy would point into the trees of the original
+    FileGroupSet(const FileGroupSet&) = delete;
+    FileGroupSet& operator=(const FileGroupSet&) = delete;
+    FileGroupSet(FileGroupSet&&) = default;
+    FileGroupSet& operator=(FileGroupSet&&) = default;
 
-    void addAndGroupPotentialDuplicateFile(std::string path);
+    static FileGroupSet create(std::string path, int jobs = 0);
 
-    long countFiles();
+    void addAndGroupPotentialDuplicateFile(std::string path, int jobs = 0);
 
-    std::map<std::string, std::vector<backer::FileSystemEntry>> fileMap() {
-        return m_fileMap;
+    // Groups the files of an already scanned tree, shards are filled in parallel
+    void addTree(FileTree tree, int jobs = 0);
+
+    long countFiles() const;
+
+    size_t nrOfGroups() const;
+
+    // Files of the group, empty when there is none. Stays valid until files are added.
+    gsl::span<const FileReference> group(std::string_view name, uint64_t size) const;
+
+    void forEachGroup(const std::function<void(const FileGroupKey& key, gsl::span<const FileReference> files)>& function) const;
+
+    const FileTree& tree(const FileReference& file) const {
+        return m_trees[file.tree];
     }
 
+    FileSystemEntry entry(const FileReference& file) const {
+        return m_trees[file.tree].entry(file.node);
+    }
+
+    // Every file detached from its tree, grouped files are next to each other
+    std::vector<FileSystemEntry> entries() const;
+
 private:
-    std::map<std::string, std::vector<backer::FileSystemEntry>> m_fileMap;
+    static constexpr size_t NrOfShards = 16;
+
+    using Shard = std::unordered_map<FileGroupKey, std::vector<FileReference>, FileGroupKeyHash>;
+
+    std::deque<FileTree> m_trees; // Keys point into the trees, a deque keeps them in place
+    std::array<Shard, NrOfShards> m_shards;
 };
 
 } // namespace backer
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,170 @@
+#include "file-hash-cache.h"
+
+#include "worker-pool.h"
+
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include <array>
+#include <chrono>
+#include <cstring>
+
+namespace backer {
+
+    namespace {
+        constexpr uint8_t AttributeVersion = 1;
+
+        // Version, digest size, size, modification time, inode and the digest
+        constexpr size_t AttributeHeaderSize = 2 + 3 * sizeof(uint64_t);
+        constexpr size_t MaxAttributeSize = AttributeHeaderSize + std::tuple_size<Digest>::value;
+
+        // A file written again within the same timestamp tick keeps its modification time, so hashes of files
+        // modified this recently are not stored
+        constexpr int64_t MinModificationAge = 2000000000; // ns
+
+        template<typename T>
+        void writeField(std::array<std::byte, MaxAttributeSize>& buffer, size_t& offset, T value) {
+            std::memcpy(buffer.data() + offset, &value, sizeof(value));
+            offset += sizeof(value);
+        }
+
+        template<typename T>
+        T readField(const std::array<std::byte, MaxAttributeSize>& buffer, size_t& offset) {
+            T value;
+            std::memcpy(&value, buffer.data() + offset, sizeof(value));
+            offset += sizeof(value);
+            return value;
+        }
+    }
+
+    FileHashCache::FileHashCache(HashAlgorithm algorithm) :
+        m_algorithm(algorithm),
+        m_attributeName(katla::format("user.backer.{}", Hasher::algorithmName(algorithm)))
+    {
+    }
+
+    std::optional<Digest> FileHashCache::lookup(const std::string& path, FileHashCacheKey& key) {
+        struct stat statResult {};
+        if (::stat(path.c_str(), &statResult) != 0) {
+            key.valid = false;
+            m_nrOfMisses++;
+            return std::nullopt;
+        }
+
+        key.valid = true;
+        key.size = static_cast<uint64_t>(statResult.st_size);
+        key.modificationTime = static_cast<int64_t>(statResult.st_mtim.tv_sec) * 1000000000 + statResult.st_mtim.tv_nsec;
+        key.inode = statResult.st_ino;
+
+        std::array<std::byte, MaxAttributeSize> buffer {};
+        auto digestSize = Hasher::digestSize(m_algorithm);
+        auto attributeSize = ::getxattr(path.c_str(), m_attributeName.c_str(), buffer.data(), buffer.size());
+        if (attributeSize != static_cast<ssize_t>(AttributeHeaderSize + digestSize)) {
+            m_nrOfMisses++;
+            return std::nullopt;
+        }
+
+        size_t offset = 0;
+        bool matches = readField<uint8_t>(buffer, offset) == AttributeVersion;
+        matches = readField<uint8_t>(buffer, offset) == digestSize && matches;
+        matches = readField<uint64_t>(buffer, offset) == key.size && matches;
+        matches = readField<int64_t>(buffer, offset) == key.modificationTime && matches;
+        matches = readField<uint64_t>(buffer, offset) == key.inode && matches;
+        if (!matches) {
+            m_nrOfMisses++;
+            return std::nullopt;
+        }
+
+        Digest digest {};
+        std::memcpy(digest.data(), buffer.data() + offset, digestSize);
+        m_nrOfHits++;
+        return digest;
+    }
+
+    void FileHashCache::store(const std::string& path, const FileHashCacheKey& key, const Digest& hash) {
+        auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        if (!key.valid || now - key.modificationTime < MinModificationAge) {
+            return;
+        }
+
+        std::array<std::byte, MaxAttributeSize> buffer {};
+        auto digestSize = Hasher::digestSize(m_algorithm);
+
+        size_t offset = 0;
+        writeField<uint8_t>(buffer, offset, AttributeVersion);
+        writeField<uint8_t>(buffer, offset, static_cast<uint8_t>(digestSize));
+        writeField<uint64_t>(buffer, offset, key.size);
+        writeField<int64_t>(buffer, offset, key.modificationTime);
+        writeField<uint64_t>(buffer, offset, key.inode);
+        std::memcpy(buffer.data() + offset, hash.data(), digestSize);
+
+        if (::setxattr(path.c_str(), m_attributeName.c_str(), buffer.data(), offset + digestSize, 0) == 0) {
+            m_nrOfStored++;
+        }
+    }
+
+    void FileHashCache::printStatistics() const {
+        uint64_t nrOfLookups = m_nrOfHits + m_nrOfMisses;
+        katla::print(stdout,
+                     "Hash cache: {} hits, {} misses, {:.1f}% hit rate, {} hashes stored\n",
+                     m_nrOfHits.load(),
+                     m_nrOfMisses.load(),
+                     nrOfLookups ? 100.0 * m_nrOfHits / nrOfLookups : 0.0,
+                     m_nrOfStored.load());
+    }
+
+    CachingFileHashReader::CachingFileHashReader(std::unique_ptr<FileHashReader> reader, int jobs, HashAlgorithm algorithm) :
+        m_reader(std::move(reader)),
+        m_jobs(jobs),
+        m_algorithm(algorithm),
+        m_cache(algorithm)
+    {
+    }
+
+    std::vector<std::vector<std::byte>> CachingFileHashReader::hash(const std::vector<FileHashRequest>& requests,
+                                                                    const ProgressFunction& progress) {
+        std::vector<std::vector<std::byte>> result(requests.size());
+        std::vector<FileHashCacheKey> keys(requests.size());
+        std::vector<char> cached(requests.size(), false);
+
+        WorkerPool(m_jobs).forEach(requests.size(), [&](size_t i) {
+            auto digest = m_cache.lookup(requests[i].path, keys[i]);
+            if (!digest) {
+                return;
+            }
+
+            result[i] = Hasher::fromDigest(*digest, m_algorithm);
+            cached[i] = true;
+            if (progress) {
+                progress(i, result[i]);
+            }
+        });
+
+        std::vector<size_t> uncached;
+        std::vector<FileHashRequest> uncachedRequests;
+        for (size_t i = 0; i < requests.size(); i++) {
+            if (!cached[i]) {
+                uncached.push_back(i);
+                uncachedRequests.push_back(requests[i]);
+            }
+        }
+
+        if (uncached.empty()) {
+            return result;
+        }
+
+        auto hashes = m_reader->hash(uncachedRequests, [&](size_t i, const std::vector<std::byte>& hash) {
+            m_cache.store(uncachedRequests[i].path, keys[uncached[i]], Hasher::toDigest(hash));
+            if (progress) {
+                progress(uncached[i], hash);
+            }
+        });
+
+        for (size_t i = 0; i < uncached.size(); i++) {
+            result[uncached[i]] = std::move(hashes[i]);
+        }
+
+        return result;
+    }
+
+} // namespace backer
@@ -0,0 +1,110 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FILE_HASH_CACHE_H
+#define FILE_HASH_CACHE_H
+
+#include "katla/core/core.h"
+
+#include "file-hash-reader.h"
+#include "hasher.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace backer {
+
+// Stat of a file when it was looked up in the cache, a hash read after the lookup is stored for this stat
+struct FileHashCacheKey
+{
+    bool valid { false };
+    uint64_t size { 0 };
+    int64_t modificationTime { 0 }; // ns since epoch
+    uint64_t inode { 0 };
+};
+
+// Keeps the hash of a file in its user.backer.<algorithm> extended attribute, along with the size, modification
+// time and inode it was computed for. A cached hash is only trusted while all three still match. The change time
+// can't be part of it, storing the attribute updates it. Files that are renamed or hard linked keep their cached
+// hash, so they are never read again, whichever tree they are indexed in.
+class FileHashCache {
+public:
+    explicit FileHashCache(HashAlgorithm algorithm);
+
+    std::optional<Digest> lookup(const std::string& path, FileHashCacheKey& key);
+
+    // Fails silently on file systems without user extended attributes or files that are not writable
+    void store(const std::string& path, const FileHashCacheKey& key, const Digest& hash);
+
+    uint64_t nrOfHits() const {
+        return m_nrOfHits;
+    }
+
+    uint64_t nrOfMisses() const {
+        return m_nrOfMisses;
+    }
+
+    uint64_t nrOfStored() const {
+        return m_nrOfStored;
+    }
+
+    void printStatistics() const;
+
+private:
+    HashAlgorithm m_algorithm;
+    std::string m_attributeName;
+
+    std::atomic<uint64_t> m_nrOfHits {0};
+    std::atomic<uint64_t> m_nrOfMisses {0};
+    std::atomic<uint64_t> m_nrOfStored {0};
+};
+
+// Answers requests from the hash cache where possible and hashes the other files with the wrapped reader,
+// storing their hashes for the next run
+class CachingFileHashReader : public FileHashReader {
+public:
+    CachingFileHashReader(std::unique_ptr<FileHashReader> reader, int jobs, HashAlgorithm algorithm);
+
+    std::string name() const override {
+        return m_reader->name();
+    }
+
+    std::vector<std::vector<std::byte>> hash(const std::vector<FileHashRequest>& requests,
+                                             const ProgressFunction& progress = {}) override;
+
+    void printStatistics() const override {
+        m_cache.printStatistics();
+    }
+
+    const FileHashCache& cache() const {
+        return m_cache;
+    }
+
+private:
+    std::unique_ptr<FileHashReader> m_reader;
+    int m_jobs;
+    HashAlgorithm m_algorithm;
+    FileHashCache m_cache;
+};
+
+} // namespace backer
+
+#endif
@@ -0,0 +1,129 @@
+#include "file-hash-reader.h"
+
+#include "backer.h"
+#include "file-hash-cache.h"
+#include "io-uring-file-hash-reader.h"
+#include "per-device-file-hash-reader.h"
+#include "sha256-multi-buffer.h"
+#include "worker-pool.h"
+
+#include <exception>
+
+namespace backer {
+
+    namespace {
+        bool useIoUring(const IoOptions& options)
+        {
+            return options.backend != IoBackend::Blocking && IoUringFileHashReader::isSupported();
+        }
+    }
+
+    std::unique_ptr<FileHashReader> FileHashReader::create(int jobs, IoOptions options, HashAlgorithm algorithm)
+    {
+        if (options.hashCache) {
+            options.hashCache = false;
+            return std::make_unique<CachingFileHashReader>(create(jobs, options, algorithm), jobs, algorithm);
+        }
+
+        return std::make_unique<PerDeviceFileHashReader>(jobs, options, algorithm);
+    }
+
+    std::unique_ptr<FileHashReader> FileHashReader::createBackend(int jobs, IoOptions options, HashAlgorithm algorithm)
+    {
+        if (useIoUring(options)) {
+            return std::make_unique<IoUringFileHashReader>(jobs, options, algorithm);
+        }
+
+        if (options.backend == IoBackend::IoUring) {
+            katla::printError("io_uring is not available, falling back to blocking reads");
+        }
+
+        return std::make_unique<BlockingFileHashReader>(jobs, options, algorithm);
+    }
+
+    std::string FileHashReader::backendName(const IoOptions& options)
+    {
+        return useIoUring(options) ? "io_uring" : "blocking";
+    }
+
+    IoBackend FileHashReader::parseBackend(const std::string& backend)
+    {
+        if (backend == "auto") {
+            return IoBackend::Auto;
+        }
+        if (backend == "blocking") {
+            return IoBackend::Blocking;
+        }
+        if (backend == "io_uring") {
+            return IoBackend::IoUring;
+        }
+
+        throw std::runtime_error(katla::format("Unknown io backend: {}, options are: auto, blocking, io_uring", backend));
+    }
+
+    bool FileHashReader::useMultiBuffer(const IoOptions& options, HashAlgorithm algorithm, uint64_t size)
+    {
+        // With the SHA extensions OpenSSL hashes a single file faster than the lanes can, batching only adds copies
+        return algorithm == HashAlgorithm::Sha256 &&
+               size <= options.multiBufferThreshold &&
+               Sha256MultiBuffer::defaultImplementation() != Sha256MultiBuffer::Implementation::OpenSsl;
+    }
+
+    BlockingFileHashReader::BlockingFileHashReader(int jobs, IoOptions options, HashAlgorithm algorithm) :
+        m_jobs(jobs),
+        m_options(options),
+        m_algorithm(algorithm)
+    {
+    }
+
+    std::vector<std::vector<std::byte>> BlockingFileHashReader::hash(const std::vector<FileHashRequest>& requests,
+                                                                     const ProgressFunction& progress)
+    {
+        constexpr size_t BatchSize = 64;
+
+        std::vector<std::vector<std::byte>> result(requests.size());
+
+        std::vector<std::vector<size_t>> batches;
+        std::vector<size_t> largeFiles;
+        for (size_t i = 0; i < requests.size(); i++) {
+            if (!useMultiBuffer(m_options, m_algorithm, requests[i].size)) {
+                largeFiles.push_back(i);
+                continue;
+            }
+
+            if (batches.empty() || batches.back().size() == BatchSize) {
+                batches.emplace_back();
+            }
+            batches.back().push_back(i);
+        }
+
+        WorkerPool workerPool(m_jobs);
+        workerPool.forEach(batches.size(), [&](size_t batchIndex) {
+            auto& batch = batches[batchIndex];
+
+            std::vector<std::string> paths;
+            for (auto i : batch) {
+                paths.push_back(requests[i].path);
+            }
+
+            auto hashes = Backer::sha256Files(paths);
+            for (size_t j = 0; j < batch.size(); j++) {
+                result[batch[j]] = std::move(hashes[j]);
+                if (progress) {
+                    progress(batch[j], result[batch[j]]);
+                }
+            }
+        });
+
+        workerPool.forEach(largeFiles.size(), [&](size_t largeFileIndex) {
+            auto i = largeFiles[largeFileIndex];
+            result[i] = Backer::hashFile(requests[i].path, m_algorithm, m_options.bufferSize);
+            if (progress) {
+                progress(i, result[i]);
+            }
+        });
+
+        return result;
+    }
+
+} // namespace backer
@@ -0,0 +1,108 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FILE_HASH_READER_H
+#define FILE_HASH_READER_H
+
+#include "katla/core/core.h"
+
+#include "hasher.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace backer {
+
+enum class IoBackend { Auto, Blocking, IoUring };
+
+// Order in which files are read, see ReadScheduler
+enum class ReadOrder { Auto, Scan, Inode, Extent };
+
+struct IoOptions
+{
+    IoBackend backend { IoBackend::Auto };
+    size_t bufferSize { 128 * 1024 }; // Size of a single read
+    unsigned queueDepth { 64 }; // Maximum number of reads in flight per hashing thread
+    uint64_t multiBufferThreshold { 16 * 1024 }; // Sha256 files up to this size are hashed in batches, 0 disables
+    ReadOrder readOrder { ReadOrder::Auto }; // Auto sorts reads by physical offset on rotational disks only
+    int rotationalJobs { 1 }; // Hashing threads per rotational disk, other devices use all threads
+    bool hashCache { false }; // Reuse and store hashes in extended attributes of the files, see FileHashCache
+};
+
+struct FileHashRequest
+{
+    std::string path;
+    uint64_t size { 0 }; // Size found while scanning, used to plan the reads
+    uint64_t device { 0 }; // Files on different devices are read at the same time
+};
+
+// Reads and hashes many files at once, the backend decides how reads are scheduled
+class FileHashReader {
+public:
+    // Called as soon as a file is hashed, with the same hash that is returned for it
+    using ProgressFunction = std::function<void(size_t requestIndex, const std::vector<std::byte>& hash)>;
+
+    virtual ~FileHashReader() = default;
+
+    // Reads every device with a backend of its own, see PerDeviceFileHashReader, and adds the hash cache when enabled
+    static std::unique_ptr<FileHashReader> create(int jobs, IoOptions options, HashAlgorithm algorithm = HashAlgorithm::Sha256);
+
+    // Picks the backend from the options, falls back to blocking reads when io_uring is not available
+    static std::unique_ptr<FileHashReader> createBackend(int jobs, IoOptions options, HashAlgorithm algorithm);
+
+    // Name of the backend createBackend picks for the options
+    static std::string backendName(const IoOptions& options);
+
+    static IoBackend parseBackend(const std::string& backend);
+
+    // Whether a file of this size is hashed in a multi-buffer batch together with other small files
+    static bool useMultiBuffer(const IoOptions& options, HashAlgorithm algorithm, uint64_t size);
+
+    virtual std::string name() const = 0;
+
+    // Returns the hash of every request, in request order. The progress function can be called from any thread.
+    virtual std::vector<std::vector<std::byte>> hash(const std::vector<FileHashRequest>& requests,
+                                                     const ProgressFunction& progress = {}) = 0;
+
+    virtual void printStatistics() const {
+    }
+};
+
+// One blocking read loop per file, files are spread over a worker pool
+class BlockingFileHashReader : public FileHashReader {
+public:
+    BlockingFileHashReader(int jobs, IoOptions options, HashAlgorithm algorithm);
+
+    std::string name() const override {
+        return "blocking";
+    }
+
+    std::vector<std::vector<std::byte>> hash(const std::vector<FileHashRequest>& requests,
+                                             const ProgressFunction& progress = {}) override;
+
+private:
+    int m_jobs;
+    IoOptions m_options;
+    HashAlgorithm m_algorithm;
+};
+
+} // namespace backer
+
+#endif
@@ -0,0 +1,143 @@
+#include "file-index-compare.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+namespace backer {
+
+    FileIndexComparison FileIndexCompare::compare(const std::string& srcIndexPath, const std::string& destIndexPath) {
+        std::string srcAlgorithm;
+        auto srcRecords = readFiles(srcIndexPath, srcAlgorithm);
+
+        if (FileIndexSnapshot::isSnapshot(destIndexPath)) {
+            auto destSnapshot = FileIndexSnapshot::open(destIndexPath);
+            requireSameHashAlgorithm(srcIndexPath, srcAlgorithm, destIndexPath, destSnapshot.hashAlgorithm());
+
+            return compare(srcRecords, destSnapshot);
+        }
+
+        std::string destAlgorithm;
+        auto destRecords = readFiles(destIndexPath, destAlgorithm);
+        requireSameHashAlgorithm(srcIndexPath, srcAlgorithm, destIndexPath, destAlgorithm);
+
+        return compare(srcRecords, destRecords);
+    }
+
+    void FileIndexCompare::requireSameHashAlgorithm(const std::string& srcIndexPath, const std::string& srcAlgorithm,
+                                                    const std::string& destIndexPath, const std::string& destAlgorithm) {
+        if (srcAlgorithm != destAlgorithm) {
+            throw std::runtime_error(katla::format("File-index {} uses {} and {} uses {}, their hashes can't be compared",
+                                                   srcIndexPath, srcAlgorithm, destIndexPath, destAlgorithm));
+        }
+    }
+
+    FileIndexComparison FileIndexCompare::compare(const std::unordered_map<std::string, FileIndexRecord>& srcRecords,
+                                                  const std::unordered_map<std::string, FileIndexRecord>& destRecords) {
+        FileIndexComparison result;
+
+        // A file at the same path with the same content is the obvious match, otherwise any dest file will do
+        std::unordered_map<Digest, const std::string*, DigestHash> destFilesByHash;
+        destFilesByHash.reserve(destRecords.size());
+        for (auto& [file, record] : destRecords) {
+            if (record.type == FileSystemEntryType::File && !FileIndexReader::isIndexFile(file)) {
+                destFilesByHash.emplace(record.hash, &file);
+            }
+        }
+
+        std::unordered_set<Digest, DigestHash> srcHashes;
+        srcHashes.reserve(srcRecords.size());
+        for (auto& [file, record] : srcRecords) {
+            if (record.type != FileSystemEntryType::File || FileIndexReader::isIndexFile(file)) {
+                continue;
+            }
+            srcHashes.insert(record.hash);
+
+            auto samePath = destRecords.find(file);
+            if (samePath != destRecords.end() && samePath->second.type == FileSystemEntryType::File && samePath->second.hash == record.hash) {
+                result.atBoth.emplace_back(file, file);
+                continue;
+            }
+
+            auto findIt = destFilesByHash.find(record.hash);
+            if (findIt != destFilesByHash.end()) {
+                result.atBoth.emplace_back(file, *findIt->second);
+            } else {
+                result.onlyAtSrc.push_back(file);
+            }
+        }
+
+        for (auto& [file, record] : destRecords) {
+            if (record.type == FileSystemEntryType::File && !FileIndexReader::isIndexFile(file) && srcHashes.find(record.hash) == srcHashes.end()) {
+                result.onlyAtDest.push_back(file);
+            }
+        }
+
+        std::sort(result.onlyAtSrc.begin(), result.onlyAtSrc.end());
+        std::sort(result.onlyAtDest.begin(), result.onlyAtDest.end());
+        std::sort(result.atBoth.begin(), result.atBoth.end());
+        return result;
+    }
+
+    FileIndexComparison FileIndexCompare::compare(const std::unordered_map<std::string, FileIndexRecord>& srcRecords,
+                                                  const FileIndexSnapshot& destSnapshot) {
+        FileIndexComparison result;
+
+        destSnapshot.advise(SnapshotAccess::Lookup);
+
+        std::unordered_set<Digest, DigestHash> srcHashes;
+        srcHashes.reserve(srcRecords.size());
+        for (auto& [file, record] : srcRecords) {
+            if (record.type != FileSystemEntryType::File || FileIndexReader::isIndexFile(file)) {
+                continue;
+            }
+            srcHashes.insert(record.hash);
+
+            auto [first, last] = destSnapshot.find(record.hash);
+            if (first == last) {
+                result.onlyAtSrc.push_back(file);
+                continue;
+            }
+
+            // Same preference as with records, a file at the same path with the same content. Records with the same
+            // hash are sorted by path index, so a common hash costs two binary searches instead of a pass over its files.
+            auto match = first;
+            auto pathIndex = destSnapshot.findPath(file);
+            if (pathIndex) {
+                auto samePath = std::lower_bound(first, last, *pathIndex, [](const FileIndexSnapshotRecord& destRecord, uint64_t value) {
+                    return destRecord.pathIndex < value;
+                });
+                if (samePath != last && samePath->pathIndex == *pathIndex) {
+                    match = samePath;
+                }
+            }
+            result.atBoth.emplace_back(file, std::string(destSnapshot.path(*match)));
+        }
+
+        destSnapshot.advise(SnapshotAccess::Scan);
+        for (size_t i = 0; i < destSnapshot.size(); i++) {
+            auto& record = destSnapshot.record(i);
+            if (srcHashes.find(record.hash) == srcHashes.end()) {
+                result.onlyAtDest.emplace_back(destSnapshot.path(record));
+            }
+        }
+
+        std::sort(result.onlyAtSrc.begin(), result.onlyAtSrc.end());
+        std::sort(result.onlyAtDest.begin(), result.onlyAtDest.end());
+        std::sort(result.atBoth.begin(), result.atBoth.end());
+        return result;
+    }
+
+    std::unordered_map<std::string, FileIndexRecord> FileIndexCompare::readFiles(const std::string& indexPath, std::string& hashAlgorithm) {
+        auto reader = FileIndexReader::open(indexPath);
+        if (!reader.isComplete()) {
+            throw std::runtime_error(katla::format("File-index {} is incomplete, create it again before comparing", indexPath));
+        }
+        if (!reader.hasColumn("fileIndex", "inode")) {
+            throw std::runtime_error(katla::format("File-index {} is too old to compare, create it again", indexPath));
+        }
+
+        hashAlgorithm = reader.hashAlgorithm();
+        return reader.readRecords();
+    }
+
+} // namespace backer
@@ -0,0 +1,63 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FILE_INDEX_COMPARE_H
+#define FILE_INDEX_COMPARE_H
+
+#include "katla/core/core.h"
+
+#include "file-index-reader.h"
+#include "file-index-snapshot.h"
+
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace backer {
+
+struct FileIndexComparison
+{
+    std::vector<std::string> onlyAtSrc; // Files without any file of the same content at dest
+    std::vector<std::string> onlyAtDest; // Files without any file of the same content at src
+    std::vector<std::pair<std::string, std::string>> atBoth; // Source file and a dest file with the same content
+};
+
+// Compares two trees by the file hashes stored in their indexes, no file content is read. Files are matched on
+// content only, a file that moved or was renamed at dest is still at both.
+class FileIndexCompare {
+public:
+    // The dest index can also be a snapshot, see FileIndexSnapshot
+    static FileIndexComparison compare(const std::string& srcIndexPath, const std::string& destIndexPath);
+
+    static FileIndexComparison compare(const std::unordered_map<std::string, FileIndexRecord>& srcRecords,
+                                       const std::unordered_map<std::string, FileIndexRecord>& destRecords);
+
+    // Looks up every src file in the snapshot where it is mapped, dest is never loaded
+    static FileIndexComparison compare(const std::unordered_map<std::string, FileIndexRecord>& srcRecords,
+                                       const FileIndexSnapshot& destSnapshot);
+
+    // Throws when two indexes were hashed with different algorithms, their hashes never match
+    static void requireSameHashAlgorithm(const std::string& srcIndexPath, const std::string& srcAlgorithm,
+                                         const std::string& destIndexPath, const std::string& destAlgorithm);
+
+    // Records of a complete index with stat columns, along with the name of its hash algorithm
+    static std::unordered_map<std::string, FileIndexRecord> readFiles(const std::string& indexPath, std::string& hashAlgorithm);
+};
+
+} // namespace backer
+
+#endif
@@ -2,14 +2,23 @@
 
 #include "file-group-set.h"
 #include "file-tree.h"
+#include "read-scheduler.h"
+#include "worker-pool.h"
 
 #include "katla/core/posix-file.h"
 #include "backer.h"
 
 #include <filesystem>
 #include <openssl/md5.h>
+#include <sys/stat.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <exception>
+#include <iterator>
+#include <thread>
+#include <unordered_set>
 
 namespace backer {
 
@@ -18,116 +27,501 @@ namespace backer {
     FileIndexDatabase::FileIndexDatabase() {
     }
 
-    FileIndexDatabase FileIndexDatabase::create(std::string indexDatabasePath, std::string indexSource) {
+    FileIndexDatabase FileIndexDatabase::create(std::string indexDatabasePath, std::string indexSource, FileIndexOptions options) {
         FileIndexDatabase result;
+        result.m_options = options;
 
-        result.createSqliteDatabase(indexDatabasePath);
+        result.loadPreviousIndex(indexDatabasePath);
+        result.createIndexWriter(indexDatabasePath);
         result.fillDatabase(indexSource);
         return result;
     }
 
-    void FileIndexDatabase::createSqliteDatabase(std::string path) {
-        katla::printInfo("Creating file index: {}", path);
+    void FileIndexDatabase::loadPreviousIndex(std::string path) {
+        if (!fs::exists(path)) {
+            if (m_options.update) {
+                katla::printInfo("No existing file index at {}, indexing all files", path);
+            }
+            return;
+        }
+
+        // An interrupted run is always resumed, a complete index is only reused when updating. Without updating
+        // nothing is read from a file that isn't an interrupted index, it is replaced.
+        bool resume = FileIndexReader::isIncompleteIndex(path);
+        if (!m_options.update && !resume) {
+            return;
+        }
+
+        auto reader = FileIndexReader::open(path);
+
+        if (resume) {
+            katla::printInfo("Resuming interrupted file index {}", path);
+        }
+
+        if (!reader.hasColumn("fileIndex", "inode") || !reader.hasColumn("fileIndex", "hash")) {
+            katla::printInfo("Existing file index has no stat information, indexing all files");
+            return;
+        }
 
-        auto createResult = m_database.create(path);
-        if (!createResult) {
-            throw std::runtime_error(katla::format("Failed creating file-index: {}", createResult.error().message()));
+        auto previousAlgorithm = reader.hashAlgorithm();
+        if (previousAlgorithm != Hasher::algorithmName(m_options.hashAlgorithm)) {
+            katla::printInfo("Existing file index uses {} instead of {}, indexing all files",
+                             previousAlgorithm,
+                             Hasher::algorithmName(m_options.hashAlgorithm));
+            return;
         }
 
-        m_database.init();
+        if (m_options.chunking) {
+            auto description = FastCdc(m_options.chunkingOptions).description();
+            if (reader.chunking() != description) {
+                katla::printInfo("Existing file index has no chunks cut as {}, indexing all files", description);
+                return;
+            }
+        }
+
+        m_previousRecords = reader.readRecords();
+
+        if (m_options.chunking) {
+            reader.readChunks([&](int64_t fileId, const FileChunk& chunk) {
+                m_previousChunks[fileId].push_back(chunk);
+            });
+        }
+
+        if (reader.directoryHashVersion() != DirectoryHashVersion) {
+            katla::printInfo("Existing file index hashes directories differently, rehashing all directories");
+            for (auto it = m_previousRecords.begin(); it != m_previousRecords.end();) {
+                it = (it->second.type == FileSystemEntryType::Dir) ? m_previousRecords.erase(it) : std::next(it);
+            }
+        }
+
+        katla::printInfo("Loaded {} entries from existing file index", m_previousRecords.size());
+    }
+
+    void FileIndexDatabase::createIndexWriter(std::string path) {
+        katla::printInfo("Creating file index: {}", path);
+        m_writer = FileIndexWriter::create(path, m_options.hashAlgorithm, m_options.jobs);
+
+        if (m_options.chunking) {
+            m_writer.setChunking(FastCdc(m_options.chunkingOptions).description());
+        }
     }
 
     void FileIndexDatabase::fillDatabase(std::string path) {
         katla::printInfo("Retreiving file list...");
 
-        auto fileSystemEntry = FileTree::create(path);
+        auto tree = FileTree::create(path, m_options.jobs);
+        katla::printInfo("Scanned {} files and {} directories using {} bytes, {} bytes per entry",
+                         tree.nrOfFiles(),
+                         tree.nrOfDirectories(),
+                         tree.memoryUsage(),
+                         tree.memoryUsage() / tree.size());
+
+        m_writer.addDirectories(tree);
+
+        std::vector<char> reused;
+        auto filesToHash = reuseUnchangedFiles(tree, reused);
+        auto hardLinks = removeHardLinks(tree, filesToHash);
+        orderReads(tree, filesToHash);
+
+        auto fileHashReader = FileHashReader::create(m_options.jobs, m_options.io, m_options.hashAlgorithm);
+        FastCdc chunker(m_options.chunkingOptions);
+        if (m_options.chunking) {
+            katla::printInfo("Hashing {} files with {} in chunks of {} bytes on average...",
+                             filesToHash.size(),
+                             Hasher::algorithmName(m_options.hashAlgorithm),
+                             chunker.options().averageSize);
+        } else {
+            katla::printInfo("Hashing {} files with {} using {} reads...",
+                             filesToHash.size(),
+                             Hasher::algorithmName(m_options.hashAlgorithm),
+                             fileHashReader->name());
+        }
 
-        auto flatList = FileTree::flatten(fileSystemEntry);
+        // Once the scan is done, the walk over the files to hash, hashing and database writes run at the same time.
+        // Each queue gets a quarter of the memory limit and a batch of requests an eighth, so a queue always holds at
+        // least two batches. The scan itself does not overlap with hashing and the scanned tree stays in memory, so
+        // memory grows with the number of entries: nodes only get their index once the whole tree is listed, and the
+        // writer and the directory hashes refer to nodes by that index.
+        const size_t queueCapacity = std::max<size_t>(1, m_options.pipelineMemoryLimit / 4);
+        const size_t batchCost = std::max<size_t>(1, m_options.pipelineMemoryLimit / 8);
+
+        BoundedQueue<std::pair<std::vector<NodeIndex>, std::vector<FileHashRequest>>> requestQueue(queueCapacity);
+        BoundedQueue<HashedFile> hashedFileQueue(queueCapacity);
+
+        auto runStage = [](std::exception_ptr& error, const std::function<void()>& stage) {
+            try {
+                stage();
+            } catch (...) {
+                error = std::current_exception();
+            }
+        };
+
+        std::exception_ptr walkError;
+        std::thread walkThread([&]() {
+            runStage(walkError, [&]() {
+                std::vector<NodeIndex> indices;
+                std::vector<FileHashRequest> requests;
+                size_t cost = 0;
+
+                for (auto index : filesToHash) {
+                    requests.push_back({tree.absolutePath(index), tree.node(index).size, tree.node(index).device});
+                    indices.push_back(index);
+                    // The hash of the request is accounted for up front, it replaces the request when hashed
+                    cost += sizeof(NodeIndex) + sizeof(FileHashRequest) + requests.back().path.size() + sizeof(HashedFile);
+
+                    if (cost >= batchCost) {
+                        if (!requestQueue.push({std::move(indices), std::move(requests)}, cost)) {
+                            return;
+                        }
+                        indices.clear();
+                        requests.clear();
+                        cost = 0;
+                    }
+                }
 
-        std::vector<std::pair<std::string, std::vector<std::byte>>> fileHashList;
+                if (!indices.empty()) {
+                    requestQueue.push({std::move(indices), std::move(requests)}, cost);
+                }
+            });
+            requestQueue.close();
+        });
+
+        std::exception_ptr hashError;
+        std::thread hashThread([&]() {
+            runStage(hashError, [&]() {
+                std::atomic<size_t> idx {0};
+                WorkerPool chunkingPool(m_options.jobs);
+                while (auto batch = requestQueue.pop()) {
+                    auto& indices = batch->first;
+
+                    // Every hash is handed on as soon as it is known, a batch of large files can take hours
+                    std::atomic<bool> stopped {false};
+                    if (m_options.chunking) {
+                        // Chunks are cut and hashed in the same pass that hashes the whole file
+                        chunkingPool.forEach(indices.size(), [&](size_t i) {
+                            if (stopped) {
+                                return;
+                            }
+
+                            HashedFile hashedFile;
+                            hashedFile.index = indices[i];
+                            hashedFile.chunks = chunker.chunkFile(batch->second[i].path, m_options.hashAlgorithm, hashedFile.hash);
+
+                            katla::printInfo("{}/{} {}", ++idx, filesToHash.size(), tree.relativePath(indices[i]));
+                            size_t cost = sizeof(HashedFile) + hashedFile.chunks.size() * sizeof(FileChunk);
+                            if (!hashedFileQueue.push(std::move(hashedFile), cost)) {
+                                stopped = true;
+                            }
+                        });
+                    } else {
+                        fileHashReader->hash(batch->second, [&](size_t i, const std::vector<std::byte>& hash) {
+                            if (m_options.io.hashCache) {
+                                refreshChangeTime(tree, indices[i]);
+                            }
+                            katla::printInfo("{}/{} {}", ++idx, filesToHash.size(), tree.relativePath(indices[i]));
+                            HashedFile hashedFile;
+                            hashedFile.index = indices[i];
+                            hashedFile.hash = Hasher::toDigest(hash);
+                            if (!hashedFileQueue.push(std::move(hashedFile), sizeof(HashedFile))) {
+                                stopped = true;
+                            }
+                        });
+                    }
+
+                    if (stopped) {
+                        break;
+                    }
+                }
+            });
+
+            // Stops the walk as well when hashing ended early
+            requestQueue.close();
+            hashedFileQueue.close();
+        });
+
+        std::exception_ptr writeError;
+        bool written = false;
+        runStage(writeError, [&]() {
+            written = writeEntries(tree, reused, hardLinks, hashedFileQueue);
+            m_writer.finish();
+        });
+
+        requestQueue.close();
+        hashedFileQueue.close();
+        walkThread.join();
+        hashThread.join();
+
+        m_previousRecords.clear();
+        m_previousChunks.clear();
+        fileHashReader->printStatistics();
+
+        for (auto& error : {walkError, hashError, writeError}) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+        if (!written) {
+            katla::printError("File index is incomplete");
+        }
+    }
 
-        size_t idx = 0;
-        processEntry(fileSystemEntry, fileHashList, idx, flatList.size());
-        
-        auto openResult = m_database.open();
-        if (!openResult) {
-            katla::printError("Opering table failed!: {}", openResult.error().message());
+    void FileIndexDatabase::refreshChangeTime(FileTree& tree, NodeIndex index) const
+    {
+        struct stat statResult {};
+        if (::lstat(tree.absolutePath(index).c_str(), &statResult) != 0) {
             return;
         }
 
-        std::string sqlCreateTableQuery = katla::format("CREATE TABLE IF NOT EXISTS fileIndex (id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, file TEXT, sha256 TEXT);");
-        auto createTableQueryResult = m_database.exec(sqlCreateTableQuery);
-        if (!createTableQueryResult) {
-            katla::printError("Creating table failed!: {}", createTableQueryResult.error().message());
+        auto& node = tree.node(index);
+        auto modificationTime = static_cast<int64_t>(statResult.st_mtim.tv_sec) * 1000000000 + statResult.st_mtim.tv_nsec;
+        if (static_cast<uint64_t>(statResult.st_size) != node.size ||
+            modificationTime != node.modificationTime ||
+            statResult.st_ino != node.inode) {
             return;
         }
 
-        constexpr int BatchSize = 1024;
-        const int fileHashListSize = fileHashList.size();
+        node.changeTime = static_cast<int64_t>(statResult.st_ctim.tv_sec) * 1000000000 + statResult.st_ctim.tv_nsec;
+    }
 
-        for (int i = 0; i < fileHashList.size(); i += BatchSize) {
+    const FileIndexRecord* FileIndexDatabase::findUnchanged(const FileTree& tree, NodeIndex index) const
+    {
+        if (m_previousRecords.empty()) {
+            return nullptr;
+        }
 
-            auto beginTransactionResult = m_database.exec("BEGIN TRANSACTION;");
-            if (!beginTransactionResult) {
-                katla::printError("Error beginning transaction!: {}", beginTransactionResult.error().message());
-                return;
+        auto findIt = m_previousRecords.find(tree.relativePath(index));
+        if (findIt == m_previousRecords.end()) {
+            return nullptr;
+        }
+
+        auto& node = tree.node(index);
+        auto& record = findIt->second;
+        if (record.size != node.size ||
+            record.modificationTime != node.modificationTime ||
+            record.changeTime != node.changeTime ||
+            record.inode != node.inode) {
+            return nullptr;
+        }
+
+        return &record;
+    }
+
+    std::vector<NodeIndex> FileIndexDatabase::reuseUnchangedFiles(FileTree& tree, std::vector<char>& reused)
+    {
+        reused.assign(tree.size(), false);
+
+        // Unchanged files keep their stored hash and are never read
+        std::vector<NodeIndex> filesToHash;
+        filesToHash.reserve(tree.nrOfFiles());
+        tree.forEachFile([&](NodeIndex index) {
+            auto record = findUnchanged(tree, index);
+            if (record) {
+                tree.node(index).hash = record->hash;
+                reused[index] = true;
+            } else {
+                filesToHash.push_back(index);
             }
+        });
 
-            for (int batchIndex = 0; batchIndex < BatchSize; batchIndex++) {
-                if ((i + batchIndex) >= fileHashList.size()) {
-                    break;
+        if (!m_previousRecords.empty()) {
+            katla::printInfo("Reusing hashes of {} unchanged files", tree.nrOfFiles() - filesToHash.size());
+        }
+
+        return filesToHash;
+    }
+
+    HardLinks FileIndexDatabase::removeHardLinks(const FileTree& tree, std::vector<NodeIndex>& filesToHash) const
+    {
+        HardLinks hardLinks;
+        std::unordered_map<InodeId, NodeIndex, InodeIdHash> firstLinks;
+        size_t nrOfLinks = 0;
+
+        auto end = std::remove_if(filesToHash.begin(), filesToHash.end(), [&](NodeIndex index) {
+            auto& node = tree.node(index);
+            if (!node.hardLinked) {
+                return false;
+            }
+
+            auto [it, inserted] = firstLinks.emplace(node.inodeId(), index);
+            if (inserted) {
+                return false;
+            }
+
+            hardLinks[it->second].push_back(index);
+            nrOfLinks++;
+            return true;
+        });
+        filesToHash.erase(end, filesToHash.end());
+
+        if (nrOfLinks > 0) {
+            katla::printInfo("Skipping {} hard links to files that are hashed through another path", nrOfLinks);
+        }
+
+        return hardLinks;
+    }
+
+    void FileIndexDatabase::orderReads(const FileTree& tree, std::vector<NodeIndex>& filesToHash) const
+    {
+        if (m_options.io.readOrder == ReadOrder::Scan) {
+            return;
+        }
+
+        std::vector<InodeId> inodes;
+        inodes.reserve(filesToHash.size());
+        for (auto index : filesToHash) {
+            inodes.push_back(tree.node(index).inodeId());
+        }
+
+        auto order = ReadScheduler::schedule(m_options.io.readOrder, m_options.jobs, inodes, [&](size_t i) {
+            return tree.absolutePath(filesToHash[i]);
+        });
+
+        std::vector<NodeIndex> orderedFiles;
+        orderedFiles.reserve(filesToHash.size());
+        for (auto i : order) {
+            orderedFiles.push_back(filesToHash[i]);
+        }
+        filesToHash = std::move(orderedFiles);
+    }
+
+    bool FileIndexDatabase::writeEntries(FileTree& tree, const std::vector<char>& reused, const HardLinks& hardLinks, BoundedQueue<HashedFile>& hashedFiles)
+    {
+        const size_t nrOfEntries = tree.size();
+        size_t nrOfWritten = 0;
+
+        auto insert = [&](NodeIndex index) {
+            m_writer.write(tree, index);
+            nrOfWritten++;
+        };
+
+        // A directory is hashed and written once its last child is, changed marks entries with a new hash
+        std::vector<NodeIndex> remainingChildren(nrOfEntries, 0);
+        std::vector<char> changed(nrOfEntries, false);
+
+        // Hard links share their content, its chunks are written for the first path of the inode only
+        std::unordered_set<InodeId, InodeIdHash> chunkedInodes;
+        auto writeChunks = [&](NodeIndex index, const std::vector<FileChunk>& chunks) {
+            auto& node = tree.node(index);
+            if (!node.hardLinked || chunkedInodes.insert(node.inodeId()).second) {
+                m_writer.writeChunks(index, chunks);
+            }
+        };
+
+        auto complete = [&](NodeIndex index) {
+            while (true) {
+                insert(index);
+
+                auto parent = tree.node(index).parent;
+                if (parent == NoNode) {
+                    return;
                 }
 
-                auto& pair = fileHashList[i + batchIndex];
-                if (pair.first.size() == 0) {
-                    continue;
+                changed[parent] = changed[parent] || changed[index];
+                if (--remainingChildren[parent] > 0) {
+                    return;
                 }
 
-                std::vector<std::pair<std::string, std::string>> values = {{"file", pair.first}, {"sha256", Backer::formatHash(pair.second)}};
+                hashDirectory(tree, parent, changed);
+                index = parent;
+            }
+        };
 
-                auto insertQueryResult = m_database.insert("fileIndex", values);
-                if (!insertQueryResult) {
-                    katla::printError("Inserting into fileindex failed!: {} - {}", insertQueryResult.error().message(), insertQueryResult.error().description());
-                    return;
+        for (NodeIndex index = 0; index < nrOfEntries; index++) {
+            remainingChildren[index] = tree.node(index).childCount;
+        }
+
+        for (NodeIndex index = 0; index < nrOfEntries; index++) {
+            auto& node = tree.node(index);
+            bool ready = (node.type == FileSystemEntryType::File) ? reused[index] : node.childCount == 0;
+            if (!ready) {
+                continue;
+            }
+
+            if (node.type != FileSystemEntryType::File) {
+                hashDirectory(tree, index, changed);
+            } else if (m_options.chunking) {
+                auto record = findUnchanged(tree, index);
+                auto chunks = m_previousChunks.find(record->id);
+                if (chunks != m_previousChunks.end()) {
+                    writeChunks(index, chunks->second);
                 }
             }
 
-            katla::printInfo("Saving database: {}/{}", i+1, fileHashListSize);
+            complete(index);
+        }
+
+        // Everything taken over from the previous index is in, from here on rows are committed as they arrive
+        m_writer.commit();
 
-            auto commitTransactionResult = m_database.exec("COMMIT TRANSACTION;");
-            if (!commitTransactionResult) {
-                katla::printError("Error commiting transaction!: {} - {}", commitTransactionResult.error().message(), commitTransactionResult.error().description());
-                return;
+        constexpr auto IdleCommitInterval = std::chrono::seconds(1);
+        while (true) {
+            auto hashedFile = hashedFiles.pop(IdleCommitInterval);
+            if (!hashedFile) {
+                if (hashedFiles.drained()) {
+                    break;
+                }
+
+                // Nothing arrived for a while, put what was written so far on disk
+                m_writer.commit();
+                continue;
+            }
+
+            tree.node(hashedFile->index).hash = hashedFile->hash;
+            changed[hashedFile->index] = true;
+
+            writeChunks(hashedFile->index, hashedFile->chunks);
+            complete(hashedFile->index);
+
+            auto links = hardLinks.find(hashedFile->index);
+            if (links == hardLinks.end()) {
+                continue;
+            }
+
+            for (auto link : links->second) {
+                tree.node(link).hash = hashedFile->hash;
+                tree.node(link).changeTime = tree.node(hashedFile->index).changeTime; // Same inode
+                changed[link] = true;
+                complete(link);
             }
         }
 
-        m_database.close();
+        return nrOfWritten == nrOfEntries;
     }
 
-    std::vector<std::byte> FileIndexDatabase::processEntry(const FileSystemEntry& entry, std::vector<std::pair<std::string, std::vector<std::byte>>>& fileHashList, size_t& idx, size_t totalCount)
+    void FileIndexDatabase::hashDirectory(FileTree& tree, NodeIndex index, std::vector<char>& changed) const
     {
-        if (entry.type == FileSystemEntryType::File) {
-            auto sha256 = Backer::sha256(entry.absolutePath);
+        auto& node = tree.node(index);
 
-            fileHashList.push_back({entry.relativePath, sha256});
-            katla::printInfo("{}/{} {}", ++idx, totalCount, entry.relativePath);
-            return sha256;
-        }
+        // A directory only needs a new hash when one of its children changed, or when entries were
+        // added or removed, which updates the directory's own stat tuple
+        const FileIndexRecord* record = changed[index] ? nullptr : findUnchanged(tree, index);
+        changed[index] = (record == nullptr);
 
-        if (entry.type != FileSystemEntryType::Dir) {
-            return {};
+        if (record) {
+            node.hash = record->hash;
+            return;
         }
 
-        std::vector<std::vector<std::byte>> dirHashes;
-        for (auto& file : entry.children.value()) {
-            auto processResult = processEntry(file, fileHashList, idx, totalCount);
-            dirHashes.push_back(processResult);
+        // Children are hashed by name with their type, so the hash doesn't depend on the order the file system
+        // lists them in and equal hashes mean equal subtrees, see FileIndexDiff
+        std::vector<NodeIndex> children(node.childCount);
+        for (uint32_t i = 0; i < node.childCount; i++) {
+            children[i] = node.firstChild + i;
+        }
+        std::sort(children.begin(), children.end(), [&](NodeIndex left, NodeIndex right) {
+            return tree.name(left) < tree.name(right);
+        });
+
+        auto hasher = Hasher::create(m_options.hashAlgorithm);
+        for (auto child : children) {
+            auto name = tree.name(child);
+            auto type = static_cast<std::byte>(tree.node(child).type);
+            hasher->update(reinterpret_cast<const std::byte*>(name.data()), name.size());
+            hasher->update(&type, 1);
+            hasher->update(tree.node(child).hash.data(), Hasher::digestSize(m_options.hashAlgorithm));
         }
 
-        katla::printInfo("{}/{} {}", ++idx, totalCount, entry.relativePath);
-        auto result = Backer::sha256(dirHashes);
-        fileHashList.push_back({entry.relativePath, result});
-        return result;
+        node.hash = Hasher::toDigest(hasher->final());
     }
 
 } // namespace backer
\ No newline at end of file
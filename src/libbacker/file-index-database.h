@@ -18,31 +18,89 @@
 #define FILE_INDEX_DATABASE_H
 
 #include "katla/core/core.h"
-#include "katla/sqlite/sqlite-database.h"
 
-#include "file-data.h"
+#include "bounded-queue.h"
+#include "fast-cdc.h"
+#include "file-hash-reader.h"
+#include "file-index-reader.h"
+#include "file-index-writer.h"
+#include "file-tree.h"
+#include "hasher.h"
 
 #include <cstddef>
 #include <cstdint>
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
 
 namespace backer {
 
+struct FileIndexOptions
+{
+    int jobs { 0 }; // Number of hashing threads, 0 uses all hardware threads
+    bool update { false }; // Reuse hashes from an existing index for entries with an unchanged stat tuple
+    IoOptions io;
+    HashAlgorithm hashAlgorithm { HashAlgorithm::Sha256 };
+    // Bytes queued between the walk, hashing and database stages. The scanned tree and the per entry bookkeeping
+    // of the stages are not included, they grow with the number of entries.
+    size_t pipelineMemoryLimit { 16 * 1024 * 1024 };
+    // Store the content-defined chunks of every file as well, once per hard linked inode. Files are read without the
+    // hash cache then.
+    bool chunking { false };
+    ChunkingOptions chunkingOptions;
+};
+
+struct HashedFile
+{
+    NodeIndex index { 0 };
+    Digest hash {};
+    std::vector<FileChunk> chunks;
+};
+
+// The first path of a hard linked file that is hashed, with the other paths linking to the same inode
+using HardLinks = std::unordered_map<NodeIndex, std::vector<NodeIndex>>;
+
 class FileIndexDatabase {
 public:
     FileIndexDatabase();
 
-    static FileIndexDatabase create(std::string indexDatabasePath, std::string indexSource);
+    static FileIndexDatabase create(std::string indexDatabasePath, std::string indexSource, FileIndexOptions options = {});
 
 private:
-    void createSqliteDatabase(std::string path);
+    void loadPreviousIndex(std::string path);
+    void createIndexWriter(std::string path);
+    // Scans the whole tree first, then hashes and writes the files that changed while the hashes come in
     void fillDatabase(std::string path);
 
-    std::vector<std::byte> processEntry(const FileSystemEntry& entry, std::vector<std::pair<std::string, std::vector<std::byte>>>& fileHashList, size_t& idx, size_t totalCount);
+    const FileIndexRecord* findUnchanged(const FileTree& tree, NodeIndex index) const;
+
+    // Storing a hash in the hash cache changes the change time of the file. The index takes the new one, so the next
+    // update doesn't take the file for changed, as long as the file still has the size and modification time it
+    // was scanned with.
+    void refreshChangeTime(FileTree& tree, NodeIndex index) const;
+
+    // Fills in the hashes found in the previous index, reused marks those files. Returns the files left to hash.
+    std::vector<NodeIndex> reuseUnchangedFiles(FileTree& tree, std::vector<char>& reused);
+
+    // Leaves only the first path of every hard linked inode in filesToHash, the other paths get its hash
+    HardLinks removeHardLinks(const FileTree& tree, std::vector<NodeIndex>& filesToHash) const;
+
+    // Sorts the files by where they are stored when the read order asks for it
+    void orderReads(const FileTree& tree, std::vector<NodeIndex>& filesToHash) const;
+
+    // Writes every entry as soon as its hash is known, a directory follows once all of its children are written.
+    // Returns false when hashedFiles was closed before all files arrived.
+    bool writeEntries(FileTree& tree, const std::vector<char>& reused, const HardLinks& hardLinks, BoundedQueue<HashedFile>& hashedFiles);
+
+    void hashDirectory(FileTree& tree, NodeIndex index, std::vector<char>& changed) const;
+
+    FileIndexOptions m_options;
+    std::unordered_map<std::string, FileIndexRecord> m_previousRecords;
+    // Chunks of the previous index by record id, only loaded when chunking with the same options
+    std::unordered_map<int64_t, std::vector<FileChunk>> m_previousChunks;
 
-    katla::SqliteDatabase m_database;
+    FileIndexWriter m_writer;
 };
 
 } // namespace backer
@@ -0,0 +1,120 @@
+#include "file-index-diff.h"
+
+#include "file-index-compare.h"
+#include "file-index-writer.h"
+
+#include <utility>
+
+namespace backer {
+
+    namespace {
+        std::string childPath(const std::string& directoryPath, const std::string& name) {
+            return directoryPath.empty() ? name : katla::format("{}/{}", directoryPath, name);
+        }
+    }
+
+    FileIndexDiffResult FileIndexDiff::diff(const std::string& srcIndexPath, const std::string& destIndexPath) {
+        auto src = open(srcIndexPath);
+        auto dest = open(destIndexPath);
+
+        FileIndexCompare::requireSameHashAlgorithm(srcIndexPath, src.hashAlgorithm(), destIndexPath, dest.hashAlgorithm());
+
+        FileIndexDiffResult result;
+
+        struct Pending
+        {
+            int64_t srcId;
+            int64_t destId;
+            std::string path;
+        };
+
+        auto srcRoot = src.rootDirectory();
+        auto destRoot = dest.rootDirectory();
+        if (srcRoot.hash == destRoot.hash) {
+            result.nrOfDirectoriesSkipped++;
+            return result;
+        }
+
+        auto addChange = [&](FileIndexChangeType type, const FileIndexChild& child, const std::string& path) {
+            // Differs whenever the trees do
+            if (FileIndexReader::isIndexFile(path)) {
+                return;
+            }
+            result.changes.push_back({type, child.type, path, child.size});
+        };
+
+        // Depth first, children are pushed in reverse so they are visited by name
+        std::vector<Pending> pending = {{srcRoot.id, destRoot.id, ""}};
+        while (!pending.empty()) {
+            auto directory = std::move(pending.back());
+            pending.pop_back();
+            result.nrOfDirectoriesVisited++;
+
+            auto srcChildren = src.children(directory.srcId);
+            auto destChildren = dest.children(directory.destId);
+
+            std::vector<Pending> changedDirectories;
+            auto srcIt = srcChildren.begin();
+            auto destIt = destChildren.begin();
+            while (srcIt != srcChildren.end() || destIt != destChildren.end()) {
+                if (destIt == destChildren.end() || (srcIt != srcChildren.end() && srcIt->name < destIt->name)) {
+                    addChange(FileIndexChangeType::Removed, *srcIt, childPath(directory.path, srcIt->name));
+                    srcIt++;
+                    continue;
+                }
+                if (srcIt == srcChildren.end() || destIt->name < srcIt->name) {
+                    addChange(FileIndexChangeType::Added, *destIt, childPath(directory.path, destIt->name));
+                    destIt++;
+                    continue;
+                }
+
+                auto path = childPath(directory.path, srcIt->name);
+                if (srcIt->type != destIt->type) {
+                    addChange(FileIndexChangeType::Removed, *srcIt, path);
+                    addChange(FileIndexChangeType::Added, *destIt, path);
+                } else if (srcIt->hash == destIt->hash) {
+                    if (srcIt->type == FileSystemEntryType::Dir) {
+                        result.nrOfDirectoriesSkipped++;
+                    }
+                } else if (srcIt->type == FileSystemEntryType::Dir) {
+                    changedDirectories.push_back({srcIt->id, destIt->id, std::move(path)});
+                } else {
+                    addChange(FileIndexChangeType::Modified, *destIt, path);
+                }
+
+                srcIt++;
+                destIt++;
+            }
+
+            pending.insert(pending.end(), std::make_move_iterator(changedDirectories.rbegin()), std::make_move_iterator(changedDirectories.rend()));
+        }
+
+        return result;
+    }
+
+    std::string FileIndexDiff::changeTypeName(FileIndexChangeType type) {
+        switch (type) {
+            case FileIndexChangeType::Added:
+                return "Added";
+            case FileIndexChangeType::Removed:
+                return "Removed";
+            case FileIndexChangeType::Modified:
+                return "Modified";
+        }
+
+        return "Unknown";
+    }
+
+    FileIndexReader FileIndexDiff::open(const std::string& indexPath) {
+        auto reader = FileIndexReader::open(indexPath);
+        if (!reader.isComplete()) {
+            throw std::runtime_error(katla::format("File-index {} is incomplete, create it again before diffing", indexPath));
+        }
+        if (!reader.hasDirectoryTables() || reader.directoryHashVersion() != DirectoryHashVersion) {
+            throw std::runtime_error(katla::format("File-index {} is too old to diff, update it first", indexPath));
+        }
+
+        return reader;
+    }
+
+} // namespace backer
@@ -0,0 +1,63 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FILE_INDEX_DIFF_H
+#define FILE_INDEX_DIFF_H
+
+#include "katla/core/core.h"
+
+#include "file-index-reader.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace backer {
+
+enum class FileIndexChangeType { Added, Removed, Modified };
+
+// An added or removed directory is a single change, the entries below it are not listed
+struct FileIndexChange
+{
+    FileIndexChangeType type { FileIndexChangeType::Modified };
+    FileSystemEntryType entryType { FileSystemEntryType::File };
+    std::string path;
+    uint64_t size { 0 }; // Size at dest, or at src for removed entries
+};
+
+struct FileIndexDiffResult
+{
+    std::vector<FileIndexChange> changes; // In depth first order, by name
+    size_t nrOfDirectoriesVisited { 0 }; // Directories whose children were read
+    size_t nrOfDirectoriesSkipped { 0 }; // Identical subtrees that were never read
+};
+
+// Diffs two trees by path using the Merkle tree of directory hashes in their indexes. Both indexes are walked
+// top-down and only directories whose hash differs are descended into, so the cost depends on the number of
+// changed branches instead of the size of the trees.
+class FileIndexDiff {
+public:
+    static FileIndexDiffResult diff(const std::string& srcIndexPath, const std::string& destIndexPath);
+
+    static std::string changeTypeName(FileIndexChangeType type);
+
+private:
+    static FileIndexReader open(const std::string& indexPath);
+};
+
+} // namespace backer
+
+#endif
@@ -0,0 +1,380 @@
+#include "file-index-reader.h"
+
+#include "backer.h"
+#include "hasher.h"
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <optional>
+
+namespace backer {
+
+    FileIndexReader::FileIndexReader() {
+    }
+
+    FileIndexReader::~FileIndexReader() {
+        if (m_childDirectoriesStatement) {
+            sqlite3_finalize(m_childDirectoriesStatement);
+        }
+        if (m_childFilesStatement) {
+            sqlite3_finalize(m_childFilesStatement);
+        }
+        if (m_database) {
+            sqlite3_close(m_database);
+        }
+    }
+
+    FileIndexReader::FileIndexReader(FileIndexReader&& other) noexcept :
+        m_database(other.m_database),
+        m_childDirectoriesStatement(other.m_childDirectoriesStatement),
+        m_childFilesStatement(other.m_childFilesStatement)
+    {
+        other.m_database = nullptr;
+        other.m_childDirectoriesStatement = nullptr;
+        other.m_childFilesStatement = nullptr;
+    }
+
+    FileIndexReader& FileIndexReader::operator=(FileIndexReader&& other) noexcept {
+        std::swap(m_database, other.m_database);
+        std::swap(m_childDirectoriesStatement, other.m_childDirectoriesStatement);
+        std::swap(m_childFilesStatement, other.m_childFilesStatement);
+        return *this;
+    }
+
+    FileIndexReader FileIndexReader::open(std::string indexDatabasePath) {
+        FileIndexReader result;
+
+        int openResult = sqlite3_open_v2(indexDatabasePath.c_str(), &result.m_database, SQLITE_OPEN_READONLY, nullptr);
+        if (openResult != SQLITE_OK) {
+            throw std::runtime_error(katla::format("Failed opening file-index {}: {}", indexDatabasePath, sqlite3_errstr(openResult)));
+        }
+
+        return result;
+    }
+
+    bool FileIndexReader::isIncompleteIndex(const std::string& indexDatabasePath) {
+        try {
+            // Indexes from before runs could be resumed have no marker and count as complete
+            return open(indexDatabasePath).info("complete") == std::optional<std::string>("0");
+        } catch (const std::runtime_error&) {
+            return false;
+        }
+    }
+
+    bool FileIndexReader::isIndexFile(const std::string& relativePath) {
+        std::string_view name = DefaultFileIndexName;
+        return relativePath.compare(0, name.size(), name) == 0 && relativePath.find('/') == std::string::npos;
+    }
+
+    bool FileIndexReader::hasColumn(std::string table, std::string column) {
+        std::string query = katla::format("PRAGMA table_info({});", table);
+
+        sqlite3_stmt* statement = nullptr;
+        if (sqlite3_prepare_v2(m_database, query.c_str(), -1, &statement, nullptr) != SQLITE_OK) {
+            throw std::runtime_error(katla::format("Failed reading table info: {}", sqlite3_errmsg(m_database)));
+        }
+
+        bool found = false;
+        while (sqlite3_step(statement) == SQLITE_ROW) {
+            auto name = reinterpret_cast<const char*>(sqlite3_column_text(statement, 1));
+            if (name && column == name) {
+                found = true;
+                break;
+            }
+        }
+
+        sqlite3_finalize(statement);
+        return found;
+    }
+
+    std::string FileIndexReader::hashAlgorithm() {
+        return info("hashAlgorithm").value_or(Hasher::algorithmName(HashAlgorithm::Sha256));
+    }
+
+    int FileIndexReader::directoryHashVersion() {
+        return std::stoi(info("directoryHashVersion").value_or("1"));
+    }
+
+    bool FileIndexReader::isComplete() {
+        return info("complete").value_or("1") != "0";
+    }
+
+    std::optional<std::string> FileIndexReader::chunking() {
+        return info("chunking");
+    }
+
+    std::optional<std::string> FileIndexReader::info(const std::string& key) {
+        if (!hasColumn("fileIndexInfo", "value")) {
+            return std::nullopt;
+        }
+
+        std::optional<std::string> result;
+        readRows(katla::format("SELECT value FROM fileIndexInfo WHERE key = '{}';", key), [&](sqlite3_stmt* statement) {
+            auto value = reinterpret_cast<const char*>(sqlite3_column_text(statement, 0));
+            if (value) {
+                result = value;
+            }
+        });
+
+        return result;
+    }
+
+    std::unordered_map<std::string, FileIndexRecord> FileIndexReader::readRecords() {
+        std::unordered_map<std::string, FileIndexRecord> records;
+
+        if (!hasColumn("dirs", "parent_id")) {
+            readRows("SELECT file, hash, size, mtime, ctime, inode FROM fileIndex;", [&](sqlite3_stmt* statement) {
+                auto file = reinterpret_cast<const char*>(sqlite3_column_text(statement, 0));
+                if (!file || sqlite3_column_type(statement, 1) == SQLITE_NULL) {
+                    return;
+                }
+
+                auto record = readRecord(statement, 1);
+                record.file = file;
+                records[record.file] = std::move(record);
+            });
+
+            // These indexes have no entry types, every parent of another entry is a directory. Empty directories
+            // can't be told apart from files.
+            for (auto& [file, record] : records) {
+                auto separator = file.rfind('/');
+                auto parent = (separator == std::string::npos) ? std::string(".") : file.substr(0, separator);
+                if (file == parent) {
+                    continue;
+                }
+
+                auto findIt = records.find(parent);
+                if (findIt != records.end()) {
+                    findIt->second.type = FileSystemEntryType::Dir;
+                }
+            }
+
+            return records;
+        }
+
+        // Paths are put back together here instead of through the fileIndex view, which concatenates every path in sql
+        struct Directory
+        {
+            std::optional<int64_t> parent;
+            std::string name;
+        };
+
+        std::unordered_map<int64_t, Directory> directories;
+        std::vector<std::pair<int64_t, FileIndexRecord>> directoryRecords;
+        readRows("SELECT id, parent_id, name, hash, size, mtime, ctime, inode FROM dirs;", [&](sqlite3_stmt* statement) {
+            auto id = sqlite3_column_int64(statement, 0);
+            auto name = reinterpret_cast<const char*>(sqlite3_column_text(statement, 2));
+
+            auto& directory = directories[id];
+            if (sqlite3_column_type(statement, 1) != SQLITE_NULL) {
+                directory.parent = sqlite3_column_int64(statement, 1);
+            }
+            directory.name = name ? name : "";
+
+            if (sqlite3_column_type(statement, 3) != SQLITE_NULL) {
+                directoryRecords.emplace_back(id, readRecord(statement, 3));
+            }
+        });
+
+        std::unordered_map<int64_t, std::string> directoryPaths;
+        auto directoryPath = [&](int64_t id) -> const std::string& {
+            // Walk up to the first directory with a known path, then fill in the paths on the way down
+            std::vector<int64_t> unresolved;
+            for (int64_t current = id; directoryPaths.find(current) == directoryPaths.end();) {
+                auto findIt = directories.find(current);
+                if (findIt == directories.end() || unresolved.size() > directories.size()) {
+                    throw std::runtime_error(katla::format("File-index has no valid parent for directory {}", id));
+                }
+
+                unresolved.push_back(current);
+                if (!findIt->second.parent) {
+                    break;
+                }
+                current = *findIt->second.parent;
+            }
+
+            for (auto it = unresolved.rbegin(); it != unresolved.rend(); it++) {
+                auto& directory = directories[*it];
+                directoryPaths[*it] = directory.parent ? joinPath(directoryPaths[*directory.parent], directory.name) : std::string(".");
+            }
+
+            return directoryPaths[id];
+        };
+
+        for (auto& [id, record] : directoryRecords) {
+            record.id = id;
+            record.file = directoryPath(id);
+            record.type = FileSystemEntryType::Dir;
+            records[record.file] = std::move(record);
+        }
+
+        readRows("SELECT dir_id, name, hash, size, mtime, ctime, inode, id FROM files;", [&](sqlite3_stmt* statement) {
+            auto name = reinterpret_cast<const char*>(sqlite3_column_text(statement, 1));
+            if (!name || sqlite3_column_type(statement, 2) == SQLITE_NULL) {
+                return;
+            }
+
+            auto record = readRecord(statement, 2);
+            record.id = sqlite3_column_int64(statement, 7);
+            record.file = joinPath(directoryPath(sqlite3_column_int64(statement, 0)), name);
+            records[record.file] = std::move(record);
+        });
+
+        return records;
+    }
+
+    bool FileIndexReader::hasDirectoryTables() {
+        return hasColumn("dirs", "parent_id") && hasColumn("files", "dir_id");
+    }
+
+    FileIndexChild FileIndexReader::rootDirectory() {
+        std::optional<FileIndexChild> root;
+        readRows("SELECT id, name, hash, size FROM dirs WHERE parent_id IS NULL;", [&](sqlite3_stmt* statement) {
+            root = readChild(statement, 2);
+            root->id = sqlite3_column_int64(statement, 0);
+            root->type = FileSystemEntryType::Dir;
+        });
+
+        if (!root) {
+            throw std::runtime_error("File-index has no root directory");
+        }
+
+        return *root;
+    }
+
+    std::vector<FileIndexChild> FileIndexReader::children(int64_t directoryId) {
+        // Both lookups run on the parent indexes, which are ordered by name already
+        if (!m_childDirectoriesStatement) {
+            m_childDirectoriesStatement = prepare("SELECT id, name, hash, size FROM dirs WHERE parent_id = ? ORDER BY name;");
+            m_childFilesStatement = prepare("SELECT name, hash, size FROM files WHERE dir_id = ? ORDER BY name;");
+        }
+
+        std::vector<FileIndexChild> directories;
+        bindAndReadRows(m_childDirectoriesStatement, directoryId, [&](sqlite3_stmt* statement) {
+            auto child = readChild(statement, 2);
+            child.id = sqlite3_column_int64(statement, 0);
+            child.type = FileSystemEntryType::Dir;
+            directories.push_back(std::move(child));
+        });
+
+        std::vector<FileIndexChild> files;
+        bindAndReadRows(m_childFilesStatement, directoryId, [&](sqlite3_stmt* statement) {
+            files.push_back(readChild(statement, 1));
+        });
+
+        std::vector<FileIndexChild> result;
+        result.reserve(directories.size() + files.size());
+        std::merge(std::make_move_iterator(directories.begin()), std::make_move_iterator(directories.end()),
+                   std::make_move_iterator(files.begin()), std::make_move_iterator(files.end()),
+                   std::back_inserter(result),
+                   [](const FileIndexChild& left, const FileIndexChild& right) { return left.name < right.name; });
+        return result;
+    }
+
+    void FileIndexReader::readChunks(const std::function<void(int64_t fileId, const FileChunk& chunk)>& function) {
+        if (!hasColumn("chunks", "file_id")) {
+            return;
+        }
+
+        // Chunks of a file are inserted one after the other, a scan in rowid order keeps them in file order
+        readRows("SELECT file_id, offset, length, hash FROM chunks ORDER BY rowid;", [&](sqlite3_stmt* statement) {
+            FileChunk chunk;
+            chunk.offset = static_cast<uint64_t>(sqlite3_column_int64(statement, 1));
+            chunk.length = static_cast<uint32_t>(sqlite3_column_int64(statement, 2));
+
+            auto hash = static_cast<const std::byte*>(sqlite3_column_blob(statement, 3));
+            chunk.hash = Hasher::toDigest(std::vector<std::byte>(hash, hash + sqlite3_column_bytes(statement, 3)));
+
+            function(sqlite3_column_int64(statement, 0), chunk);
+        });
+    }
+
+    void FileIndexReader::readRows(const std::string& query, const std::function<void(sqlite3_stmt* statement)>& function) {
+        sqlite3_stmt* statement = nullptr;
+        if (sqlite3_prepare_v2(m_database, query.c_str(), -1, &statement, nullptr) != SQLITE_OK) {
+            throw std::runtime_error(katla::format("Failed reading file-index: {}", sqlite3_errmsg(m_database)));
+        }
+
+        std::unique_ptr<sqlite3_stmt, int (*)(sqlite3_stmt*)> statementGuard(statement, sqlite3_finalize);
+
+        int stepResult = SQLITE_ROW;
+        while ((stepResult = sqlite3_step(statement)) == SQLITE_ROW) {
+            function(statement);
+        }
+
+        if (stepResult != SQLITE_DONE) {
+            throw std::runtime_error(katla::format("Failed reading file-index: {}", sqlite3_errmsg(m_database)));
+        }
+    }
+
+    sqlite3_stmt* FileIndexReader::prepare(const char* query) {
+        sqlite3_stmt* statement = nullptr;
+        if (sqlite3_prepare_v2(m_database, query, -1, &statement, nullptr) != SQLITE_OK) {
+            throw std::runtime_error(katla::format("Failed reading file-index: {}", sqlite3_errmsg(m_database)));
+        }
+        return statement;
+    }
+
+    void FileIndexReader::bindAndReadRows(sqlite3_stmt* statement, int64_t value, const std::function<void(sqlite3_stmt* statement)>& function) {
+        std::unique_ptr<sqlite3_stmt, int (*)(sqlite3_stmt*)> resetGuard(statement, sqlite3_reset);
+        sqlite3_bind_int64(statement, 1, value);
+
+        int stepResult = SQLITE_ROW;
+        while ((stepResult = sqlite3_step(statement)) == SQLITE_ROW) {
+            function(statement);
+        }
+
+        if (stepResult != SQLITE_DONE) {
+            throw std::runtime_error(katla::format("Failed reading file-index: {}", sqlite3_errmsg(m_database)));
+        }
+    }
+
+    FileIndexChild FileIndexReader::readChild(sqlite3_stmt* statement, int hashColumn) {
+        FileIndexChild child;
+
+        auto name = reinterpret_cast<const char*>(sqlite3_column_text(statement, hashColumn - 1));
+        child.name = name ? name : "";
+        if (sqlite3_column_type(statement, hashColumn) == SQLITE_BLOB) {
+            auto hash = static_cast<const std::byte*>(sqlite3_column_blob(statement, hashColumn));
+            child.hash = Hasher::toDigest(std::vector<std::byte>(hash, hash + sqlite3_column_bytes(statement, hashColumn)));
+        }
+        child.size = static_cast<uint64_t>(sqlite3_column_int64(statement, hashColumn + 1));
+        return child;
+    }
+
+    FileIndexRecord FileIndexReader::readRecord(sqlite3_stmt* statement, int hashColumn) {
+        FileIndexRecord record;
+
+        // Hashes are stored as blobs, older indexes stored them as hex text
+        if (sqlite3_column_type(statement, hashColumn) == SQLITE_BLOB) {
+            auto hash = static_cast<const std::byte*>(sqlite3_column_blob(statement, hashColumn));
+            record.hash = Hasher::toDigest(std::vector<std::byte>(hash, hash + sqlite3_column_bytes(statement, hashColumn)));
+        } else {
+            record.hash = Hasher::toDigest(Backer::parseHash(reinterpret_cast<const char*>(sqlite3_column_text(statement, hashColumn))));
+        }
+
+        record.size = static_cast<uint64_t>(sqlite3_column_int64(statement, hashColumn + 1));
+        record.modificationTime = sqlite3_column_int64(statement, hashColumn + 2);
+        record.changeTime = sqlite3_column_int64(statement, hashColumn + 3);
+        record.inode = static_cast<uint64_t>(sqlite3_column_int64(statement, hashColumn + 4));
+        return record;
+    }
+
+    std::string FileIndexReader::joinPath(const std::string& directoryPath, std::string_view name) {
+        if (directoryPath == ".") {
+            return std::string(name);
+        }
+
+        std::string result;
+        result.reserve(directoryPath.size() + 1 + name.size());
+        result += directoryPath;
+        result += '/';
+        result += name;
+        return result;
+    }
+
+} // namespace backer
@@ -0,0 +1,133 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FILE_INDEX_READER_H
+#define FILE_INDEX_READER_H
+
+#include "katla/core/core.h"
+
+#include "fast-cdc.h"
+#include "file-data.h"
+#include "hasher.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+namespace backer {
+
+// Name of the file index when it is stored in the root of the tree it indexes
+constexpr const char* DefaultFileIndexName = "file-index.db.sqlite";
+
+struct FileIndexRecord
+{
+    int64_t id { 0 }; // Row in the dirs or files table, 0 for indexes with a single fileIndex table
+    std::string file;
+    FileSystemEntryType type { FileSystemEntryType::File };
+    Digest hash {};
+    uint64_t size { 0 };
+    int64_t modificationTime { 0 };
+    int64_t changeTime { 0 };
+    uint64_t inode { 0 };
+};
+
+// A child of a directory in an index with dirs and files tables, id is only set for directories
+struct FileIndexChild
+{
+    int64_t id { 0 };
+    std::string name;
+    FileSystemEntryType type { FileSystemEntryType::File };
+    Digest hash {};
+    uint64_t size { 0 };
+};
+
+// Read-only access to an existing file-index database
+class FileIndexReader {
+public:
+    FileIndexReader();
+    ~FileIndexReader();
+
+    FileIndexReader(const FileIndexReader&) = delete;
+    FileIndexReader& operator=(const FileIndexReader&) = delete;
+    FileIndexReader(FileIndexReader&& other) noexcept;
+    FileIndexReader& operator=(FileIndexReader&& other) noexcept;
+
+    static FileIndexReader open(std::string indexDatabasePath);
+
+    // Whether the file is a file index written by a run that was interrupted, anything else at the path is false
+    static bool isIncompleteIndex(const std::string& indexDatabasePath);
+
+    // An index stored in the root of the tree it indexes shows up in that index as well, along with its sqlite files
+    static bool isIndexFile(const std::string& relativePath);
+
+    bool hasColumn(std::string table, std::string column);
+
+    // Name of the hash algorithm the index was built with, indexes without this information use sha256
+    std::string hashAlgorithm();
+
+    // How directory hashes were computed, see DirectoryHashVersion
+    int directoryHashVersion();
+
+    // False when the run writing the index was interrupted, its rows can be reused to resume it
+    bool isComplete();
+
+    // Description of how the chunks of the files were cut, not set when the index has no chunks
+    std::optional<std::string> chunking();
+
+    // All records keyed by relative path, requires the stat columns to be present. Works with both the fileIndex
+    // table of older indexes and the dirs and files tables.
+    std::unordered_map<std::string, FileIndexRecord> readRecords();
+
+    // Lookups of single directories for walking the tree top-down, these need the dirs and files tables
+    bool hasDirectoryTables();
+    FileIndexChild rootDirectory();
+    // Child directories and files sorted by name
+    std::vector<FileIndexChild> children(int64_t directoryId);
+
+    // Streams the chunks of all files, the chunks of a file come in order. The file id matches the id of its record.
+    void readChunks(const std::function<void(int64_t fileId, const FileChunk& chunk)>& function);
+
+private:
+    std::optional<std::string> info(const std::string& key);
+
+    void readRows(const std::string& query, const std::function<void(sqlite3_stmt* statement)>& function);
+
+    // Reads the hash and stat columns, which follow each other starting at hashColumn
+    static FileIndexRecord readRecord(sqlite3_stmt* statement, int hashColumn);
+
+    static std::string joinPath(const std::string& directoryPath, std::string_view name);
+
+    static FileIndexChild readChild(sqlite3_stmt* statement, int hashColumn);
+
+    sqlite3_stmt* prepare(const char* query);
+    void bindAndReadRows(sqlite3_stmt* statement, int64_t value, const std::function<void(sqlite3_stmt* statement)>& function);
+
+    sqlite3* m_database { nullptr };
+    sqlite3_stmt* m_childDirectoriesStatement { nullptr };
+    sqlite3_stmt* m_childFilesStatement { nullptr };
+};
+
+} // namespace backer
+
+#endif
@@ -0,0 +1,331 @@
+#include "file-index-snapshot.h"
+
+#include "file-index-compare.h"
+
+#include "katla/core/posix-file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <vector>
+
+namespace backer {
+
+    namespace fs = std::filesystem;
+
+    namespace {
+        constexpr char SnapshotMagic[8] = {'B', 'K', 'S', 'N', 'A', 'P', 'S', 'H'};
+        constexpr uint32_t ByteOrderMark = 0x01020304;
+
+        static_assert(sizeof(FileIndexSnapshotHeader) % 8 == 0, "Records following the header need 8 byte alignment");
+        static_assert(sizeof(FileIndexSnapshotRecord) == 48, "Records are fixed width on every host");
+
+        bool hashLess(const Digest& left, const Digest& right)
+        {
+            return std::memcmp(left.data(), right.data(), left.size()) < 0;
+        }
+
+        void writeAll(katla::PosixFile& file, const void* data, size_t size, const std::string& path)
+        {
+            auto bytes = static_cast<std::byte*>(const_cast<void*>(data));
+            size_t bytesWritten = 0;
+            while (bytesWritten < size) {
+                auto writeResult = file.write(gsl::span<std::byte>(bytes + bytesWritten, size - bytesWritten));
+                if (!writeResult || writeResult.value() == 0) {
+                    throw std::runtime_error(katla::format("Failed writing snapshot {}", path));
+                }
+                bytesWritten += writeResult.value();
+            }
+        }
+    }
+
+    FileIndexSnapshot::FileIndexSnapshot() {
+    }
+
+    FileIndexSnapshot::~FileIndexSnapshot() {
+        if (m_data) {
+            ::munmap(const_cast<std::byte*>(m_data), m_size);
+        }
+    }
+
+    FileIndexSnapshot::FileIndexSnapshot(FileIndexSnapshot&& other) noexcept :
+        m_data(other.m_data),
+        m_size(other.m_size),
+        m_header(other.m_header),
+        m_records(other.m_records),
+        m_pathOffsets(other.m_pathOffsets),
+        m_paths(other.m_paths),
+        m_nrOfRecords(other.m_nrOfRecords)
+    {
+        other.m_data = nullptr;
+        other.m_size = 0;
+    }
+
+    FileIndexSnapshot& FileIndexSnapshot::operator=(FileIndexSnapshot&& other) noexcept {
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+        std::swap(m_header, other.m_header);
+        std::swap(m_records, other.m_records);
+        std::swap(m_pathOffsets, other.m_pathOffsets);
+        std::swap(m_paths, other.m_paths);
+        std::swap(m_nrOfRecords, other.m_nrOfRecords);
+        return *this;
+    }
+
+    void FileIndexSnapshot::create(const std::string& indexDatabasePath, const std::string& snapshotPath) {
+        std::string hashAlgorithm;
+        auto records = FileIndexCompare::readFiles(indexDatabasePath, hashAlgorithm);
+        write(records, hashAlgorithm, snapshotPath);
+    }
+
+    void FileIndexSnapshot::write(const std::unordered_map<std::string, FileIndexRecord>& records,
+                                  const std::string& hashAlgorithm,
+                                  const std::string& snapshotPath) {
+        std::vector<const FileIndexRecord*> files;
+        for (auto& [file, record] : records) {
+            if (record.type == FileSystemEntryType::File && !FileIndexReader::isIndexFile(file)) {
+                files.push_back(&record);
+            }
+        }
+
+        std::sort(files.begin(), files.end(), [](auto left, auto right) {
+            return left->file < right->file;
+        });
+
+        std::vector<uint64_t> pathOffsets;
+        pathOffsets.reserve(files.size() + 1);
+        std::vector<FileIndexSnapshotRecord> snapshotRecords;
+        snapshotRecords.reserve(files.size());
+
+        uint64_t pathsSize = 0;
+        for (size_t i = 0; i < files.size(); i++) {
+            pathOffsets.push_back(pathsSize);
+            pathsSize += files[i]->file.size();
+
+            FileIndexSnapshotRecord record {};
+            record.hash = files[i]->hash;
+            record.size = files[i]->size;
+            record.pathIndex = i;
+            snapshotRecords.push_back(record);
+        }
+        pathOffsets.push_back(pathsSize);
+
+        std::sort(snapshotRecords.begin(), snapshotRecords.end(), [](auto& left, auto& right) {
+            int result = std::memcmp(left.hash.data(), right.hash.data(), left.hash.size());
+            return result != 0 ? result < 0 : left.pathIndex < right.pathIndex;
+        });
+
+        if (hashAlgorithm.size() >= sizeof(FileIndexSnapshotHeader::hashAlgorithm)) {
+            throw std::runtime_error(katla::format("Hash algorithm name {} does not fit a snapshot", hashAlgorithm));
+        }
+
+        FileIndexSnapshotHeader header {};
+        std::memcpy(header.magic, SnapshotMagic, sizeof(header.magic));
+        header.version = FileIndexSnapshotVersion;
+        header.byteOrder = ByteOrderMark;
+        std::memcpy(header.hashAlgorithm, hashAlgorithm.data(), hashAlgorithm.size());
+        header.digestSize = static_cast<uint32_t>(Hasher::digestSize(Hasher::parseAlgorithm(hashAlgorithm)));
+        header.nrOfRecords = files.size();
+        header.recordsOffset = sizeof(FileIndexSnapshotHeader);
+        header.pathOffsetsOffset = header.recordsOffset + snapshotRecords.size() * sizeof(FileIndexSnapshotRecord);
+        header.pathsOffset = header.pathOffsetsOffset + pathOffsets.size() * sizeof(uint64_t);
+        header.pathsSize = pathsSize;
+
+        // Written next to the snapshot and renamed over it, readers never map a partial snapshot
+        auto temporaryPath = snapshotPath + ".tmp";
+        {
+            katla::PosixFile file;
+            auto result = file.create(temporaryPath,
+                                      katla::PosixFile::OpenFlags::Create | katla::PosixFile::OpenFlags::Truncate |
+                                      katla::PosixFile::OpenFlags::WriteOnly);
+            if (!result) {
+                throw std::runtime_error(katla::format("Failed creating snapshot {}: {}", snapshotPath, result.error().message()));
+            }
+
+            writeAll(file, &header, sizeof(header), snapshotPath);
+            writeAll(file, snapshotRecords.data(), snapshotRecords.size() * sizeof(FileIndexSnapshotRecord), snapshotPath);
+            writeAll(file, pathOffsets.data(), pathOffsets.size() * sizeof(uint64_t), snapshotPath);
+
+            // Paths are written in batches, the blob can be larger than all other sections together
+            std::string paths;
+            for (auto record : files) {
+                paths += record->file;
+                if (paths.size() >= 1024 * 1024) {
+                    writeAll(file, paths.data(), paths.size(), snapshotPath);
+                    paths.clear();
+                }
+            }
+            writeAll(file, paths.data(), paths.size(), snapshotPath);
+
+            if (!file.close()) {
+                throw std::runtime_error(katla::format("Failed closing snapshot {}", snapshotPath));
+            }
+        }
+
+        fs::rename(temporaryPath, snapshotPath);
+    }
+
+    FileIndexSnapshot FileIndexSnapshot::open(const std::string& snapshotPath) {
+        int fd = ::open(snapshotPath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error(katla::format("Failed opening snapshot {}: {}", snapshotPath, std::strerror(errno)));
+        }
+
+        struct stat status {};
+        if (::fstat(fd, &status) != 0) {
+            ::close(fd);
+            throw std::runtime_error(katla::format("Failed reading status of snapshot {}: {}", snapshotPath, std::strerror(errno)));
+        }
+
+        FileIndexSnapshot result;
+        result.m_size = static_cast<size_t>(status.st_size);
+        if (result.m_size < sizeof(FileIndexSnapshotHeader)) {
+            ::close(fd);
+            throw std::runtime_error(katla::format("{} is not a file index snapshot", snapshotPath));
+        }
+
+        void* data = ::mmap(nullptr, result.m_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error(katla::format("Failed mapping snapshot {}: {}", snapshotPath, std::strerror(errno)));
+        }
+
+        result.m_data = static_cast<const std::byte*>(data);
+        result.m_header = reinterpret_cast<const FileIndexSnapshotHeader*>(result.m_data);
+
+        auto& header = *result.m_header;
+        if (std::memcmp(header.magic, SnapshotMagic, sizeof(header.magic)) != 0) {
+            throw std::runtime_error(katla::format("{} is not a file index snapshot", snapshotPath));
+        }
+        if (header.version != FileIndexSnapshotVersion || header.byteOrder != ByteOrderMark) {
+            throw std::runtime_error(katla::format("Snapshot {} was written by another version or on a host with another byte order", snapshotPath));
+        }
+
+        // Every section has to be in the file, the content of the sections is only checked when it is used. Each
+        // size is compared with the space left after its offset, so no sum or product can overflow.
+        uint64_t size = result.m_size;
+        auto fits = [size](uint64_t offset, uint64_t count, uint64_t elementSize) {
+            return offset <= size && count <= (size - offset) / elementSize;
+        };
+        uint64_t nrOfRecords = header.nrOfRecords;
+        bool valid = header.recordsOffset >= sizeof(FileIndexSnapshotHeader) &&
+                     header.recordsOffset % 8 == 0 &&
+                     header.pathOffsetsOffset % 8 == 0 &&
+                     fits(header.recordsOffset, nrOfRecords, sizeof(FileIndexSnapshotRecord)) &&
+                     header.recordsOffset + nrOfRecords * sizeof(FileIndexSnapshotRecord) <= header.pathOffsetsOffset &&
+                     fits(header.pathOffsetsOffset, nrOfRecords + 1, sizeof(uint64_t)) &&
+                     header.pathOffsetsOffset + (nrOfRecords + 1) * sizeof(uint64_t) <= header.pathsOffset &&
+                     fits(header.pathsOffset, header.pathsSize, 1);
+        if (!valid) {
+            throw std::runtime_error(katla::format("Snapshot {} is damaged", snapshotPath));
+        }
+
+        result.m_records = reinterpret_cast<const FileIndexSnapshotRecord*>(result.m_data + header.recordsOffset);
+        result.m_pathOffsets = reinterpret_cast<const uint64_t*>(result.m_data + header.pathOffsetsOffset);
+        result.m_paths = reinterpret_cast<const char*>(result.m_data + header.pathsOffset);
+        result.m_nrOfRecords = nrOfRecords;
+
+        return result;
+    }
+
+    bool FileIndexSnapshot::isSnapshot(const std::string& path) {
+        char magic[sizeof(SnapshotMagic)] = {};
+
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        auto bytesRead = ::read(fd, magic, sizeof(magic));
+        ::close(fd);
+
+        return bytesRead == sizeof(magic) && std::memcmp(magic, SnapshotMagic, sizeof(magic)) == 0;
+    }
+
+    std::string FileIndexSnapshot::hashAlgorithm() const {
+        auto& name = m_header->hashAlgorithm;
+        return std::string(name, strnlen(name, sizeof(name)));
+    }
+
+    std::pair<const FileIndexSnapshotRecord*, const FileIndexSnapshotRecord*> FileIndexSnapshot::find(const Digest& hash) const {
+        auto begin = m_records;
+        auto end = m_records + m_nrOfRecords;
+
+        auto first = std::lower_bound(begin, end, hash, [](const FileIndexSnapshotRecord& record, const Digest& value) {
+            return hashLess(record.hash, value);
+        });
+
+        auto last = std::upper_bound(first, end, hash, [](const Digest& value, const FileIndexSnapshotRecord& record) {
+            return hashLess(value, record.hash);
+        });
+
+        return {first, last};
+    }
+
+    bool FileIndexSnapshot::contains(const Digest& hash) const {
+        auto range = find(hash);
+        return range.first != range.second;
+    }
+
+    std::string_view FileIndexSnapshot::path(const FileIndexSnapshotRecord& record) const {
+        return path(record.pathIndex);
+    }
+
+    std::optional<uint64_t> FileIndexSnapshot::findPath(std::string_view path) const {
+        uint64_t low = 0;
+        uint64_t high = m_nrOfRecords;
+        while (low < high) {
+            uint64_t middle = low + (high - low) / 2;
+            auto compareResult = this->path(middle).compare(path);
+            if (compareResult == 0) {
+                return middle;
+            }
+            if (compareResult < 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    void FileIndexSnapshot::advise(SnapshotAccess access) const {
+        if (!m_data) {
+            return;
+        }
+
+        auto data = const_cast<std::byte*>(m_data);
+        if (access == SnapshotAccess::Lookup) {
+            ::madvise(data, m_size, MADV_RANDOM);
+            return;
+        }
+
+        // Records are read in order, the paths of those records are still visited in hash order
+        ::madvise(data, m_size, MADV_NORMAL);
+        auto pageSize = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+        uint64_t begin = m_header->recordsOffset / pageSize * pageSize;
+        uint64_t end = m_header->recordsOffset + m_nrOfRecords * sizeof(FileIndexSnapshotRecord);
+        ::madvise(data + begin, end - begin, MADV_SEQUENTIAL);
+    }
+
+    std::string_view FileIndexSnapshot::path(uint64_t pathIndex) const {
+        if (pathIndex >= m_nrOfRecords) {
+            throw std::runtime_error(katla::format("Snapshot has no path {}", pathIndex));
+        }
+
+        uint64_t begin = m_pathOffsets[pathIndex];
+        uint64_t end = m_pathOffsets[pathIndex + 1];
+        if (begin > end || end > m_header->pathsSize) {
+            throw std::runtime_error("Snapshot is damaged");
+        }
+
+        return std::string_view(m_paths + begin, end - begin);
+    }
+
+} // namespace backer
@@ -0,0 +1,128 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FILE_INDEX_SNAPSHOT_H
+#define FILE_INDEX_SNAPSHOT_H
+
+#include "katla/core/core.h"
+
+#include "file-index-reader.h"
+#include "hasher.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+namespace backer {
+
+constexpr uint32_t FileIndexSnapshotVersion = 1;
+
+// Fixed size start of a snapshot file, all numbers in the byte order of the host that wrote it
+struct FileIndexSnapshotHeader
+{
+    char magic[8]; // "BKSNAPSH"
+    uint32_t version;
+    uint32_t byteOrder; // 0x01020304 as written
+    char hashAlgorithm[16];
+    uint32_t digestSize;
+    uint32_t reserved;
+    uint64_t nrOfRecords;
+    uint64_t recordsOffset;
+    uint64_t pathOffsetsOffset; // nrOfRecords + 1 offsets into the paths
+    uint64_t pathsOffset;
+    uint64_t pathsSize;
+};
+
+// How the next reads go through a snapshot. Lookups jump around, a scan reads the records in order.
+enum class SnapshotAccess { Lookup, Scan };
+
+// A file of the snapshot, records are sorted by hash and then by path index
+struct FileIndexSnapshotRecord
+{
+    Digest hash;
+    uint64_t size;
+    uint64_t pathIndex; // Paths are numbered in sorted order
+};
+
+// Read-only snapshot of the files in a file index, meant to be memory mapped and searched as is. Hashes are sorted
+// fixed width records for binary search, paths are stored in sorted order in a single blob with a table of their
+// offsets. Opening a snapshot only checks its header, the pages that are searched are read on demand, so a lookup in
+// a snapshot of millions of files costs a few page reads instead of loading and parsing a whole sqlite index.
+class FileIndexSnapshot {
+public:
+    FileIndexSnapshot();
+    ~FileIndexSnapshot();
+
+    FileIndexSnapshot(const FileIndexSnapshot&) = delete;
+    FileIndexSnapshot& operator=(const FileIndexSnapshot&) = delete;
+    FileIndexSnapshot(FileIndexSnapshot&& other) noexcept;
+    FileIndexSnapshot& operator=(FileIndexSnapshot&& other) noexcept;
+
+    // Exports the files of a complete index, directories and index files are left out
+    static void create(const std::string& indexDatabasePath, const std::string& snapshotPath);
+
+    static void write(const std::unordered_map<std::string, FileIndexRecord>& records,
+                      const std::string& hashAlgorithm,
+                      const std::string& snapshotPath);
+
+    static FileIndexSnapshot open(const std::string& snapshotPath);
+
+    // True when the file starts like a snapshot, so any other path can be opened as a sqlite index
+    static bool isSnapshot(const std::string& path);
+
+    std::string hashAlgorithm() const;
+
+    size_t size() const {
+        return m_nrOfRecords;
+    }
+
+    const FileIndexSnapshotRecord& record(size_t index) const {
+        return m_records[index];
+    }
+
+    // All records with the hash, an empty range when there is none
+    std::pair<const FileIndexSnapshotRecord*, const FileIndexSnapshotRecord*> find(const Digest& hash) const;
+
+    bool contains(const Digest& hash) const;
+
+    std::string_view path(const FileIndexSnapshotRecord& record) const;
+
+    // Path index of a path, found by binary search in the sorted paths
+    std::optional<uint64_t> findPath(std::string_view path) const;
+
+    // Tells the kernel how the mapping is read next, so it only reads ahead where that helps
+    void advise(SnapshotAccess access) const;
+
+private:
+    std::string_view path(uint64_t pathIndex) const;
+
+    const std::byte* m_data { nullptr };
+    size_t m_size { 0 };
+
+    const FileIndexSnapshotHeader* m_header { nullptr };
+    const FileIndexSnapshotRecord* m_records { nullptr };
+    const uint64_t* m_pathOffsets { nullptr };
+    const char* m_paths { nullptr };
+    size_t m_nrOfRecords { 0 };
+};
+
+} // namespace backer
+
+#endif
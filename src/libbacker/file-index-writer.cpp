@@ -0,0 +1,350 @@
+#include "file-index-writer.h"
+
+#include "worker-pool.h"
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <exception>
+
+namespace backer {
+
+    namespace {
+        constexpr size_t MinTransactionSize = 256;
+        constexpr size_t MaxTransactionSize = 256 * 1024;
+
+        // Transactions grow while they commit faster than this and shrink when they take ten times as long,
+        // so a slow producer still gets its rows on disk regularly
+        constexpr auto TargetTransactionDuration = std::chrono::milliseconds(100);
+        constexpr auto MaxTransactionDuration = std::chrono::seconds(1);
+    }
+
+    FileIndexWriter::FileIndexWriter() {
+    }
+
+    FileIndexWriter::~FileIndexWriter() {
+        if (m_insertDirectoryStatement) {
+            sqlite3_finalize(m_insertDirectoryStatement);
+        }
+        if (m_updateDirectoryStatement) {
+            sqlite3_finalize(m_updateDirectoryStatement);
+        }
+        if (m_insertFileStatement) {
+            sqlite3_finalize(m_insertFileStatement);
+        }
+        if (m_insertChunkStatement) {
+            sqlite3_finalize(m_insertChunkStatement);
+        }
+        if (m_database) {
+            sqlite3_close(m_database);
+        }
+    }
+
+    FileIndexWriter::FileIndexWriter(FileIndexWriter&& other) noexcept :
+        m_database(other.m_database),
+        m_insertDirectoryStatement(other.m_insertDirectoryStatement),
+        m_updateDirectoryStatement(other.m_updateDirectoryStatement),
+        m_insertFileStatement(other.m_insertFileStatement),
+        m_insertChunkStatement(other.m_insertChunkStatement),
+        m_algorithm(other.m_algorithm),
+        m_jobs(other.m_jobs),
+        m_nrOfRows(other.m_nrOfRows),
+        m_transactionRows(other.m_transactionRows),
+        m_transactionSize(other.m_transactionSize),
+        m_inTransaction(other.m_inTransaction),
+        m_holdTransaction(other.m_holdTransaction),
+        m_transactionStart(other.m_transactionStart)
+    {
+        other.m_database = nullptr;
+        other.m_insertDirectoryStatement = nullptr;
+        other.m_updateDirectoryStatement = nullptr;
+        other.m_insertFileStatement = nullptr;
+        other.m_insertChunkStatement = nullptr;
+    }
+
+    FileIndexWriter& FileIndexWriter::operator=(FileIndexWriter&& other) noexcept {
+        std::swap(m_database, other.m_database);
+        std::swap(m_insertDirectoryStatement, other.m_insertDirectoryStatement);
+        std::swap(m_updateDirectoryStatement, other.m_updateDirectoryStatement);
+        std::swap(m_insertFileStatement, other.m_insertFileStatement);
+        std::swap(m_insertChunkStatement, other.m_insertChunkStatement);
+        std::swap(m_algorithm, other.m_algorithm);
+        std::swap(m_jobs, other.m_jobs);
+        std::swap(m_nrOfRows, other.m_nrOfRows);
+        std::swap(m_transactionRows, other.m_transactionRows);
+        std::swap(m_transactionSize, other.m_transactionSize);
+        std::swap(m_inTransaction, other.m_inTransaction);
+        std::swap(m_holdTransaction, other.m_holdTransaction);
+        std::swap(m_transactionStart, other.m_transactionStart);
+        return *this;
+    }
+
+    FileIndexWriter FileIndexWriter::create(std::string indexDatabasePath, HashAlgorithm algorithm, int jobs) {
+        FileIndexWriter result;
+        result.m_algorithm = algorithm;
+        result.m_jobs = jobs;
+
+        int openResult = sqlite3_open_v2(indexDatabasePath.c_str(), &result.m_database, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
+        if (openResult != SQLITE_OK) {
+            throw std::runtime_error(katla::format("Failed creating file-index {}: {}", indexDatabasePath, sqlite3_errstr(openResult)));
+        }
+
+        // A crash can at most lose the last transactions, it can't corrupt the index. The page size only applies to
+        // a new database file.
+        result.exec("PRAGMA page_size = 8192;");
+        result.exec("PRAGMA journal_mode = WAL;");
+        result.exec("PRAGMA synchronous = NORMAL;");
+        result.exec("PRAGMA cache_size = -16384;");
+        result.exec("PRAGMA temp_store = MEMORY;");
+
+        // The previous content is replaced in the same transaction that writes the rows reused from it, so an
+        // interrupted run never loses the index it resumes from
+        result.beginTransaction();
+        result.m_holdTransaction = true;
+        result.dropSchema(indexDatabasePath);
+
+        // Paths are stored once per directory instead of once per entry, the root is named "." like its relative path
+        result.exec("CREATE TABLE dirs (id INTEGER NOT NULL PRIMARY KEY, parent_id INTEGER, name TEXT, hash BLOB, size INTEGER, mtime INTEGER, ctime INTEGER, inode INTEGER);");
+        result.exec("CREATE TABLE files (id INTEGER NOT NULL PRIMARY KEY, dir_id INTEGER NOT NULL, name TEXT, hash BLOB, size INTEGER, mtime INTEGER, ctime INTEGER, inode INTEGER);");
+
+        // Chunks of files indexed with content-defined chunking, in file order
+        result.exec("CREATE TABLE chunks (file_id INTEGER NOT NULL, offset INTEGER, length INTEGER, hash BLOB);");
+
+        result.exec("CREATE VIEW dirPaths AS "
+                    "WITH RECURSIVE paths (id, path) AS ("
+                    "SELECT id, name FROM dirs WHERE parent_id IS NULL "
+                    "UNION ALL "
+                    "SELECT dirs.id, CASE paths.path WHEN '.' THEN dirs.name ELSE paths.path || '/' || dirs.name END "
+                    "FROM dirs JOIN paths ON dirs.parent_id = paths.id) "
+                    "SELECT id, path FROM paths;");
+
+        // Same columns as the fileIndex table of older indexes, so readers work with both
+        result.exec("CREATE VIEW fileIndex AS "
+                    "SELECT dirPaths.path AS file, dirs.hash AS hash, dirs.size AS size, dirs.mtime AS mtime, dirs.ctime AS ctime, dirs.inode AS inode "
+                    "FROM dirs JOIN dirPaths ON dirs.id = dirPaths.id "
+                    "UNION ALL "
+                    "SELECT CASE dirPaths.path WHEN '.' THEN files.name ELSE dirPaths.path || '/' || files.name END, "
+                    "files.hash, files.size, files.mtime, files.ctime, files.inode "
+                    "FROM files JOIN dirPaths ON files.dir_id = dirPaths.id;");
+
+        // Indexes built with different hash algorithms can't be compared, record which one was used
+        result.exec("CREATE TABLE fileIndexInfo (key TEXT NOT NULL PRIMARY KEY, value TEXT);");
+        result.exec(katla::format("INSERT INTO fileIndexInfo (key, value) VALUES ('hashAlgorithm', '{}');", Hasher::algorithmName(algorithm)).c_str());
+        result.exec(katla::format("INSERT INTO fileIndexInfo (key, value) VALUES ('directoryHashVersion', '{}');", DirectoryHashVersion).c_str());
+        result.exec("INSERT INTO fileIndexInfo (key, value) VALUES ('complete', '0');");
+
+        result.m_insertDirectoryStatement = result.prepare("INSERT INTO dirs (id, parent_id, name, size, mtime, ctime, inode) VALUES (?, ?, ?, ?, ?, ?, ?);");
+        result.m_updateDirectoryStatement = result.prepare("UPDATE dirs SET hash = ? WHERE id = ?;");
+        result.m_insertFileStatement = result.prepare("INSERT INTO files (id, dir_id, name, hash, size, mtime, ctime, inode) VALUES (?, ?, ?, ?, ?, ?, ?, ?);");
+        result.m_insertChunkStatement = result.prepare("INSERT INTO chunks (file_id, offset, length, hash) VALUES (?, ?, ?, ?);");
+
+        return result;
+    }
+
+    void FileIndexWriter::setChunking(const std::string& description) {
+        sqlite3_stmt* statement = prepare("INSERT INTO fileIndexInfo (key, value) VALUES ('chunking', ?);");
+        sqlite3_bind_text(statement, 1, description.c_str(), static_cast<int>(description.size()), SQLITE_TRANSIENT);
+        int stepResult = sqlite3_step(statement);
+        sqlite3_finalize(statement);
+        if (stepResult != SQLITE_DONE) {
+            throw std::runtime_error(katla::format("Writing file-index failed: {}", sqlite3_errmsg(m_database)));
+        }
+    }
+
+    void FileIndexWriter::addDirectories(const FileTree& tree) {
+        for (NodeIndex index = 0; index < tree.size(); index++) {
+            auto& node = tree.node(index);
+            if (node.type == FileSystemEntryType::File) {
+                continue;
+            }
+
+            auto name = (index == FileTree::root()) ? std::string_view(".") : tree.name(index);
+
+            sqlite3_bind_int64(m_insertDirectoryStatement, 1, index);
+            if (node.parent == NoNode) {
+                sqlite3_bind_null(m_insertDirectoryStatement, 2);
+            } else {
+                sqlite3_bind_int64(m_insertDirectoryStatement, 2, node.parent);
+            }
+            sqlite3_bind_text(m_insertDirectoryStatement, 3, name.data(), static_cast<int>(name.size()), SQLITE_STATIC);
+            sqlite3_bind_int64(m_insertDirectoryStatement, 4, static_cast<sqlite3_int64>(node.size));
+            sqlite3_bind_int64(m_insertDirectoryStatement, 5, node.modificationTime);
+            sqlite3_bind_int64(m_insertDirectoryStatement, 6, node.changeTime);
+            sqlite3_bind_int64(m_insertDirectoryStatement, 7, static_cast<sqlite3_int64>(node.inode));
+
+            step(m_insertDirectoryStatement);
+        }
+    }
+
+    void FileIndexWriter::write(const FileTree& tree, NodeIndex index) {
+        if (!m_inTransaction) {
+            beginTransaction();
+        }
+
+        auto& node = tree.node(index);
+        auto hashSize = static_cast<int>(Hasher::digestSize(m_algorithm));
+
+        if (node.type == FileSystemEntryType::File) {
+            auto name = tree.name(index);
+
+            sqlite3_bind_int64(m_insertFileStatement, 1, index);
+            sqlite3_bind_int64(m_insertFileStatement, 2, node.parent);
+            sqlite3_bind_text(m_insertFileStatement, 3, name.data(), static_cast<int>(name.size()), SQLITE_STATIC);
+            sqlite3_bind_blob(m_insertFileStatement, 4, node.hash.data(), hashSize, SQLITE_STATIC);
+            sqlite3_bind_int64(m_insertFileStatement, 5, static_cast<sqlite3_int64>(node.size));
+            sqlite3_bind_int64(m_insertFileStatement, 6, node.modificationTime);
+            sqlite3_bind_int64(m_insertFileStatement, 7, node.changeTime);
+            sqlite3_bind_int64(m_insertFileStatement, 8, static_cast<sqlite3_int64>(node.inode));
+
+            step(m_insertFileStatement);
+        } else {
+            sqlite3_bind_blob(m_updateDirectoryStatement, 1, node.hash.data(), hashSize, SQLITE_STATIC);
+            sqlite3_bind_int64(m_updateDirectoryStatement, 2, index);
+
+            step(m_updateDirectoryStatement);
+        }
+
+        m_nrOfRows++;
+        m_transactionRows++;
+
+        if (m_holdTransaction) {
+            return;
+        }
+
+        bool full = m_transactionRows >= m_transactionSize;
+        bool expired = std::chrono::steady_clock::now() - m_transactionStart > MaxTransactionDuration;
+        if (full || expired) {
+            commitTransaction();
+        }
+    }
+
+    void FileIndexWriter::writeChunks(NodeIndex index, const std::vector<FileChunk>& chunks) {
+        if (!m_inTransaction) {
+            beginTransaction();
+        }
+
+        auto hashSize = static_cast<int>(Hasher::digestSize(m_algorithm));
+
+        for (auto& chunk : chunks) {
+            sqlite3_bind_int64(m_insertChunkStatement, 1, index);
+            sqlite3_bind_int64(m_insertChunkStatement, 2, static_cast<sqlite3_int64>(chunk.offset));
+            sqlite3_bind_int64(m_insertChunkStatement, 3, chunk.length);
+            sqlite3_bind_blob(m_insertChunkStatement, 4, chunk.hash.data(), hashSize, SQLITE_STATIC);
+
+            step(m_insertChunkStatement);
+        }
+
+        // Chunks fill a transaction like other rows, the commit happens when the file is written
+        m_transactionRows += chunks.size();
+    }
+
+    void FileIndexWriter::commit() {
+        m_holdTransaction = false;
+        if (m_inTransaction) {
+            commitTransaction();
+        }
+    }
+
+    void FileIndexWriter::finish() {
+        commit();
+
+        katla::printInfo("Creating file-index indexes...");
+
+        // Index creation sorts all rows, a larger cache keeps the sort from spilling to temporary files and
+        // helper threads next to the calling thread sort in parallel
+        exec("PRAGMA cache_size = -131072;");
+        exec(katla::format("PRAGMA threads = {};", WorkerPool(m_jobs).nrOfThreads() - 1).c_str());
+        exec("CREATE INDEX dirsParent ON dirs (parent_id, name);");
+        exec("CREATE INDEX filesDir ON files (dir_id, name);");
+        exec("CREATE INDEX filesHash ON files (hash);");
+        exec("CREATE INDEX chunksHash ON chunks (hash);");
+        exec("UPDATE fileIndexInfo SET value = '1' WHERE key = 'complete';");
+
+        // Moves the log into the database, so the index is a single file again
+        exec("PRAGMA wal_checkpoint(TRUNCATE);");
+    }
+
+    void FileIndexWriter::dropSchema(const std::string& indexDatabasePath) {
+        std::vector<std::pair<std::string, std::string>> objects;
+        bool empty = true;
+
+        sqlite3_stmt* statement = prepare("SELECT type, name FROM sqlite_schema WHERE name NOT LIKE 'sqlite_%';");
+        while (sqlite3_step(statement) == SQLITE_ROW) {
+            empty = false;
+            std::string type = reinterpret_cast<const char*>(sqlite3_column_text(statement, 0));
+            std::string name = reinterpret_cast<const char*>(sqlite3_column_text(statement, 1));
+            if ((type == "table" || type == "view") &&
+                (name == "dirs" || name == "files" || name == "chunks" || name == "fileIndexInfo" || name == "fileIndex" || name == "dirPaths")) {
+                objects.emplace_back(type, name);
+            }
+        }
+        sqlite3_finalize(statement);
+
+        // Any other database at the output path is left alone, older indexes only have a fileIndex table
+        auto isIndexObject = [&](const std::string& type, const std::string& name) {
+            return std::find(objects.begin(), objects.end(), std::make_pair(type, name)) != objects.end();
+        };
+        if (!empty && !isIndexObject("table", "fileIndexInfo") && !isIndexObject("table", "fileIndex")) {
+            throw std::runtime_error(katla::format("{} is not a file-index, refusing to overwrite it", indexDatabasePath));
+        }
+
+        // Views first, they depend on the tables. Tables and views that aren't part of the index are kept.
+        std::sort(objects.begin(), objects.end(), [](auto& a, auto& b) {
+            return a.first > b.first;
+        });
+
+        for (auto& [type, name] : objects) {
+            exec(katla::format("DROP {} \"{}\";", type == "view" ? "VIEW" : "TABLE", name).c_str());
+        }
+    }
+
+    void FileIndexWriter::step(sqlite3_stmt* statement) {
+        int stepResult = sqlite3_step(statement);
+        sqlite3_reset(statement);
+        if (stepResult != SQLITE_DONE) {
+            throw std::runtime_error(katla::format("Writing file-index failed: {}", sqlite3_errmsg(m_database)));
+        }
+    }
+
+    sqlite3_stmt* FileIndexWriter::prepare(const char* query) {
+        sqlite3_stmt* statement = nullptr;
+        if (sqlite3_prepare_v3(m_database, query, -1, SQLITE_PREPARE_PERSISTENT, &statement, nullptr) != SQLITE_OK) {
+            throw std::runtime_error(katla::format("Failed preparing {}: {}", query, sqlite3_errmsg(m_database)));
+        }
+
+        return statement;
+    }
+
+    void FileIndexWriter::exec(const char* query) {
+        char* errorMessage = nullptr;
+        if (sqlite3_exec(m_database, query, nullptr, nullptr, &errorMessage) != SQLITE_OK) {
+            std::string message = errorMessage ? errorMessage : sqlite3_errmsg(m_database);
+            sqlite3_free(errorMessage);
+            throw std::runtime_error(katla::format("File-index query failed: {}: {}", query, message));
+        }
+    }
+
+    void FileIndexWriter::beginTransaction() {
+        exec("BEGIN TRANSACTION;");
+        m_inTransaction = true;
+        m_transactionRows = 0;
+        m_transactionStart = std::chrono::steady_clock::now();
+    }
+
+    void FileIndexWriter::commitTransaction() {
+        exec("COMMIT TRANSACTION;");
+        m_inTransaction = false;
+
+        auto duration = std::chrono::steady_clock::now() - m_transactionStart;
+        if (duration < TargetTransactionDuration) {
+            m_transactionSize = std::min(MaxTransactionSize, m_transactionSize * 2);
+        } else if (duration > TargetTransactionDuration * 10) {
+            m_transactionSize = std::max(MinTransactionSize, m_transactionSize / 2);
+        }
+
+        katla::printInfo("Saving database: {} rows", m_nrOfRows);
+    }
+
+} // namespace backer
@@ -0,0 +1,109 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FILE_INDEX_WRITER_H
+#define FILE_INDEX_WRITER_H
+
+#include "katla/core/core.h"
+
+#include "fast-cdc.h"
+#include "file-tree.h"
+#include "hasher.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+namespace backer {
+
+// Directories are hashed from the name, type and hash of their children in name order since version 2, version 1
+// hashed only the child hashes in listing order
+constexpr int DirectoryHashVersion = 2;
+
+// Writes a file-index database while the tree is being hashed. Directories and files are stored in separate tables
+// by name, with a reference to their parent directory, the fileIndex view puts the full relative paths back together.
+// Rows go through prepared statements with the hash stored as a blob, transactions grow while commits are cheap and
+// the secondary indexes are only built once all rows are in. Until then the index is marked incomplete.
+class FileIndexWriter {
+public:
+    FileIndexWriter();
+    ~FileIndexWriter();
+
+    FileIndexWriter(const FileIndexWriter&) = delete;
+    FileIndexWriter& operator=(const FileIndexWriter&) = delete;
+    FileIndexWriter(FileIndexWriter&& other) noexcept;
+    FileIndexWriter& operator=(FileIndexWriter&& other) noexcept;
+
+    // Replaces the content of any existing database at the path. Nothing is committed until the first call to
+    // commit, so rows taken over from the previous content can be written in the same transaction. The secondary
+    // indexes are sorted with up to jobs threads, 0 uses all hardware threads.
+    static FileIndexWriter create(std::string indexDatabasePath, HashAlgorithm algorithm, int jobs = 0);
+
+    // Records how the chunks of the files were cut, only indexes with chunks call this
+    void setChunking(const std::string& description);
+
+    // Adds every directory without a hash, so files can be written before their directory is complete.
+    // Directories are identified by their node index.
+    void addDirectories(const FileTree& tree);
+
+    // Adds a file with its hash, or sets the hash of a directory
+    void write(const FileTree& tree, NodeIndex index);
+
+    // Adds the chunks of a file, written before the file itself so they are committed together
+    void writeChunks(NodeIndex index, const std::vector<FileChunk>& chunks);
+
+    // Commits the rows written so far, from then on transactions are committed as they fill up
+    void commit();
+
+    // Commits the remaining rows, builds the secondary indexes and marks the index complete
+    void finish();
+
+    size_t nrOfRows() const {
+        return m_nrOfRows;
+    }
+
+private:
+    void dropSchema(const std::string& indexDatabasePath);
+    void step(sqlite3_stmt* statement);
+    sqlite3_stmt* prepare(const char* query);
+    void exec(const char* query);
+    void beginTransaction();
+    void commitTransaction();
+
+    sqlite3* m_database { nullptr };
+    sqlite3_stmt* m_insertDirectoryStatement { nullptr };
+    sqlite3_stmt* m_updateDirectoryStatement { nullptr };
+    sqlite3_stmt* m_insertFileStatement { nullptr };
+    sqlite3_stmt* m_insertChunkStatement { nullptr };
+    HashAlgorithm m_algorithm { HashAlgorithm::Sha256 };
+    int m_jobs { 0 };
+
+    size_t m_nrOfRows { 0 };
+    size_t m_transactionRows { 0 };
+    size_t m_transactionSize { 1024 };
+    bool m_inTransaction { false };
+    bool m_holdTransaction { false };
+    std::chrono::steady_clock::time_point m_transactionStart;
+};
+
+} // namespace backer
+
+#endif
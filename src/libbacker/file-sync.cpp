@@ -0,0 +1,255 @@
+#include "file-sync.h"
+
+#include "backer.h"
+#include "file-descriptor.h"
+#include "file-index-compare.h"
+#include "worker-pool.h"
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <random>
+#include <set>
+
+namespace backer {
+
+    namespace fs = std::filesystem;
+
+    namespace {
+        // Largest count a single copy_file_range or sendfile call accepts without being cut short
+        constexpr size_t MaxCopySize = 0x7ffff000;
+
+        // Copies with the given call until the end of the file, returns false when the call is not supported
+        // for these files and nothing was copied yet
+        bool copyAll(const std::function<ssize_t(size_t)>& copy, uint64_t size, const std::string& path)
+        {
+            uint64_t bytesCopied = 0;
+            while (bytesCopied < size) {
+                ssize_t result = copy(std::min<uint64_t>(size - bytesCopied, MaxCopySize));
+                if (result < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (result < 0 && bytesCopied == 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                    return false;
+                }
+                if (result < 0) {
+                    throw std::runtime_error(katla::format("Failed copying {}: {}", path, std::strerror(errno)));
+                }
+                if (result == 0) {
+                    throw std::runtime_error(katla::format("Failed copying {}: file shrunk while copying", path));
+                }
+                bytesCopied += result;
+            }
+
+            return true;
+        }
+
+        // A name next to destPath that no other sync uses at the same time. The random part keeps it from matching
+        // what a crashed run left behind, the file is still opened with O_EXCL so nothing at that name is written
+        // through.
+        std::string temporaryPath(const fs::path& destPath)
+        {
+            static const uint64_t nonce = (static_cast<uint64_t>(std::random_device()()) << 32) | static_cast<uint32_t>(::getpid());
+            static std::atomic<uint64_t> counter {0};
+            return (destPath.parent_path() / katla::format(".{}.{:x}-{}.backer-sync", destPath.filename().string(), nonce, counter++)).string();
+        }
+
+        // Copies owner, mode and times of the source to an open file or directory
+        void copyAttributes(int fd, const struct stat& status, const std::string& path)
+        {
+            // Owners can only be kept with enough privileges, a copy owned by the user running the sync is fine
+            if (::fchown(fd, status.st_uid, status.st_gid) != 0 && errno != EPERM) {
+                throw std::runtime_error(katla::format("Failed setting owner of {}: {}", path, std::strerror(errno)));
+            }
+            if (::fchmod(fd, status.st_mode & 07777) != 0) {
+                throw std::runtime_error(katla::format("Failed setting mode of {}: {}", path, std::strerror(errno)));
+            }
+
+            struct timespec times[2] = {status.st_atim, status.st_mtim};
+            if (::futimens(fd, times) != 0) {
+                throw std::runtime_error(katla::format("Failed setting times of {}: {}", path, std::strerror(errno)));
+            }
+        }
+
+        void copyDirectoryAttributes(const std::string& srcPath, const std::string& destPath)
+        {
+            FileDescriptor src(srcPath, O_RDONLY | O_DIRECTORY);
+            struct stat status {};
+            if (::fstat(src.fd, &status) != 0) {
+                throw std::runtime_error(katla::format("Failed reading status of {}: {}", srcPath, std::strerror(errno)));
+            }
+
+            FileDescriptor dest(destPath, O_RDONLY | O_DIRECTORY);
+            copyAttributes(dest.fd, status, destPath);
+        }
+    }
+
+    FileSync::FileSync(FileSyncOptions options) :
+        m_options(options)
+    {
+    }
+
+    void FileSync::sync(const std::string& srcPath, const std::string& srcIndexPath, const std::string& destPath, const std::string& destIndexPath)
+    {
+        m_statistics = {};
+
+        // Dest can be a snapshot as well, only the src records are needed again to copy and verify the files
+        auto files = FileIndexCompare::compare(srcIndexPath, destIndexPath).onlyAtSrc;
+
+        std::string srcAlgorithm;
+        auto srcRecords = FileIndexCompare::readFiles(srcIndexPath, srcAlgorithm);
+        auto algorithm = Hasher::parseAlgorithm(srcAlgorithm);
+        m_statistics.nrOfFiles = files.size();
+
+        katla::printInfo("Copying {} files from {} to {}...", files.size(), srcPath, destPath);
+
+        // Directories are created up front, so the copies don't race to create them, and only get the attributes of
+        // their source once all files are renamed into them
+        std::set<fs::path> createdDirectories;
+        for (auto& file : files) {
+            fs::path directory;
+            for (auto& part : fs::path(file).parent_path()) {
+                directory /= part;
+                std::error_code error;
+                if (fs::create_directory(fs::path(destPath) / directory, error)) {
+                    createdDirectories.insert(directory);
+                }
+            }
+        }
+
+        std::atomic<size_t> nrOfDone {0};
+        std::atomic<size_t> nrOfFailed {0};
+        std::atomic<size_t> nrOfMethod[3] {{0}, {0}, {0}};
+        std::atomic<uint64_t> bytesCopied {0};
+        std::atomic<uint64_t> bytesReflinked {0};
+
+        WorkerPool(m_options.jobs).forEach(files.size(), [&](size_t i) {
+            auto& file = files[i];
+            auto& record = srcRecords.at(file);
+            auto target = fs::path(destPath) / file;
+            auto temporary = temporaryPath(target);
+            bool copied = false;
+
+            try {
+                auto method = copyFile((fs::path(srcPath) / file).string(), temporary);
+                copied = true;
+
+                if (m_options.verify) {
+                    auto hash = Hasher::toDigest(Backer::hashFile(temporary, algorithm, 1024 * 1024));
+                    if (hash != record.hash) {
+                        throw std::runtime_error(katla::format("Copy of {} does not match its source, it changed since it was indexed", file));
+                    }
+                }
+
+                fs::rename(temporary, target);
+
+                nrOfMethod[static_cast<int>(method)]++;
+                bytesCopied += record.size;
+                if (method == CopyMethod::Reflink) {
+                    bytesReflinked += record.size;
+                }
+                katla::printInfo("{}/{} {} ({})", ++nrOfDone, files.size(), file, copyMethodName(method));
+            } catch (const std::exception& exception) {
+                if (copied) {
+                    std::error_code error;
+                    fs::remove(temporary, error);
+                }
+                nrOfFailed++;
+                katla::printError("{}", exception.what());
+            }
+        });
+
+        for (auto& directory : createdDirectories) {
+            try {
+                copyDirectoryAttributes((fs::path(srcPath) / directory).string(), (fs::path(destPath) / directory).string());
+            } catch (const std::exception& exception) {
+                katla::printError("{}", exception.what());
+            }
+        }
+
+        m_statistics.nrOfReflinked = nrOfMethod[static_cast<int>(CopyMethod::Reflink)];
+        m_statistics.nrOfCopied = nrOfMethod[static_cast<int>(CopyMethod::CopyFileRange)];
+        m_statistics.nrOfSent = nrOfMethod[static_cast<int>(CopyMethod::Sendfile)];
+        m_statistics.nrOfFailed = nrOfFailed;
+        m_statistics.bytesCopied = bytesCopied;
+        m_statistics.bytesReflinked = bytesReflinked;
+    }
+
+    void FileSync::printStatistics() const
+    {
+        katla::print(stdout, "Nr of files only at src: {}\n", m_statistics.nrOfFiles);
+        katla::print(stdout,
+                     "Reflinked: {}, copied by copy_file_range: {}, copied by sendfile: {}, failed: {}\n",
+                     m_statistics.nrOfReflinked,
+                     m_statistics.nrOfCopied,
+                     m_statistics.nrOfSent,
+                     m_statistics.nrOfFailed);
+        katla::print(stdout, "Copied: {} bytes, of which {} bytes share extents with their source\n", m_statistics.bytesCopied, m_statistics.bytesReflinked);
+    }
+
+    CopyMethod FileSync::copyFile(const std::string& srcPath, const std::string& destPath)
+    {
+        FileDescriptor src(srcPath, O_RDONLY);
+
+        struct stat status {};
+        if (::fstat(src.fd, &status) != 0) {
+            throw std::runtime_error(katla::format("Failed reading status of {}: {}", srcPath, std::strerror(errno)));
+        }
+        if (!S_ISREG(status.st_mode)) {
+            throw std::runtime_error(katla::format("{} is not a regular file", srcPath));
+        }
+
+        FileDescriptor dest(destPath, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+        auto size = static_cast<uint64_t>(status.st_size);
+
+        CopyMethod method = CopyMethod::Reflink;
+        try {
+            if (::ioctl(dest.fd, FICLONE, src.fd) != 0) {
+                method = CopyMethod::CopyFileRange;
+                bool copied = copyAll([&](size_t count) {
+                    return ::copy_file_range(src.fd, nullptr, dest.fd, nullptr, count, 0);
+                }, size, srcPath);
+
+                if (!copied) {
+                    method = CopyMethod::Sendfile;
+                    copyAll([&](size_t count) {
+                        return ::sendfile(dest.fd, src.fd, nullptr, count);
+                    }, size, srcPath);
+                }
+            }
+
+            copyAttributes(dest.fd, status, destPath);
+        } catch (...) {
+            // Only the file created here is removed, never one that was already at destPath
+            ::unlink(destPath.c_str());
+            throw;
+        }
+
+        return method;
+    }
+
+    std::string FileSync::copyMethodName(CopyMethod method)
+    {
+        switch (method) {
+            case CopyMethod::Reflink:
+                return "reflink";
+            case CopyMethod::CopyFileRange:
+                return "copy_file_range";
+            case CopyMethod::Sendfile:
+                return "sendfile";
+        }
+
+        return "unknown";
+    }
+
+} // namespace backer
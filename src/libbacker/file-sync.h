@@ -0,0 +1,81 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FILE_SYNC_H
+#define FILE_SYNC_H
+
+#include "katla/core/core.h"
+
+#include "hasher.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace backer {
+
+// Ways a file is copied, from cheapest to most expensive
+enum class CopyMethod { Reflink, CopyFileRange, Sendfile };
+
+struct FileSyncOptions
+{
+    int jobs { 0 }; // Number of files copied at the same time, 0 uses all hardware threads
+    bool verify { true }; // Hash every copy and compare it with the hash of the source in its index
+};
+
+struct FileSyncStatistics
+{
+    size_t nrOfFiles { 0 }; // Files only at src
+    size_t nrOfReflinked { 0 };
+    size_t nrOfCopied { 0 }; // Copied by the kernel with copy_file_range
+    size_t nrOfSent { 0 }; // Copied with sendfile, when copy_file_range is not supported between the file systems
+    size_t nrOfFailed { 0 };
+    uint64_t bytesCopied { 0 }; // Including reflinked bytes, which take no extra space
+    uint64_t bytesReflinked { 0 };
+};
+
+// Copies the files that have no file with the same content at dest, as found by comparing the indexes of both
+// trees, to the same path below dest. The data never passes through user space: a copy shares the extents of its
+// source when the file system supports reflinks, otherwise the kernel copies it. A copy is written to a temporary
+// file that only replaces the destination path once its mode, owner and times are set and its content matches
+// the hash in the source index, so the source is never read twice. Directories created at dest get the mode, owner
+// and times of their source once their files are in place.
+class FileSync {
+public:
+    explicit FileSync(FileSyncOptions options = {});
+
+    void sync(const std::string& srcPath, const std::string& srcIndexPath, const std::string& destPath, const std::string& destIndexPath);
+
+    const FileSyncStatistics& statistics() const {
+        return m_statistics;
+    }
+
+    void printStatistics() const;
+
+    // Copies the content, mode, owner and times of a regular file to a new file at destPath, fails when destPath
+    // already exists
+    static CopyMethod copyFile(const std::string& srcPath, const std::string& destPath);
+
+    static std::string copyMethodName(CopyMethod method);
+
+private:
+    FileSyncOptions m_options;
+    FileSyncStatistics m_statistics;
+};
+
+} // namespace backer
+
+#endif
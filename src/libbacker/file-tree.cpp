@@ -1,108 +1,158 @@
 #include "file-tree.h"
 
-#include "katla/core/posix-file.h"
+#include "directory-scanner.h"
 
-#include <filesystem>
-#include <openssl/md5.h>
+#include <algorithm>
 
 namespace backer {
 
-    namespace fs = std::filesystem;
-
     FileTree::FileTree() {
     }
 
-    FileSystemEntry FileTree::create(std::string path) {
-        return fileSystemEntryFromDir(fs::directory_entry(fs::path(path)), path);
+    FileTree FileTree::create(std::string path, int jobs) {
+        return DirectoryScanner(jobs).scan(path);
     }
 
-    std::vector<backer::FileSystemEntry> FileTree::flatten(const FileSystemEntry& entry)
+    std::string_view FileTree::name(NodeIndex index) const
     {
-        std::vector<FileSystemEntry> files;
-        files.push_back(entry);
-
-        flattenChild(entry, files);
-        return files;
+        auto& node = m_nodes[index];
+        return std::string_view(m_names.data() + node.nameOffset, node.nameLength);
     }
 
-    void FileTree::flattenChild(const FileSystemEntry& entry, std::vector<backer::FileSystemEntry>& list)
+    std::string FileTree::relativePath(NodeIndex index) const
     {
-        if (entry.children.has_value()) {
-            for(auto& file : entry.children.value()) {
-                list.push_back(file);
+        if (index == root()) {
+            return ".";
+        }
+
+        std::vector<NodeIndex> ancestors;
+        size_t length = 0;
+        for (NodeIndex i = index; i != root(); i = m_nodes[i].parent) {
+            ancestors.push_back(i);
+            length += m_nodes[i].nameLength + 1;
+        }
 
-                if (file.type == FileSystemEntryType::Dir) {
-                    flattenChild(file, list);
-                }
+        std::string result;
+        result.reserve(length);
+        for (auto it = ancestors.rbegin(); it != ancestors.rend(); it++) {
+            if (!result.empty()) {
+                result += '/';
             }
+            result += name(*it);
         }
+
+        return result;
     }
 
-    FileSystemEntry FileTree::fileSystemEntryFromFile(const std::filesystem::directory_entry& entry, std::string basePath)
+    std::string FileTree::absolutePath(NodeIndex index) const
     {
-        if (!entry.is_regular_file()) {
-            return {};
+        if (index == root()) {
+            return m_rootPath;
         }
 
-        FileSystemEntry fileData{};
-        fileData.name = entry.path().filename().string();
-        fileData.relativePath = fs::relative(entry.path(), basePath).string();
-
-        auto absolutePathResult = katla::PosixFile::absolutePath(entry.path().string());
-        if (!absolutePathResult) {
-            throw std::runtime_error(absolutePathResult.error().message());
+        if (!m_rootPath.empty() && m_rootPath.back() == '/') {
+            return m_rootPath + relativePath(index);
         }
+        return m_rootPath + "/" + relativePath(index);
+    }
 
-        fileData.absolutePath = absolutePathResult.value();
-        fileData.size = entry.file_size();
-        fileData.type = FileSystemEntryType::File;
-
-        return fileData;
+    FileSystemEntry FileTree::entry(NodeIndex index) const
+    {
+        auto& node = m_nodes[index];
+
+        FileSystemEntry result {};
+        result.name = std::string(name(index));
+        result.relativePath = relativePath(index);
+        result.absolutePath = absolutePath(index);
+        result.size = node.size;
+        result.modificationTime = node.modificationTime;
+        result.changeTime = node.changeTime;
+        result.device = node.device;
+        result.inode = node.inode;
+        result.hash = node.hash;
+        result.type = node.type;
+        result.hardLinked = node.hardLinked;
+        return result;
     }
 
-    FileSystemEntry FileTree::fileSystemEntryFromDir(const std::filesystem::directory_entry& entry, std::string basePath)
+    void FileTree::forEachFile(const std::function<void(NodeIndex)>& function) const
     {
-        if (!entry.is_directory()) {
-            return {};
+        for (NodeIndex i = 0; i < m_nodes.size(); i++) {
+            if (m_nodes[i].type == FileSystemEntryType::File) {
+                function(i);
+            }
         }
+    }
+
+    void FileTree::visitPreOrder(NodeIndex index, const std::function<void(NodeIndex)>& function) const
+    {
+        std::vector<NodeIndex> stack = {index};
+        while (!stack.empty()) {
+            auto current = stack.back();
+            stack.pop_back();
 
-        FileSystemEntry dirData{};
-        dirData.name = entry.path().filename().string();
-        dirData.relativePath = fs::relative(entry.path(), basePath).string();
+            function(current);
 
-        auto absolutePathResult = katla::PosixFile::absolutePath(entry.path().string());
-        if (!absolutePathResult) {
-            throw std::runtime_error(absolutePathResult.error().message());
+            auto& node = m_nodes[current];
+            for (NodeIndex child = node.firstChild + node.childCount; child > node.firstChild; child--) {
+                stack.push_back(child - 1);
+            }
         }
+    }
+
+    void FileTree::visitPostOrder(NodeIndex index, const std::function<void(NodeIndex)>& function) const
+    {
+        // Every directory on the stack remembers how many of its children were visited
+        std::vector<std::pair<NodeIndex, uint32_t>> stack = {{index, 0}};
+        while (!stack.empty()) {
+            auto& [current, nextChild] = stack.back();
+            auto& node = m_nodes[current];
+
+            if (nextChild < node.childCount) {
+                NodeIndex child = node.firstChild + nextChild++;
+                stack.push_back({child, 0});
+                continue;
+            }
 
-        dirData.absolutePath = absolutePathResult.value();
+            function(current);
+            stack.pop_back();
+        }
+    }
 
-        fs::directory_iterator dirIter(entry.path());
+    size_t FileTree::memoryUsage() const
+    {
+        return sizeof(FileTree) + m_nodes.capacity() * sizeof(FileNode) + m_names.capacity() + m_rootPath.capacity();
+    }
 
-        dirData.children = std::vector<FileSystemEntry>();
+    NodeIndex FileTree::addNode(FileNode node, std::string_view name)
+    {
+        if (m_nodes.size() >= NoNode) {
+            throw std::runtime_error("Too many entries for a file tree");
+        }
 
-        size_t dirSize = 0;
-        for (auto &entry : dirIter) {
-            if (entry.is_symlink() || entry.is_other()) {
-                continue;
-            }
+        node.nameOffset = m_names.size();
+        node.nameLength = static_cast<uint16_t>(name.size());
+        m_names.append(name);
 
-            if (entry.is_regular_file() ) {
-                auto childFileData = fileSystemEntryFromFile(entry, basePath);
-                dirSize += childFileData.size;
-                dirData.children->push_back(childFileData);             
-            }
-            if (entry.is_directory()) {
-                auto childDirData = fileSystemEntryFromDir(entry, basePath);
-                dirSize += childDirData.size;
-                dirData.children->push_back(childDirData);          
-            }      
+        if (node.type == FileSystemEntryType::File) {
+            m_nrOfFiles++;
+        } else {
+            m_nrOfDirectories++;
         }
 
-        dirData.size = dirSize;
-        dirData.type = FileSystemEntryType::Dir;
+        m_nodes.push_back(node);
+        return static_cast<NodeIndex>(m_nodes.size() - 1);
+    }
+
+    void FileTree::setRootPath(std::string absolutePath)
+    {
+        m_rootPath = std::move(absolutePath);
+    }
 
-        return dirData;
+    void FileTree::reserve(size_t nrOfNodes, size_t nameBytes)
+    {
+        m_nodes.reserve(nrOfNodes);
+        m_names.reserve(nameBytes);
     }
 
-} // namespace backer
\ No newline at end of file
+} // namespace backer
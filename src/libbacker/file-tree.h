@@ -20,31 +20,110 @@
 #include "katla/core/core.h"
 
 #include "file-data.h"
+#include "hasher.h"
 
 #include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <limits>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <map>
-#include <filesystem>
 
 namespace backer {
-    
+
+using NodeIndex = uint32_t;
+constexpr NodeIndex NoNode = std::numeric_limits<NodeIndex>::max();
+
+// A file or directory in a FileTree. The name lives in the name arena of the tree, paths are rebuilt from
+// the parent indices when needed.
+struct FileNode
+{
+    uint64_t nameOffset { 0 };
+    NodeIndex parent { NoNode };
+    NodeIndex firstChild { 0 }; // Children of a directory are stored next to each other
+    uint32_t childCount { 0 };
+    uint16_t nameLength { 0 };
+    FileSystemEntryType type { FileSystemEntryType::File };
+    bool hardLinked { false }; // A file with more than one link, see inodeId
+    uint64_t size { 0 }; // For directories the size of everything below it
+    int64_t modificationTime { 0 }; // ns since epoch
+    int64_t changeTime { 0 }; // ns since epoch
+    uint64_t device { 0 };
+    uint64_t inode { 0 };
+    Digest hash {};
+
+    InodeId inodeId() const {
+        return {device, inode};
+    }
+};
+
+// Directory tree stored as a flat vector of nodes, the root is the first node. Children always come after
+// their parent.
 class FileTree {
 public:
     FileTree();
 
-    static FileSystemEntry create(std::string path);
+    // Scans the tree below path, see DirectoryScanner. Jobs is the number of scanning threads, 0 uses all hardware threads.
+    static FileTree create(std::string path, int jobs = 0);
+
+    static constexpr NodeIndex root() {
+        return 0;
+    }
+
+    size_t size() const {
+        return m_nodes.size();
+    }
+
+    size_t nrOfFiles() const {
+        return m_nrOfFiles;
+    }
+
+    size_t nrOfDirectories() const {
+        return m_nrOfDirectories;
+    }
+
+    FileNode& node(NodeIndex index) {
+        return m_nodes[index];
+    }
+
+    const FileNode& node(NodeIndex index) const {
+        return m_nodes[index];
+    }
+
+    std::string_view name(NodeIndex index) const;
+
+    // Path relative to the root, "." for the root itself
+    std::string relativePath(NodeIndex index) const;
+    std::string absolutePath(NodeIndex index) const;
+
+    // Copy of a node with its paths filled in
+    FileSystemEntry entry(NodeIndex index) const;
+
+    // Calls function for every regular file, in node order
+    void forEachFile(const std::function<void(NodeIndex)>& function) const;
+
+    // Depth first traversals starting at index, children are visited in the order the file system listed them.
+    // Pre-order visits a directory before its children, post-order after them.
+    void visitPreOrder(NodeIndex index, const std::function<void(NodeIndex)>& function) const;
+    void visitPostOrder(NodeIndex index, const std::function<void(NodeIndex)>& function) const;
 
-    static std::vector<backer::FileSystemEntry> flatten(const FileSystemEntry& entry);
+    // Bytes used by the nodes and the name arena
+    size_t memoryUsage() const;
 
-    static backer::FileSystemEntry fileSystemEntryFromFile(const std::filesystem::directory_entry& entry, std::string basePath);
-    static backer::FileSystemEntry fileSystemEntryFromDir(const std::filesystem::directory_entry& entry, std::string basePath);
+    // Used while building the tree
+    NodeIndex addNode(FileNode node, std::string_view name);
+    void setRootPath(std::string absolutePath);
+    void reserve(size_t nrOfNodes, size_t nameBytes);
 
 private:
-    static void flattenChild(const FileSystemEntry& entry, std::vector<backer::FileSystemEntry>& list);
+    std::vector<FileNode> m_nodes;
+    std::string m_names;
+    std::string m_rootPath;
+    size_t m_nrOfFiles { 0 };
+    size_t m_nrOfDirectories { 0 };
 };
 
 } // namespace backer
 
-#endif
\ No newline at end of file
+#endif
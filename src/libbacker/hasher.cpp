@@ -0,0 +1,195 @@
+#include "hasher.h"
+
+#include <openssl/sha.h>
+
+#ifdef BACKER_HAVE_XXHASH
+#include <xxhash.h>
+#endif
+
+#ifdef BACKER_HAVE_BLAKE3
+#include <blake3.h>
+#endif
+
+#include <algorithm>
+#include <exception>
+
+namespace backer {
+
+    namespace {
+        class Sha256Hasher : public Hasher {
+        public:
+            Sha256Hasher() {
+                if (!SHA256_Init(&m_ctx)) {
+                    throw std::runtime_error("Failed initializing sha256 context!");
+                }
+            }
+
+            void update(const std::byte* data, size_t size) override {
+                SHA256_Update(&m_ctx, reinterpret_cast<const unsigned char*>(data), size);
+            }
+
+            std::vector<std::byte> final() override {
+                std::vector<std::byte> result(SHA256_DIGEST_LENGTH);
+                SHA256_Final(reinterpret_cast<unsigned char*>(result.data()), &m_ctx);
+                return result;
+            }
+
+        private:
+            SHA256_CTX m_ctx;
+        };
+
+#ifdef BACKER_HAVE_XXHASH
+        class Xxh3Hasher : public Hasher {
+        public:
+            Xxh3Hasher() :
+                m_state(XXH3_createState())
+            {
+                if (!m_state || XXH3_128bits_reset(m_state) != XXH_OK) {
+                    throw std::runtime_error("Failed initializing xxh3 state!");
+                }
+            }
+
+            ~Xxh3Hasher() override {
+                XXH3_freeState(m_state);
+            }
+
+            void update(const std::byte* data, size_t size) override {
+                XXH3_128bits_update(m_state, data, size);
+            }
+
+            std::vector<std::byte> final() override {
+                XXH128_canonical_t canonical;
+                XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(m_state));
+
+                auto digest = reinterpret_cast<const std::byte*>(canonical.digest);
+                return std::vector<std::byte>(digest, digest + sizeof(canonical.digest));
+            }
+
+        private:
+            XXH3_state_t* m_state;
+        };
+#endif
+
+#ifdef BACKER_HAVE_BLAKE3
+        class Blake3Hasher : public Hasher {
+        public:
+            Blake3Hasher() {
+                blake3_hasher_init(&m_hasher);
+            }
+
+            void update(const std::byte* data, size_t size) override {
+                blake3_hasher_update(&m_hasher, data, size);
+            }
+
+            std::vector<std::byte> final() override {
+                std::vector<std::byte> result(BLAKE3_OUT_LEN);
+                blake3_hasher_finalize(&m_hasher, reinterpret_cast<uint8_t*>(result.data()), result.size());
+                return result;
+            }
+
+        private:
+            blake3_hasher m_hasher;
+        };
+#endif
+    }
+
+    std::unique_ptr<Hasher> Hasher::create(HashAlgorithm algorithm)
+    {
+        switch (algorithm) {
+            case HashAlgorithm::Sha256:
+                return std::make_unique<Sha256Hasher>();
+            case HashAlgorithm::Xxh3_128:
+#ifdef BACKER_HAVE_XXHASH
+                return std::make_unique<Xxh3Hasher>();
+#else
+                break;
+#endif
+            case HashAlgorithm::Blake3:
+#ifdef BACKER_HAVE_BLAKE3
+                return std::make_unique<Blake3Hasher>();
+#else
+                break;
+#endif
+        }
+
+        throw std::runtime_error(katla::format("Backer was built without {} support", algorithmName(algorithm)));
+    }
+
+    bool Hasher::isAvailable(HashAlgorithm algorithm)
+    {
+        switch (algorithm) {
+            case HashAlgorithm::Sha256:
+                return true;
+            case HashAlgorithm::Xxh3_128:
+#ifdef BACKER_HAVE_XXHASH
+                return true;
+#else
+                return false;
+#endif
+            case HashAlgorithm::Blake3:
+#ifdef BACKER_HAVE_BLAKE3
+                return true;
+#else
+                return false;
+#endif
+        }
+
+        return false;
+    }
+
+    HashAlgorithm Hasher::parseAlgorithm(const std::string& name)
+    {
+        for (auto algorithm : {HashAlgorithm::Sha256, HashAlgorithm::Xxh3_128, HashAlgorithm::Blake3}) {
+            if (name == algorithmName(algorithm)) {
+                return algorithm;
+            }
+        }
+
+        throw std::runtime_error(katla::format("Unknown hash algorithm: {}, options are: sha256, xxh3-128, blake3", name));
+    }
+
+    std::string Hasher::algorithmName(HashAlgorithm algorithm)
+    {
+        switch (algorithm) {
+            case HashAlgorithm::Sha256:
+                return "sha256";
+            case HashAlgorithm::Xxh3_128:
+                return "xxh3-128";
+            case HashAlgorithm::Blake3:
+                return "blake3";
+        }
+
+        return "unknown";
+    }
+
+    size_t Hasher::digestSize(HashAlgorithm algorithm)
+    {
+        switch (algorithm) {
+            case HashAlgorithm::Sha256:
+                return 32;
+            case HashAlgorithm::Xxh3_128:
+                return 16;
+            case HashAlgorithm::Blake3:
+                return 32;
+        }
+
+        return 0;
+    }
+
+    Digest Hasher::toDigest(const std::vector<std::byte>& hash)
+    {
+        if (hash.size() > std::tuple_size<Digest>::value) {
+            throw std::runtime_error(katla::format("Hash of {} bytes does not fit a digest", hash.size()));
+        }
+
+        Digest digest {};
+        std::copy(hash.begin(), hash.end(), digest.begin());
+        return digest;
+    }
+
+    std::vector<std::byte> Hasher::fromDigest(const Digest& digest, HashAlgorithm algorithm)
+    {
+        return std::vector<std::byte>(digest.begin(), digest.begin() + digestSize(algorithm));
+    }
+
+} // namespace backer
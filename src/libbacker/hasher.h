@@ -0,0 +1,70 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HASHER_H
+#define HASHER_H
+
+#include "katla/core/core.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace backer {
+
+// Sha256 is the default. Xxh3_128 and Blake3 are much faster but only available when backer is built with
+// libxxhash or libblake3, Xxh3_128 is not cryptographic and only meant for trusted local data.
+enum class HashAlgorithm { Sha256, Xxh3_128, Blake3 };
+
+// Fixed size storage for a hash of any of the algorithms, shorter hashes are zero padded
+using Digest = std::array<std::byte, 32>;
+
+// Digests are uniformly distributed, their first bytes make a good hash already
+struct DigestHash
+{
+    size_t operator()(const Digest& digest) const {
+        size_t result;
+        std::memcpy(&result, digest.data(), sizeof(result));
+        return result;
+    }
+};
+
+class Hasher {
+public:
+    virtual ~Hasher() = default;
+
+    static std::unique_ptr<Hasher> create(HashAlgorithm algorithm);
+
+    static bool isAvailable(HashAlgorithm algorithm);
+    static HashAlgorithm parseAlgorithm(const std::string& name);
+    static std::string algorithmName(HashAlgorithm algorithm);
+    // Number of bytes in a hash of the algorithm
+    static size_t digestSize(HashAlgorithm algorithm);
+
+    static Digest toDigest(const std::vector<std::byte>& hash);
+    static std::vector<std::byte> fromDigest(const Digest& digest, HashAlgorithm algorithm);
+
+    virtual void update(const std::byte* data, size_t size) = 0;
+    virtual std::vector<std::byte> final() = 0;
+};
+
+} // namespace backer
+
+#endif
@@ -0,0 +1,472 @@
+#include "io-uring-file-hash-reader.h"
+
+#include "backer.h"
+#include "sha256-multi-buffer.h"
+#include "worker-pool.h"
+
+#ifdef BACKER_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <map>
+#include <memory>
+
+namespace backer {
+
+#ifdef BACKER_HAVE_LIBURING
+
+    namespace {
+        constexpr size_t BufferAlignment = 4096;
+        constexpr int MaxReadsPerFile = 4;
+        constexpr size_t MultiBufferBatchSize = 64;
+
+        enum class OperationType { SmallOpen, SmallRead, SmallClose, Open, Read, EndOfFile, Close };
+
+        struct Buffer
+        {
+            std::byte* data { nullptr };
+        };
+
+        struct FileState
+        {
+            size_t shardIndex { 0 };
+            size_t requestIndex { 0 };
+            uint64_t size { 0 };
+            int fd { -1 };
+            unsigned slot { 0 };
+            uint64_t nextReadOffset { 0 };
+            uint64_t nextHashOffset { 0 };
+            int readsInFlight { 0 };
+            bool failed { false };
+            bool multiBuffer { false }; // Content is hashed in a batch with other small files
+            std::byte endOfFileProbe { 0 }; // Target of the read past the expected end, which must return nothing
+            std::unique_ptr<Hasher> hasher;
+            std::map<uint64_t, std::pair<Buffer*, size_t>> completedReads; // Out of order completions by offset
+        };
+
+        struct Operation
+        {
+            OperationType type;
+            FileState* file { nullptr };
+            Buffer* buffer { nullptr };
+            uint64_t offset { 0 };
+            unsigned length { 0 };
+        };
+
+        struct FreeDeleter
+        {
+            void operator()(std::byte* data) const {
+                std::free(data);
+            }
+        };
+    }
+
+    IoUringFileHashReader::IoUringFileHashReader(int jobs, IoOptions options, HashAlgorithm algorithm) :
+        m_jobs(jobs),
+        m_options(options),
+        m_algorithm(algorithm)
+    {
+        m_options.bufferSize = std::max(BufferAlignment, (m_options.bufferSize + BufferAlignment - 1) / BufferAlignment * BufferAlignment);
+        m_options.queueDepth = std::max(4u, m_options.queueDepth);
+    }
+
+    bool IoUringFileHashReader::isSupported()
+    {
+        static const bool supported = []() {
+            io_uring ring;
+            if (io_uring_queue_init(4, &ring, 0) != 0) {
+                return false;
+            }
+            io_uring_queue_exit(&ring);
+            return true;
+        }();
+
+        return supported;
+    }
+
+    std::vector<std::vector<std::byte>> IoUringFileHashReader::hash(const std::vector<FileHashRequest>& requests,
+                                                                    const ProgressFunction& progress)
+    {
+        std::vector<std::vector<std::byte>> result(requests.size());
+        std::vector<char> failed(requests.size(), false);
+
+        // Every thread drives its own ring, so hashing is spread over the threads as well
+        WorkerPool workerPool(m_jobs);
+        size_t nrOfShards = std::max<size_t>(1, std::min<size_t>(workerPool.nrOfThreads(), requests.size()));
+
+        std::vector<std::vector<size_t>> shards(nrOfShards);
+        for (size_t i = 0; i < requests.size(); i++) {
+            shards[i % nrOfShards].push_back(i);
+        }
+
+        workerPool.forEach(nrOfShards, [&](size_t shardIndex) {
+            hashShard(requests, shards[shardIndex], result, failed, progress);
+        });
+
+        // Files that changed while being read, or that could not be read through the ring, are hashed again with
+        // blocking reads which also report the actual error
+        for (size_t i = 0; i < requests.size(); i++) {
+            if (failed[i]) {
+                result[i] = Backer::hashFile(requests[i].path, m_algorithm, m_options.bufferSize);
+                if (progress) {
+                    progress(i, result[i]);
+                }
+            }
+        }
+
+        return result;
+    }
+
+    void IoUringFileHashReader::hashShard(const std::vector<FileHashRequest>& requests,
+                                          const std::vector<size_t>& shard,
+                                          std::vector<std::vector<std::byte>>& result,
+                                          std::vector<char>& failed,
+                                          const ProgressFunction& progress)
+    {
+        const unsigned queueDepth = m_options.queueDepth;
+        const size_t bufferSize = m_options.bufferSize;
+
+        io_uring ring;
+        int initResult = io_uring_queue_init(queueDepth * 4, &ring, 0);
+        if (initResult != 0) {
+            throw std::runtime_error(katla::format("Failed creating io_uring: {}", std::strerror(-initResult)));
+        }
+
+        std::unique_ptr<io_uring, void (*)(io_uring*)> ringGuard(&ring, io_uring_queue_exit);
+
+        // Small files are opened into a fixed file slot so open, read and close can be linked
+        std::vector<unsigned> freeSlots;
+        if (io_uring_register_files_sparse(&ring, queueDepth) == 0) {
+            for (unsigned slot = 0; slot < queueDepth; slot++) {
+                freeSlots.push_back(slot);
+            }
+        }
+        const bool linkedSmallFiles = !freeSlots.empty();
+
+        // Small files are read with a single read one byte larger than the file, so growth shows up as a long read
+        auto isSmallFile = [&](uint64_t size) {
+            return linkedSmallFiles && size < bufferSize;
+        };
+
+        auto bufferData = std::unique_ptr<std::byte, FreeDeleter>(
+            static_cast<std::byte*>(std::aligned_alloc(BufferAlignment, bufferSize * queueDepth)));
+        if (!bufferData) {
+            throw std::bad_alloc();
+        }
+
+        std::vector<Buffer> buffers(queueDepth);
+        std::vector<Buffer*> freeBuffers;
+        for (unsigned i = 0; i < queueDepth; i++) {
+            buffers[i].data = bufferData.get() + i * bufferSize;
+            freeBuffers.push_back(&buffers[i]);
+        }
+
+        // A file state lives until the last completion of the file arrived
+        std::vector<std::unique_ptr<FileState>> files(shard.size());
+        std::vector<FileState*> openFiles;
+
+        // Bounded by the completion queue, every operation produces exactly one completion
+        const unsigned maxPendingCompletions = queueDepth * 4;
+        unsigned pendingCompletions = 0;
+
+        auto getSqe = [&]() {
+            io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+            if (!sqe) {
+                io_uring_submit(&ring);
+                sqe = io_uring_get_sqe(&ring);
+            }
+            if (!sqe) {
+                throw std::runtime_error("io_uring submission queue is full");
+            }
+            pendingCompletions++;
+            return sqe;
+        };
+
+        auto releaseFile = [&](FileState& file) {
+            files[file.shardIndex].reset();
+        };
+
+        // Small files waiting to be hashed together, their content is copied so the buffers can be reused
+        std::vector<size_t> batchRequests;
+        std::vector<std::vector<std::byte>> batchContents;
+
+        auto flushBatch = [&]() {
+            std::vector<gsl::span<const std::byte>> messages;
+            for (auto& content : batchContents) {
+                messages.push_back(gsl::span<const std::byte>(content.data(), content.size()));
+            }
+
+            auto hashes = Sha256MultiBuffer::hash(messages);
+            for (size_t i = 0; i < batchRequests.size(); i++) {
+                result[batchRequests[i]] = std::move(hashes[i]);
+                if (progress) {
+                    progress(batchRequests[i], result[batchRequests[i]]);
+                }
+            }
+
+            batchRequests.clear();
+            batchContents.clear();
+        };
+
+        auto finishFile = [&](FileState& file) {
+            if (file.failed) {
+                failed[file.requestIndex] = true;
+                return;
+            }
+
+            // Reported once its batch is hashed
+            if (file.multiBuffer) {
+                return;
+            }
+
+            result[file.requestIndex] = file.hasher->final();
+            if (progress) {
+                progress(file.requestIndex, result[file.requestIndex]);
+            }
+        };
+
+        auto closeFile = [&](FileState& file) {
+            auto operation = new Operation {OperationType::Close, &file};
+            io_uring_sqe* sqe = getSqe();
+            io_uring_prep_close(sqe, file.fd);
+            io_uring_sqe_set_data(sqe, operation);
+
+            openFiles.erase(std::find(openFiles.begin(), openFiles.end(), &file));
+            finishFile(file);
+        };
+
+        auto submitReads = [&](FileState& file) {
+            while (!file.failed &&
+                   file.nextReadOffset < file.size &&
+                   file.readsInFlight < MaxReadsPerFile &&
+                   !freeBuffers.empty() &&
+                   pendingCompletions < maxPendingCompletions) {
+                auto buffer = freeBuffers.back();
+                freeBuffers.pop_back();
+
+                auto length = static_cast<unsigned>(std::min<uint64_t>(bufferSize, file.size - file.nextReadOffset));
+                auto operation = new Operation {OperationType::Read, &file, buffer, file.nextReadOffset, length};
+
+                io_uring_sqe* sqe = getSqe();
+                io_uring_prep_read(sqe, file.fd, buffer->data, length, file.nextReadOffset);
+                io_uring_sqe_set_data(sqe, operation);
+
+                file.nextReadOffset += length;
+                file.readsInFlight++;
+            }
+        };
+
+        // The file may have grown since it was scanned, only a read past the end tells
+        auto probeEndOfFile = [&](FileState& file) {
+            io_uring_sqe* sqe = getSqe();
+            io_uring_prep_read(sqe, file.fd, &file.endOfFileProbe, 1, file.size);
+            io_uring_sqe_set_data(sqe, new Operation {OperationType::EndOfFile, &file});
+        };
+
+        auto startFile = [&](size_t shardIndex) {
+            auto& request = requests[shard[shardIndex]];
+
+            files[shardIndex] = std::make_unique<FileState>();
+            auto& file = *files[shardIndex];
+            file.shardIndex = shardIndex;
+            file.requestIndex = shard[shardIndex];
+            file.size = request.size;
+            file.multiBuffer = isSmallFile(file.size) && file.size > 0 && useMultiBuffer(m_options, m_algorithm, file.size);
+            if (!file.multiBuffer) {
+                file.hasher = Hasher::create(m_algorithm);
+            }
+
+            // Empty files are read like any other, so a file that grew or is gone since the scan is noticed
+            if (isSmallFile(file.size)) {
+                auto buffer = freeBuffers.back();
+                freeBuffers.pop_back();
+                file.slot = freeSlots.back();
+                freeSlots.pop_back();
+
+                // A failed open cancels the read and close, a short read still closes the file. Direct descriptors
+                // never enter the file table, the kernel rejects O_CLOEXEC for them.
+                io_uring_sqe* sqe = getSqe();
+                io_uring_prep_openat_direct(sqe, AT_FDCWD, request.path.c_str(), O_RDONLY, 0, file.slot);
+                io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+                io_uring_sqe_set_data(sqe, new Operation {OperationType::SmallOpen, &file});
+
+                sqe = getSqe();
+                io_uring_prep_read(sqe, static_cast<int>(file.slot), buffer->data, static_cast<unsigned>(file.size) + 1, 0);
+                io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK);
+                io_uring_sqe_set_data(sqe, new Operation {OperationType::SmallRead, &file, buffer, 0, static_cast<unsigned>(file.size)});
+
+                sqe = getSqe();
+                io_uring_prep_close_direct(sqe, file.slot);
+                io_uring_sqe_set_data(sqe, new Operation {OperationType::SmallClose, &file});
+                return;
+            }
+
+            io_uring_sqe* sqe = getSqe();
+            io_uring_prep_openat(sqe, AT_FDCWD, request.path.c_str(), O_RDONLY | O_CLOEXEC, 0);
+            io_uring_sqe_set_data(sqe, new Operation {OperationType::Open, &file});
+        };
+
+        auto handleCompletion = [&](Operation* operation, int res) {
+            auto& file = *operation->file;
+
+            switch (operation->type) {
+                case OperationType::SmallOpen:
+                    if (res < 0) {
+                        file.failed = true;
+                    }
+                    break;
+                case OperationType::SmallRead:
+                    if (res >= 0 && static_cast<unsigned>(res) == operation->length) {
+                        if (file.multiBuffer) {
+                            batchRequests.push_back(file.requestIndex);
+                            batchContents.emplace_back(operation->buffer->data, operation->buffer->data + res);
+                        } else {
+                            file.hasher->update(operation->buffer->data, res);
+                        }
+                    } else {
+                        file.failed = true;
+                    }
+                    freeBuffers.push_back(operation->buffer);
+                    break;
+                case OperationType::SmallClose:
+                    freeSlots.push_back(file.slot);
+                    finishFile(file);
+                    releaseFile(file);
+                    break;
+                case OperationType::Open:
+                    if (res < 0) {
+                        file.failed = true;
+                        finishFile(file);
+                        releaseFile(file);
+                        break;
+                    }
+                    file.fd = res;
+                    openFiles.push_back(&file);
+                    if (file.size == 0) {
+                        probeEndOfFile(file);
+                    }
+                    break;
+                case OperationType::Read:
+                    file.readsInFlight--;
+                    if (res < 0 || static_cast<unsigned>(res) != operation->length) {
+                        // The file shrunk or could not be read
+                        file.failed = true;
+                        freeBuffers.push_back(operation->buffer);
+                    } else {
+                        file.completedReads[operation->offset] = {operation->buffer, static_cast<size_t>(res)};
+                    }
+
+                    // Hash completed reads in file order
+                    while (!file.completedReads.empty() && file.completedReads.begin()->first == file.nextHashOffset) {
+                        auto completedRead = file.completedReads.begin()->second;
+                        file.hasher->update(completedRead.first->data, completedRead.second);
+                        file.nextHashOffset += completedRead.second;
+                        freeBuffers.push_back(completedRead.first);
+                        file.completedReads.erase(file.completedReads.begin());
+                    }
+
+                    if (file.readsInFlight == 0 && file.failed) {
+                        for (auto& pair : file.completedReads) {
+                            freeBuffers.push_back(pair.second.first);
+                        }
+                        file.completedReads.clear();
+                        closeFile(file);
+                    } else if (file.readsInFlight == 0 && file.nextHashOffset == file.size) {
+                        probeEndOfFile(file);
+                    }
+                    break;
+                case OperationType::EndOfFile:
+                    if (res != 0) {
+                        file.failed = true;
+                    }
+                    closeFile(file);
+                    break;
+                case OperationType::Close:
+                    releaseFile(file);
+                    break;
+            }
+
+            delete operation;
+        };
+
+        size_t nextRequest = 0;
+        while (nextRequest < shard.size() || pendingCompletions > 0 || !openFiles.empty()) {
+            for (auto file : std::vector<FileState*>(openFiles)) {
+                submitReads(*file);
+            }
+
+            // Keep room for the reads of files that are already open
+            while (nextRequest < shard.size() &&
+                   freeBuffers.size() > openFiles.size() &&
+                   pendingCompletions + 3 <= maxPendingCompletions) {
+                if (isSmallFile(requests[shard[nextRequest]].size) && freeSlots.empty()) {
+                    break;
+                }
+                startFile(nextRequest++);
+            }
+
+            if (pendingCompletions == 0) {
+                continue;
+            }
+
+            int submitResult = io_uring_submit_and_wait(&ring, 1);
+            if (submitResult < 0 && submitResult != -EINTR) {
+                throw std::runtime_error(katla::format("Failed submitting to io_uring: {}", std::strerror(-submitResult)));
+            }
+
+            io_uring_cqe* cqe = nullptr;
+            while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+                auto operation = static_cast<Operation*>(io_uring_cqe_get_data(cqe));
+                int res = cqe->res;
+                io_uring_cqe_seen(&ring, cqe);
+                pendingCompletions--;
+
+                handleCompletion(operation, res);
+            }
+
+            if (batchRequests.size() >= MultiBufferBatchSize) {
+                flushBatch();
+            }
+        }
+
+        flushBatch();
+    }
+
+#else
+
+    IoUringFileHashReader::IoUringFileHashReader(int jobs, IoOptions options, HashAlgorithm algorithm) :
+        m_jobs(jobs),
+        m_options(options),
+        m_algorithm(algorithm)
+    {
+    }
+
+    bool IoUringFileHashReader::isSupported()
+    {
+        return false;
+    }
+
+    std::vector<std::vector<std::byte>> IoUringFileHashReader::hash(const std::vector<FileHashRequest>& requests,
+                                                                    const ProgressFunction& progress)
+    {
+        throw std::runtime_error("Backer was built without io_uring support");
+    }
+
+    void IoUringFileHashReader::hashShard(const std::vector<FileHashRequest>& requests,
+                                          const std::vector<size_t>& shard,
+                                          std::vector<std::vector<std::byte>>& result,
+                                          std::vector<char>& failed,
+                                          const ProgressFunction& progress)
+    {
+    }
+
+#endif
+
+} // namespace backer
@@ -0,0 +1,55 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef IO_URING_FILE_HASH_READER_H
+#define IO_URING_FILE_HASH_READER_H
+
+#include "file-hash-reader.h"
+
+namespace backer {
+
+// Keeps up to queueDepth reads in flight per hashing thread. Small files are opened, read and closed with a
+// single chain of linked requests, large files get several reads in flight which are hashed in order.
+// Only available when built with liburing.
+class IoUringFileHashReader : public FileHashReader {
+public:
+    IoUringFileHashReader(int jobs, IoOptions options, HashAlgorithm algorithm);
+
+    // Whether liburing was available at build time and the kernel allows creating a ring
+    static bool isSupported();
+
+    std::string name() const override {
+        return "io_uring";
+    }
+
+    std::vector<std::vector<std::byte>> hash(const std::vector<FileHashRequest>& requests,
+                                             const ProgressFunction& progress = {}) override;
+
+private:
+    void hashShard(const std::vector<FileHashRequest>& requests,
+                   const std::vector<size_t>& shard,
+                   std::vector<std::vector<std::byte>>& result,
+                   std::vector<char>& failed,
+                   const ProgressFunction& progress);
+
+    int m_jobs;
+    IoOptions m_options;
+    HashAlgorithm m_algorithm;
+};
+
+} // namespace backer
+
+#endif
@@ -0,0 +1,111 @@
+#include "per-device-file-hash-reader.h"
+
+#include "read-scheduler.h"
+#include "worker-pool.h"
+
+#include <sys/sysmacros.h>
+
+#include <algorithm>
+#include <exception>
+#include <thread>
+#include <utility>
+
+namespace backer {
+
+    PerDeviceFileHashReader::PerDeviceFileHashReader(int jobs, IoOptions options, HashAlgorithm algorithm) :
+        m_jobs(jobs > 0 ? jobs : WorkerPool::defaultNrOfThreads()),
+        m_options(options),
+        m_algorithm(algorithm),
+        m_name(backendName(options))
+    {
+    }
+
+    int PerDeviceFileHashReader::jobs(uint64_t device)
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+
+        auto findIt = m_deviceJobs.find(device);
+        if (findIt != m_deviceJobs.end()) {
+            return findIt->second;
+        }
+
+        bool rotational = ReadScheduler::isRotationalDevice(device);
+        int jobs = rotational ? std::min(m_jobs, std::max(1, m_options.rotationalJobs)) : m_jobs;
+        if (device != 0) {
+            katla::printInfo("Reading device {}:{}{} with {} threads",
+                             major(device), minor(device), rotational ? " (rotational)" : "", jobs);
+        }
+
+        m_deviceJobs[device] = jobs;
+        return jobs;
+    }
+
+    FileHashReader& PerDeviceFileHashReader::reader(uint64_t device)
+    {
+        int deviceJobs = jobs(device);
+
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto& reader = m_readers[device];
+        if (!reader) {
+            reader = createBackend(deviceJobs, m_options, m_algorithm);
+        }
+        return *reader;
+    }
+
+    std::vector<std::vector<std::byte>> PerDeviceFileHashReader::hash(const std::vector<FileHashRequest>& requests,
+                                                                      const ProgressFunction& progress)
+    {
+        std::map<uint64_t, std::vector<size_t>> devices;
+        for (size_t i = 0; i < requests.size(); i++) {
+            devices[requests[i].device].push_back(i);
+        }
+
+        if (devices.size() <= 1) {
+            return reader(devices.empty() ? 0 : devices.begin()->first).hash(requests, progress);
+        }
+
+        std::vector<std::vector<std::byte>> result(requests.size());
+        std::vector<std::exception_ptr> errors(devices.size());
+        std::vector<std::thread> threads;
+
+        size_t deviceIndex = 0;
+        for (auto& [device, indices] : devices) {
+            auto& deviceReader = reader(device);
+            threads.emplace_back([&, &indices = indices, &error = errors[deviceIndex]]() {
+                try {
+                    std::vector<FileHashRequest> deviceRequests;
+                    deviceRequests.reserve(indices.size());
+                    for (auto i : indices) {
+                        deviceRequests.push_back(requests[i]);
+                    }
+
+                    auto hashes = deviceReader.hash(deviceRequests, [&](size_t i, const std::vector<std::byte>& hash) {
+                        if (progress) {
+                            progress(indices[i], hash);
+                        }
+                    });
+
+                    for (size_t i = 0; i < indices.size(); i++) {
+                        result[indices[i]] = std::move(hashes[i]);
+                    }
+                } catch (...) {
+                    error = std::current_exception();
+                }
+            });
+            deviceIndex++;
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        for (auto& error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        return result;
+    }
+
+} // namespace backer
@@ -0,0 +1,61 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PER_DEVICE_FILE_HASH_READER_H
+#define PER_DEVICE_FILE_HASH_READER_H
+
+#include "file-hash-reader.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace backer {
+
+// Splits the requests by the device the files are on and reads all devices at the same time, each with a reader
+// of its own. Spinning disks get IoOptions::rotationalJobs threads so they don't seek between files all the time,
+// other devices get all jobs.
+class PerDeviceFileHashReader : public FileHashReader {
+public:
+    PerDeviceFileHashReader(int jobs, IoOptions options, HashAlgorithm algorithm);
+
+    std::string name() const override {
+        return m_name;
+    }
+
+    std::vector<std::vector<std::byte>> hash(const std::vector<FileHashRequest>& requests,
+                                             const ProgressFunction& progress = {}) override;
+
+    // Number of hashing threads used for files on the device
+    int jobs(uint64_t device);
+
+private:
+    FileHashReader& reader(uint64_t device);
+
+    int m_jobs;
+    IoOptions m_options;
+    HashAlgorithm m_algorithm;
+    std::string m_name;
+
+    std::mutex m_mutex;
+    std::map<uint64_t, int> m_deviceJobs;
+    std::map<uint64_t, std::unique_ptr<FileHashReader>> m_readers;
+};
+
+} // namespace backer
+
+#endif
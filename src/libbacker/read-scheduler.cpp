@@ -0,0 +1,132 @@
+#include "read-scheduler.h"
+
+#include "worker-pool.h"
+
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <numeric>
+#include <tuple>
+
+namespace backer {
+
+    namespace fs = std::filesystem;
+
+    ReadOrder ReadScheduler::parseOrder(const std::string& order)
+    {
+        if (order == "auto") {
+            return ReadOrder::Auto;
+        }
+        if (order == "scan") {
+            return ReadOrder::Scan;
+        }
+        if (order == "inode") {
+            return ReadOrder::Inode;
+        }
+        if (order == "extent") {
+            return ReadOrder::Extent;
+        }
+
+        throw std::runtime_error(katla::format("Unknown read order: {}, options are: auto, scan, inode, extent", order));
+    }
+
+    bool ReadScheduler::isRotationalDevice(uint64_t deviceNumber)
+    {
+        // A partition has no queue of its own, it uses the one of the disk it is on
+        fs::path device = katla::format("/sys/dev/block/{}:{}", major(deviceNumber), minor(deviceNumber));
+        std::error_code error;
+        if (fs::exists(device / "partition", error)) {
+            device /= "..";
+        }
+
+        std::ifstream rotational(device / "queue" / "rotational");
+        char value = '0';
+        return (rotational >> value) && value == '1';
+    }
+
+    std::optional<uint64_t> ReadScheduler::physicalOffset(const std::string& path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return std::nullopt;
+        }
+
+        // Only the first extent is asked for, without syncing delayed allocations
+        alignas(struct fiemap) char buffer[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] {};
+        auto map = reinterpret_cast<struct fiemap*>(buffer);
+        map->fm_start = 0;
+        map->fm_length = FIEMAP_MAX_OFFSET;
+        map->fm_extent_count = 1;
+
+        int result = ::ioctl(fd, FS_IOC_FIEMAP, map);
+        ::close(fd);
+
+        if (result != 0 || map->fm_mapped_extents == 0) {
+            return std::nullopt;
+        }
+
+        return map->fm_extents[0].fe_physical;
+    }
+
+    std::vector<size_t> ReadScheduler::schedule(ReadOrder order,
+                                                int jobs,
+                                                const std::vector<InodeId>& inodes,
+                                                const std::function<std::string(size_t)>& path)
+    {
+        std::vector<size_t> result(inodes.size());
+        std::iota(result.begin(), result.end(), 0);
+
+        if (order == ReadOrder::Scan) {
+            return result;
+        }
+
+        std::map<uint64_t, ReadOrder> deviceOrders;
+        for (auto& inode : inodes) {
+            auto& deviceOrder = deviceOrders[inode.device];
+            if (deviceOrder == ReadOrder::Auto) {
+                deviceOrder = (order != ReadOrder::Auto) ? order : isRotationalDevice(inode.device) ? ReadOrder::Extent : ReadOrder::Scan;
+            }
+        }
+
+        // The key a file is sorted by within its device. Inodes are stored in tables ordered by their number, so the
+        // extent lookups read those in order as well.
+        std::vector<uint64_t> keys(inodes.size(), 0);
+        for (size_t i = 0; i < inodes.size(); i++) {
+            keys[i] = (deviceOrders.at(inodes[i].device) == ReadOrder::Scan) ? i : inodes[i].inode;
+        }
+
+        auto sortByKey = [&]() {
+            std::stable_sort(result.begin(), result.end(), [&](size_t left, size_t right) {
+                return std::make_tuple(inodes[left].device, keys[left]) < std::make_tuple(inodes[right].device, keys[right]);
+            });
+        };
+        sortByKey();
+
+        bool anyExtentOrder = std::any_of(deviceOrders.begin(), deviceOrders.end(), [](auto& deviceOrder) {
+            return deviceOrder.second == ReadOrder::Extent;
+        });
+        if (!anyExtentOrder) {
+            return result;
+        }
+
+        WorkerPool(jobs).forEach(result.size(), [&](size_t i) {
+            auto file = result[i];
+            if (deviceOrders.at(inodes[file].device) == ReadOrder::Extent) {
+                keys[file] = physicalOffset(path(file)).value_or(0);
+            }
+        });
+
+        // Offsets of different devices can't be compared, files are still grouped by device
+        sortByKey();
+        return result;
+    }
+
+} // namespace backer
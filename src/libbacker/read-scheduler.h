@@ -0,0 +1,57 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef READ_SCHEDULER_H
+#define READ_SCHEDULER_H
+
+#include "katla/core/core.h"
+
+#include "file-data.h"
+#include "file-hash-reader.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace backer {
+
+// Orders files by where they are stored before they are read. On a spinning disk reading in scan order seeks
+// between every small file, reading by inode or by the physical offset of the first extent mostly moves forward.
+class ReadScheduler {
+public:
+    static ReadOrder parseOrder(const std::string& order);
+
+    // Whether the block device reports itself as rotational, false when it can't be found
+    static bool isRotationalDevice(uint64_t device);
+
+    // Physical offset of the first extent of a file, empty for files without extents or without FIEMAP support
+    static std::optional<uint64_t> physicalOffset(const std::string& path);
+
+    // Returns the positions of the files in the order they should be read, grouped by device. Auto uses Extent for
+    // files on rotational disks and Scan for the others. The physical offsets of the Extent order are looked up by
+    // jobs threads, files without them are read first.
+    static std::vector<size_t> schedule(ReadOrder order,
+                                        int jobs,
+                                        const std::vector<InodeId>& inodes,
+                                        const std::function<std::string(size_t)>& path);
+};
+
+} // namespace backer
+
+#endif
@@ -0,0 +1,308 @@
+#include "sha256-multi-buffer.h"
+
+#include <openssl/sha.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define BACKER_HAVE_X86_SIMD
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+namespace backer {
+
+    namespace {
+        constexpr uint32_t InitialState[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+
+        constexpr uint32_t RoundConstants[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+
+        constexpr size_t Lanes = 8;
+        constexpr size_t BlockSize = 64;
+
+        // Message with the sha256 padding appended, so every lane can simply process whole blocks
+        struct PaddedMessage
+        {
+            std::vector<uint8_t> data;
+            size_t nrOfBlocks { 0 };
+        };
+
+        PaddedMessage pad(gsl::span<const std::byte> message)
+        {
+            PaddedMessage result;
+            result.nrOfBlocks = (message.size() + 9 + BlockSize - 1) / BlockSize;
+            result.data.resize(result.nrOfBlocks * BlockSize, 0);
+
+            std::memcpy(result.data.data(), message.data(), message.size());
+            result.data[message.size()] = 0x80;
+
+            uint64_t bitLength = static_cast<uint64_t>(message.size()) * 8;
+            for (int i = 0; i < 8; i++) {
+                result.data[result.data.size() - 1 - i] = static_cast<uint8_t>(bitLength >> (8 * i));
+            }
+
+            return result;
+        }
+
+        std::vector<std::byte> hashOpenSsl(gsl::span<const std::byte> message)
+        {
+            std::vector<std::byte> result(SHA256_DIGEST_LENGTH);
+            SHA256(reinterpret_cast<const unsigned char*>(message.data()),
+                   message.size(),
+                   reinterpret_cast<unsigned char*>(result.data()));
+            return result;
+        }
+
+#ifdef BACKER_HAVE_X86_SIMD
+        __attribute__((target("avx2"))) inline __m256i rotr(__m256i x, int n)
+        {
+            return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+        }
+
+        // Runs one compression per lane, block[i] points to the block of lane i
+        __attribute__((target("avx2"))) void compressAvx2(__m256i state[8], const uint8_t* const block[Lanes])
+        {
+            const __m256i byteSwap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                                     12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+            __m256i w[64];
+
+            // Transpose the blocks so that w[t] holds word t of every lane
+            for (int t = 0; t < 16; t += 8) {
+                __m256i rows[Lanes];
+                for (size_t lane = 0; lane < Lanes; lane++) {
+                    rows[lane] = _mm256_shuffle_epi8(
+                        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block[lane] + t * 4)), byteSwap);
+                }
+
+                __m256i t0 = _mm256_unpacklo_epi32(rows[0], rows[1]);
+                __m256i t1 = _mm256_unpackhi_epi32(rows[0], rows[1]);
+                __m256i t2 = _mm256_unpacklo_epi32(rows[2], rows[3]);
+                __m256i t3 = _mm256_unpackhi_epi32(rows[2], rows[3]);
+                __m256i t4 = _mm256_unpacklo_epi32(rows[4], rows[5]);
+                __m256i t5 = _mm256_unpackhi_epi32(rows[4], rows[5]);
+                __m256i t6 = _mm256_unpacklo_epi32(rows[6], rows[7]);
+                __m256i t7 = _mm256_unpackhi_epi32(rows[6], rows[7]);
+
+                __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+                __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+                __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+                __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+                __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+                __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+                __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+                __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+                w[t + 0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+                w[t + 1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+                w[t + 2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+                w[t + 3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+                w[t + 4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+                w[t + 5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+                w[t + 6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+                w[t + 7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+            }
+
+            for (int t = 16; t < 64; t++) {
+                __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr(w[t - 15], 7), rotr(w[t - 15], 18)), _mm256_srli_epi32(w[t - 15], 3));
+                __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr(w[t - 2], 17), rotr(w[t - 2], 19)), _mm256_srli_epi32(w[t - 2], 10));
+                w[t] = _mm256_add_epi32(_mm256_add_epi32(w[t - 16], s0), _mm256_add_epi32(w[t - 7], s1));
+            }
+
+            __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+            __m256i e = state[4], f = state[5], g = state[6], h = state[7];
+
+            for (int t = 0; t < 64; t++) {
+                __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr(e, 6), rotr(e, 11)), rotr(e, 25));
+                __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+                __m256i temp1 = _mm256_add_epi32(_mm256_add_epi32(h, s1),
+                                                 _mm256_add_epi32(_mm256_add_epi32(ch, _mm256_set1_epi32(static_cast<int>(RoundConstants[t]))), w[t]));
+                __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr(a, 2), rotr(a, 13)), rotr(a, 22));
+                __m256i maj = _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(a, c)), _mm256_and_si256(b, c));
+                __m256i temp2 = _mm256_add_epi32(s0, maj);
+
+                h = g;
+                g = f;
+                f = e;
+                e = _mm256_add_epi32(d, temp1);
+                d = c;
+                c = b;
+                b = a;
+                a = _mm256_add_epi32(temp1, temp2);
+            }
+
+            state[0] = _mm256_add_epi32(state[0], a);
+            state[1] = _mm256_add_epi32(state[1], b);
+            state[2] = _mm256_add_epi32(state[2], c);
+            state[3] = _mm256_add_epi32(state[3], d);
+            state[4] = _mm256_add_epi32(state[4], e);
+            state[5] = _mm256_add_epi32(state[5], f);
+            state[6] = _mm256_add_epi32(state[6], g);
+            state[7] = _mm256_add_epi32(state[7], h);
+        }
+
+        __attribute__((target("avx2"))) std::vector<std::byte> extractDigest(const __m256i state[8], size_t lane)
+        {
+            std::vector<std::byte> result(SHA256_DIGEST_LENGTH);
+            for (int i = 0; i < 8; i++) {
+                alignas(32) uint32_t words[Lanes];
+                _mm256_store_si256(reinterpret_cast<__m256i*>(words), state[i]);
+
+                uint32_t word = words[lane];
+                result[i * 4 + 0] = static_cast<std::byte>(word >> 24);
+                result[i * 4 + 1] = static_cast<std::byte>(word >> 16);
+                result[i * 4 + 2] = static_cast<std::byte>(word >> 8);
+                result[i * 4 + 3] = static_cast<std::byte>(word);
+            }
+            return result;
+        }
+
+        // Hashes up to eight messages, idle lanes process a dummy block and are ignored
+        __attribute__((target("avx2"))) void hashLanesAvx2(const std::vector<const PaddedMessage*>& messages,
+                                                           std::vector<std::vector<std::byte>*>& results)
+        {
+            static const uint8_t dummyBlock[BlockSize] = {};
+
+            __m256i state[8];
+            for (int i = 0; i < 8; i++) {
+                state[i] = _mm256_set1_epi32(static_cast<int>(InitialState[i]));
+            }
+
+            size_t maxBlocks = 0;
+            for (auto message : messages) {
+                maxBlocks = std::max(maxBlocks, message->nrOfBlocks);
+            }
+
+            for (size_t blockIndex = 0; blockIndex < maxBlocks; blockIndex++) {
+                const uint8_t* block[Lanes];
+                for (size_t lane = 0; lane < Lanes; lane++) {
+                    bool active = lane < messages.size() && blockIndex < messages[lane]->nrOfBlocks;
+                    block[lane] = active ? messages[lane]->data.data() + blockIndex * BlockSize : dummyBlock;
+                }
+
+                compressAvx2(state, block);
+
+                // A lane that just processed its last block has its final digest
+                for (size_t lane = 0; lane < messages.size(); lane++) {
+                    if (messages[lane]->nrOfBlocks == blockIndex + 1) {
+                        *results[lane] = extractDigest(state, lane);
+                    }
+                }
+            }
+        }
+
+        std::vector<std::vector<std::byte>> hashAvx2(const std::vector<gsl::span<const std::byte>>& messages)
+        {
+            std::vector<PaddedMessage> paddedMessages;
+            paddedMessages.reserve(messages.size());
+            for (auto& message : messages) {
+                paddedMessages.push_back(pad(message));
+            }
+
+            // Messages of a similar length share lanes, so few lanes sit idle
+            std::vector<size_t> order(messages.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::stable_sort(order.begin(), order.end(), [&](size_t left, size_t right) {
+                return paddedMessages[left].nrOfBlocks < paddedMessages[right].nrOfBlocks;
+            });
+
+            std::vector<std::vector<std::byte>> result(messages.size());
+            for (size_t i = 0; i < order.size(); i += Lanes) {
+                std::vector<const PaddedMessage*> laneMessages;
+                std::vector<std::vector<std::byte>*> laneResults;
+                for (size_t lane = 0; lane < Lanes && i + lane < order.size(); lane++) {
+                    laneMessages.push_back(&paddedMessages[order[i + lane]]);
+                    laneResults.push_back(&result[order[i + lane]]);
+                }
+
+                hashLanesAvx2(laneMessages, laneResults);
+            }
+
+            return result;
+        }
+#endif
+    }
+
+    Sha256MultiBuffer::Implementation Sha256MultiBuffer::defaultImplementation()
+    {
+#ifdef BACKER_HAVE_X86_SIMD
+        // A single stream through the SHA extensions outruns eight AVX2 lanes
+        static const bool hasShaExtensions = []() {
+            unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+            return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA);
+        }();
+        if (isAvailable(Implementation::Avx2) && !hasShaExtensions) {
+            return Implementation::Avx2;
+        }
+#endif
+        return Implementation::OpenSsl;
+    }
+
+    bool Sha256MultiBuffer::isAvailable(Implementation implementation)
+    {
+        switch (implementation) {
+            case Implementation::OpenSsl:
+                return true;
+            case Implementation::Avx2: {
+#ifdef BACKER_HAVE_X86_SIMD
+                static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+                return hasAvx2;
+#else
+                return false;
+#endif
+            }
+        }
+
+        return false;
+    }
+
+    std::string Sha256MultiBuffer::implementationName(Implementation implementation)
+    {
+        switch (implementation) {
+            case Implementation::OpenSsl:
+                return "openssl";
+            case Implementation::Avx2:
+                return "avx2";
+        }
+
+        return "unknown";
+    }
+
+    std::vector<std::vector<std::byte>> Sha256MultiBuffer::hash(const std::vector<gsl::span<const std::byte>>& messages)
+    {
+        return hash(messages, defaultImplementation());
+    }
+
+    std::vector<std::vector<std::byte>> Sha256MultiBuffer::hash(const std::vector<gsl::span<const std::byte>>& messages,
+                                                                Implementation implementation)
+    {
+#ifdef BACKER_HAVE_X86_SIMD
+        // A single message gains nothing from the lanes
+        if (implementation == Implementation::Avx2 && messages.size() > 1 && isAvailable(Implementation::Avx2)) {
+            return hashAvx2(messages);
+        }
+#endif
+
+        std::vector<std::vector<std::byte>> result;
+        result.reserve(messages.size());
+        for (auto& message : messages) {
+            result.push_back(hashOpenSsl(message));
+        }
+
+        return result;
+    }
+
+} // namespace backer
@@ -0,0 +1,49 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SHA256_MULTI_BUFFER_H
+#define SHA256_MULTI_BUFFER_H
+
+#include "katla/core/core.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace backer {
+
+// Hashes many independent small messages at once, eight messages at a time in AVX2 lanes. On CPUs with the SHA
+// extensions OpenSSL hashes a single message faster than the lanes can, so every message is hashed on its own there.
+class Sha256MultiBuffer {
+public:
+    enum class Implementation { OpenSsl, Avx2 };
+
+    static Implementation defaultImplementation();
+    // Whether backer was built with the implementation and the CPU runs it
+    static bool isAvailable(Implementation implementation);
+    static std::string implementationName(Implementation implementation);
+
+    // Returns one sha256 digest per message, in message order. An implementation that is not available falls back
+    // to OpenSSL.
+    static std::vector<std::vector<std::byte>> hash(const std::vector<gsl::span<const std::byte>>& messages);
+    static std::vector<std::vector<std::byte>> hash(const std::vector<gsl::span<const std::byte>>& messages,
+                                                    Implementation implementation);
+};
+
+} // namespace backer
+
+#endif
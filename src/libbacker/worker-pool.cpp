@@ -0,0 +1,73 @@
+#include "worker-pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace backer {
+
+    WorkerPool::WorkerPool(int nrOfThreads) :
+        m_nrOfThreads(nrOfThreads > 0 ? nrOfThreads : defaultNrOfThreads())
+    {
+    }
+
+    int WorkerPool::defaultNrOfThreads()
+    {
+        int nrOfThreads = static_cast<int>(std::thread::hardware_concurrency());
+        return nrOfThreads > 0 ? nrOfThreads : 1;
+    }
+
+    void WorkerPool::forEach(size_t count, const std::function<void(size_t)>& work)
+    {
+        if (m_nrOfThreads == 1 || count < 2) {
+            for (size_t i = 0; i < count; i++) {
+                work(i);
+            }
+            return;
+        }
+
+        std::atomic<size_t> nextIndex {0};
+        std::exception_ptr firstException;
+        std::mutex exceptionMutex;
+
+        auto worker = [&]() {
+            while (true) {
+                size_t i = nextIndex.fetch_add(1);
+                if (i >= count) {
+                    return;
+                }
+
+                try {
+                    work(i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> guard(exceptionMutex);
+                    if (!firstException) {
+                        firstException = std::current_exception();
+                    }
+                    // Stop handing out new work
+                    nextIndex = count;
+                    return;
+                }
+            }
+        };
+
+        size_t nrOfThreads = std::min(static_cast<size_t>(m_nrOfThreads), count);
+
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < nrOfThreads; i++) {
+            threads.emplace_back(worker);
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        if (firstException) {
+            std::rethrow_exception(firstException);
+        }
+    }
+
+} // namespace backer
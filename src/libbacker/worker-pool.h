@@ -0,0 +1,46 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <cstddef>
+#include <functional>
+
+namespace backer {
+
+class WorkerPool {
+public:
+    explicit WorkerPool(int nrOfThreads);
+
+    // Number of hardware threads, at least 1
+    static int defaultNrOfThreads();
+
+    int nrOfThreads() const {
+        return m_nrOfThreads;
+    }
+
+    // Calls work(i) for every i in [0, count) and blocks until all calls are done.
+    // The first exception thrown by a worker is rethrown on the calling thread.
+    void forEach(size_t count, const std::function<void(size_t)>& work);
+
+private:
+    int m_nrOfThreads { 1 };
+};
+
+} // namespace backer
+
+#endif
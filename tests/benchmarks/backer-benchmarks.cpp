@@ -0,0 +1,490 @@
+/***
+ * Copyright 2019 The Katla Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "katla/core/core.h"
+#include "libbacker/backer.h"
+#include "libbacker/directory-scanner.h"
+#include "libbacker/fast-cdc.h"
+#include "libbacker/file-group-set.h"
+#include "libbacker/file-index-compare.h"
+#include "libbacker/file-index-diff.h"
+#include "libbacker/file-hash-reader.h"
+#include "libbacker/file-index-reader.h"
+#include "libbacker/file-index-snapshot.h"
+#include "libbacker/file-index-writer.h"
+#include "libbacker/sha256-multi-buffer.h"
+#include "libbacker/worker-pool.h"
+
+#include "katla/core/posix-file.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+    std::string createTemporaryDir()
+    {
+        std::string dirTemplate = "/tmp/backer-benchmark-XXXXXX";
+        if (mkdtemp(dirTemplate.data()) == NULL) {
+            throw std::runtime_error("Failed creating temporary dir");
+        }
+        return dirTemplate;
+    }
+
+    std::vector<backer::FileHashRequest> createFiles(const std::string& dir, size_t count, size_t size)
+    {
+        std::mt19937_64 random(count * size);
+        std::vector<char> data(size);
+
+        std::vector<backer::FileHashRequest> requests;
+        for (size_t i = 0; i < count; i++) {
+            // Spread files over subdirectories like a real tree
+            auto subDir = katla::format("{}/{}", dir, i / 1000);
+            fs::create_directories(subDir);
+
+            for (auto& c : data) {
+                c = static_cast<char>(random());
+            }
+
+            auto path = katla::format("{}/{}", subDir, i);
+            std::ofstream(path, std::ios::binary).write(data.data(), data.size());
+            requests.push_back({path, size});
+        }
+
+        return requests;
+    }
+
+    void benchmark(const std::string& name, const std::vector<backer::FileHashRequest>& requests, const std::function<void()>& function)
+    {
+        uint64_t totalBytes = 0;
+        for (auto& request : requests) {
+            totalBytes += request.size;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        function();
+        auto end = std::chrono::steady_clock::now();
+
+        double seconds = std::chrono::duration<double>(end - start).count();
+        katla::print(stdout,
+                     "{:<40} {:>10.3f} s {:>12.0f} files/s {:>10.1f} MiB/s\n",
+                     name,
+                     seconds,
+                     requests.size() / seconds,
+                     totalBytes / seconds / (1024 * 1024));
+    }
+
+    void benchmarkScan(const std::string& name, const std::string& dir, int jobs)
+    {
+        auto timeScan = [](const std::string& scanName, const std::function<size_t()>& scan) {
+            auto start = std::chrono::steady_clock::now();
+            size_t nrOfEntries = scan();
+            auto end = std::chrono::steady_clock::now();
+
+            double seconds = std::chrono::duration<double>(end - start).count();
+            katla::print(stdout, "{:<40} {:>10.3f} s {:>12.0f} entries/s\n", scanName, seconds, nrOfEntries / seconds);
+        };
+
+        // How the tree used to be walked, resolving the absolute and relative path of every entry
+        timeScan(katla::format("{} std::filesystem scan", name), [&]() {
+            size_t nrOfEntries = 0;
+            for (auto& entry : fs::recursive_directory_iterator(dir)) {
+                auto absolutePath = katla::PosixFile::absolutePath(entry.path().string());
+                auto relativePath = fs::relative(entry.path(), dir);
+                nrOfEntries += absolutePath && !relativePath.empty() ? 1 : 0;
+            }
+            return nrOfEntries;
+        });
+
+        auto tree = backer::FileTree::create(dir, jobs);
+        katla::print(stdout, "{:<40} {:>10} bytes per entry\n", katla::format("{} file tree", name), tree.memoryUsage() / tree.size());
+
+        for (int scanJobs : {1, jobs}) {
+            timeScan(katla::format("{} scanner {} jobs", name, scanJobs == 0 ? backer::WorkerPool::defaultNrOfThreads() : scanJobs), [&]() {
+                auto tree = backer::DirectoryScanner(scanJobs).scan(dir);
+                return tree.size();
+            });
+        }
+    }
+
+    void benchmarkGrouping(const std::string& name, const std::string& dir, int jobs)
+    {
+        auto tree = backer::FileTree::create(dir, jobs);
+
+        auto timeGrouping = [&](const std::string& groupingName, const std::function<size_t()>& grouping) {
+            auto start = std::chrono::steady_clock::now();
+            size_t nrOfGroups = grouping();
+            auto end = std::chrono::steady_clock::now();
+
+            double seconds = std::chrono::duration<double>(end - start).count();
+            katla::print(stdout, "{:<40} {:>10.3f} s {:>12.0f} files/s {:>10} groups\n", groupingName, seconds, tree.nrOfFiles() / seconds, nrOfGroups);
+        };
+
+        // How files used to be grouped, by a formatted name and size in an ordered map of detached entries
+        timeGrouping(katla::format("{} std::map grouping", name), [&]() {
+            std::map<std::string, std::vector<backer::FileSystemEntry>> fileMap;
+            tree.forEachFile([&](backer::NodeIndex index) {
+                auto key = katla::format("{}-{}", tree.name(index), tree.node(index).size);
+                fileMap[key].push_back(tree.entry(index));
+            });
+            return fileMap.size();
+        });
+
+        auto treeCopy = tree;
+        timeGrouping(katla::format("{} file group set", name), [&]() {
+            backer::FileGroupSet fileGroupSet;
+            fileGroupSet.addTree(std::move(treeCopy), jobs);
+            return fileGroupSet.nrOfGroups();
+        });
+    }
+
+    // Directories nested depth levels deep with fanOut subdirectories each, the deepest ones hold the files
+    backer::FileTree createDeepTree(int depth, int fanOut, int filesPerDirectory)
+    {
+        backer::FileTree tree;
+        backer::FileNode root;
+        root.type = backer::FileSystemEntryType::Dir;
+        tree.addNode(root, "");
+
+        std::vector<backer::NodeIndex> level = {backer::FileTree::root()};
+        for (int i = 0; i <= depth; i++) {
+            std::vector<backer::NodeIndex> nextLevel;
+            for (auto parent : level) {
+                int childCount = (i < depth) ? fanOut : filesPerDirectory;
+                tree.node(parent).firstChild = static_cast<backer::NodeIndex>(tree.size());
+                tree.node(parent).childCount = childCount;
+
+                for (int j = 0; j < childCount; j++) {
+                    backer::FileNode node;
+                    node.parent = parent;
+                    node.type = (i < depth) ? backer::FileSystemEntryType::Dir : backer::FileSystemEntryType::File;
+                    node.size = j;
+                    node.inode = tree.size();
+                    node.hash[0] = static_cast<std::byte>(j);
+                    node.hash[1] = static_cast<std::byte>(tree.size());
+
+                    auto name = (i < depth) ? katla::format("directory-{}-{}", i, j) : katla::format("file-{}.txt", j);
+                    auto index = tree.addNode(node, name);
+                    if (i < depth) {
+                        nextLevel.push_back(index);
+                    }
+                }
+            }
+            level = std::move(nextLevel);
+        }
+
+        return tree;
+    }
+
+    void benchmarkIndexWriter(const std::string& dir)
+    {
+        auto tree = createDeepTree(6, 5, 12);
+        auto path = katla::format("{}/{}", dir, backer::DefaultFileIndexName);
+
+        auto start = std::chrono::steady_clock::now();
+        auto writer = backer::FileIndexWriter::create(path, backer::HashAlgorithm::Sha256);
+        writer.addDirectories(tree);
+        writer.commit();
+        for (backer::NodeIndex index = 0; index < tree.size(); index++) {
+            writer.write(tree, index);
+        }
+
+        auto insertEnd = std::chrono::steady_clock::now();
+        writer.finish();
+        auto end = std::chrono::steady_clock::now();
+
+        double insertSeconds = std::chrono::duration<double>(insertEnd - start).count();
+        double seconds = std::chrono::duration<double>(end - start).count();
+        katla::print(stdout, "{:<40} {:>10.3f} s {:>12.0f} rows/s {:>10.0f} rows/s with indexes\n",
+                     "file index writer", seconds, tree.size() / insertSeconds, tree.size() / seconds);
+
+        // Reading all records back is what an update of the index starts with
+        start = std::chrono::steady_clock::now();
+        auto records = backer::FileIndexReader::open(path).readRecords();
+        end = std::chrono::steady_clock::now();
+
+        seconds = std::chrono::duration<double>(end - start).count();
+        katla::print(stdout, "{:<40} {:>10.3f} s {:>12.0f} rows/s {:>10} bytes {:>6} bytes per row\n",
+                     "file index full scan", seconds, records.size() / seconds, fs::file_size(path), fs::file_size(path) / records.size());
+    }
+
+    // A million files with random hashes in a shallow tree, measures the raw insert rate rather than the paths
+    void benchmarkIndexWriterInserts(const std::string& dir)
+    {
+        auto tree = createDeepTree(2, 100, 100);
+        std::mt19937_64 random(tree.size());
+        tree.forEachFile([&](backer::NodeIndex index) {
+            for (auto& byte : tree.node(index).hash) {
+                byte = static_cast<std::byte>(random());
+            }
+        });
+        auto path = katla::format("{}/inserts.db", dir);
+
+        auto start = std::chrono::steady_clock::now();
+        auto writer = backer::FileIndexWriter::create(path, backer::HashAlgorithm::Sha256);
+        writer.addDirectories(tree);
+        writer.commit();
+        for (backer::NodeIndex index = 0; index < tree.size(); index++) {
+            writer.write(tree, index);
+        }
+
+        auto insertEnd = std::chrono::steady_clock::now();
+        writer.finish();
+        auto end = std::chrono::steady_clock::now();
+
+        double insertSeconds = std::chrono::duration<double>(insertEnd - start).count();
+        double seconds = std::chrono::duration<double>(end - start).count();
+        katla::print(stdout, "{:<40} {:>10.3f} s {:>12.0f} rows/s {:>10.0f} rows/s with indexes {:>6} bytes per row\n",
+                     "file index writer 1M rows", seconds, tree.size() / insertSeconds, tree.size() / seconds, fs::file_size(path) / tree.size());
+    }
+
+    void writeIndex(const backer::FileTree& tree, const std::string& path)
+    {
+        auto writer = backer::FileIndexWriter::create(path, backer::HashAlgorithm::Sha256);
+        writer.addDirectories(tree);
+        writer.commit();
+        for (backer::NodeIndex index = 0; index < tree.size(); index++) {
+            writer.write(tree, index);
+        }
+        writer.finish();
+    }
+
+    void benchmarkIndexDiff(const std::string& dir)
+    {
+        auto tree = createDeepTree(6, 5, 12);
+        auto srcPath = katla::format("{}/diff-src.db", dir);
+        writeIndex(tree, srcPath);
+
+        // A single changed file changes the hashes of all directories above it
+        for (auto index = static_cast<backer::NodeIndex>(tree.size() - 1); index != backer::NoNode; index = tree.node(index).parent) {
+            tree.node(index).hash[2] = std::byte {1};
+        }
+        auto destPath = katla::format("{}/diff-dest.db", dir);
+        writeIndex(tree, destPath);
+
+        auto timeDiff = [&](const std::string& name, const std::function<size_t()>& diff) {
+            auto start = std::chrono::steady_clock::now();
+            size_t nrOfChanges = diff();
+            auto end = std::chrono::steady_clock::now();
+
+            double seconds = std::chrono::duration<double>(end - start).count();
+            katla::print(stdout, "{:<40} {:>10.3f} s {:>12.0f} entries/s {:>10} changes\n", name, seconds, tree.size() / seconds, nrOfChanges);
+        };
+
+        timeDiff("file index compare", [&]() {
+            auto comparison = backer::FileIndexCompare::compare(srcPath, destPath);
+            return comparison.onlyAtDest.size();
+        });
+        timeDiff("file index merkle diff", [&]() {
+            return backer::FileIndexDiff::diff(srcPath, destPath).changes.size();
+        });
+    }
+
+    void benchmarkSnapshot(const std::string& dir)
+    {
+        auto tree = createDeepTree(6, 5, 12);
+        std::mt19937_64 random(3);
+        std::vector<backer::Digest> hashes;
+        tree.forEachFile([&](backer::NodeIndex index) {
+            uint64_t value = random();
+            std::memcpy(tree.node(index).hash.data(), &value, sizeof(value));
+            hashes.push_back(tree.node(index).hash);
+        });
+
+        auto indexPath = katla::format("{}/snapshot-src.db", dir);
+        auto snapshotPath = katla::format("{}/snapshot-src.snapshot", dir);
+        writeIndex(tree, indexPath);
+
+        auto timeStage = [&](const std::string& name, const std::function<void()>& stage) {
+            auto start = std::chrono::steady_clock::now();
+            stage();
+            auto end = std::chrono::steady_clock::now();
+            double seconds = std::chrono::duration<double>(end - start).count();
+            katla::print(stdout, "{:<40} {:>10.6f} s {:>12.0f} files/s\n", name, seconds, hashes.size() / seconds);
+        };
+
+        // Half of the lookups are for hashes that are not in the index
+        std::vector<backer::Digest> lookups;
+        for (size_t i = 0; i < 1000000; i++) {
+            auto hash = hashes[random() % hashes.size()];
+            hash[31] = static_cast<std::byte>(i % 2);
+            lookups.push_back(hash);
+        }
+
+        auto timeLookups = [&](const std::string& name, const std::function<bool(const backer::Digest&)>& contains) {
+            size_t nrOfFound = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (auto& hash : lookups) {
+                nrOfFound += contains(hash);
+            }
+            auto end = std::chrono::steady_clock::now();
+            double seconds = std::chrono::duration<double>(end - start).count();
+            katla::print(stdout, "{:<40} {:>10.3f} s {:>12.0f} ns/lookup {:>10} found\n", name, seconds, seconds * 1e9 / lookups.size(), nrOfFound);
+        };
+
+        std::unordered_set<backer::Digest, backer::DigestHash> loadedHashes;
+        timeStage("file index load hashes", [&]() {
+            for (auto& [file, record] : backer::FileIndexReader::open(indexPath).readRecords()) {
+                loadedHashes.insert(record.hash);
+            }
+        });
+        timeLookups("file index hash set lookups", [&](const backer::Digest& hash) { return loadedHashes.count(hash) > 0; });
+
+        timeStage("snapshot export", [&]() { backer::FileIndexSnapshot::create(indexPath, snapshotPath); });
+
+        backer::FileIndexSnapshot snapshot;
+        timeStage("snapshot open", [&]() { snapshot = backer::FileIndexSnapshot::open(snapshotPath); });
+        timeLookups("snapshot lookups", [&](const backer::Digest& hash) { return snapshot.contains(hash); });
+    }
+
+    void benchmarkChunking(const std::vector<backer::FileHashRequest>& requests)
+    {
+        std::mt19937_64 random(1);
+        std::vector<std::byte> data(256 * 1024 * 1024);
+        for (size_t i = 0; i + sizeof(uint64_t) <= data.size(); i += sizeof(uint64_t)) {
+            uint64_t value = random();
+            std::memcpy(data.data() + i, &value, sizeof(value));
+        }
+
+        backer::FastCdc chunker;
+        auto timeCuts = [&](const std::string& name, bool serial) {
+            size_t nrOfChunks = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t offset = 0; offset < data.size(); nrOfChunks++) {
+                offset += serial ? chunker.nextChunkSerial(data.data() + offset, data.size() - offset)
+                                 : chunker.nextChunk(data.data() + offset, data.size() - offset);
+            }
+            auto end = std::chrono::steady_clock::now();
+
+            double seconds = std::chrono::duration<double>(end - start).count();
+            katla::print(stdout, "{:<40} {:>10.3f} s {:>12} chunks {:>10.1f} MiB/s\n", name, seconds, nrOfChunks, data.size() / seconds / (1024 * 1024));
+        };
+
+        timeCuts("chunk boundaries serial", true);
+        timeCuts("chunk boundaries interleaved", false);
+
+        benchmark("chunk and hash large files", requests, [&]() {
+            for (auto& request : requests) {
+                backer::Digest fileHash;
+                chunker.chunkFile(request.path, backer::HashAlgorithm::Sha256, fileHash);
+            }
+        });
+    }
+
+    void benchmarkHashReaders(const std::string& name, const std::vector<backer::FileHashRequest>& requests, int jobs)
+    {
+        benchmark(katla::format("{} sha256 per file", name), requests, [&]() {
+            for (auto& request : requests) {
+                backer::Backer::sha256(request.path);
+            }
+        });
+
+        for (auto backend : {backer::IoBackend::Blocking, backer::IoBackend::IoUring}) {
+            backer::IoOptions options;
+            options.backend = backend;
+
+            auto reader = backer::FileHashReader::create(jobs, options);
+            if (backend == backer::IoBackend::IoUring && reader->name() != "io_uring") {
+                continue;
+            }
+
+            benchmark(katla::format("{} {} reader", name, reader->name()), requests, [&]() {
+                reader->hash(requests);
+            });
+
+            options.multiBufferThreshold = 0;
+            auto singleBufferReader = backer::FileHashReader::create(jobs, options);
+            benchmark(katla::format("{} {} reader single buffer", name, reader->name()), requests, [&]() {
+                singleBufferReader->hash(requests);
+            });
+        }
+
+        // Hashing only, with the content already in memory
+        std::vector<std::vector<std::byte>> contents;
+        std::vector<gsl::span<const std::byte>> messages;
+        for (auto& request : requests) {
+            if (request.size <= backer::IoOptions().multiBufferThreshold) {
+                contents.emplace_back(request.size);
+            }
+        }
+        for (auto& content : contents) {
+            messages.push_back(gsl::span<const std::byte>(content.data(), content.size()));
+        }
+
+        for (auto implementation : {backer::Sha256MultiBuffer::Implementation::OpenSsl, backer::Sha256MultiBuffer::Implementation::Avx2}) {
+            if (messages.empty()) {
+                break;
+            }
+            if (!backer::Sha256MultiBuffer::isAvailable(implementation)) {
+                continue;
+            }
+
+            benchmark(katla::format("{} sha256 {} in memory", name, backer::Sha256MultiBuffer::implementationName(implementation)), requests, [&]() {
+                backer::Sha256MultiBuffer::hash(messages, implementation);
+            });
+        }
+
+        for (auto algorithm : {backer::HashAlgorithm::Xxh3_128, backer::HashAlgorithm::Blake3}) {
+            if (!backer::Hasher::isAvailable(algorithm)) {
+                continue;
+            }
+
+            auto reader = backer::FileHashReader::create(jobs, backer::IoOptions(), algorithm);
+            benchmark(katla::format("{} {} {} reader", name, backer::Hasher::algorithmName(algorithm), reader->name()), requests, [&]() {
+                reader->hash(requests);
+            });
+        }
+    }
+}
+
+// Usage: backer-benchmarks [number of small files] [size of large files in MiB] [jobs]
+// Runs on the page cache, drop caches in between runs to benchmark cold reads.
+int main(int argc, char* argv[])
+{
+    size_t smallFileCount = argc > 1 ? std::stoul(argv[1]) : 20000;
+    size_t largeFileSize = (argc > 2 ? std::stoul(argv[2]) : 256) * 1024 * 1024;
+    int jobs = argc > 3 ? std::stoi(argv[3]) : 0;
+
+    auto dir = createTemporaryDir();
+
+    auto smallFiles = createFiles(katla::format("{}/small", dir), smallFileCount, 2048);
+    benchmarkScan("small files", katla::format("{}/small", dir), jobs);
+    benchmarkGrouping("small files", katla::format("{}/small", dir), jobs);
+    benchmarkHashReaders("small files", smallFiles, jobs);
+
+    benchmarkIndexWriter(dir);
+    benchmarkIndexWriterInserts(dir);
+    benchmarkIndexDiff(dir);
+    benchmarkSnapshot(dir);
+
+    auto largeFiles = createFiles(katla::format("{}/large", dir), 4, largeFileSize);
+    benchmarkHashReaders("large files", largeFiles, jobs);
+    benchmarkChunking(largeFiles);
+
+    fs::remove_all(dir);
+    return EXIT_SUCCESS;
+}
@@ -17,14 +17,116 @@
 #include "gtest/gtest.h"
 
 #include <gsl/span>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sqlite3.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "katla/core/core.h"
 #include "libbacker/backer.h"
+#include "libbacker/bounded-queue.h"
+#include "libbacker/directory-scanner.h"
+#include "libbacker/duplicate-finder.h"
+#include "libbacker/fast-cdc.h"
+#include "libbacker/file-deduplicator.h"
+#include "libbacker/file-chunk-report.h"
+#include "libbacker/file-hash-cache.h"
+#include "libbacker/file-index-compare.h"
+#include "libbacker/file-index-database.h"
+#include "libbacker/file-index-diff.h"
+#include "libbacker/file-index-reader.h"
+#include "libbacker/file-index-snapshot.h"
+#include "libbacker/file-index-writer.h"
+#include "libbacker/file-sync.h"
+#include "libbacker/io-uring-file-hash-reader.h"
+#include "libbacker/per-device-file-hash-reader.h"
+#include "libbacker/read-scheduler.h"
+#include "libbacker/sha256-multi-buffer.h"
+#include "libbacker/worker-pool.h"
 
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <set>
+#include <thread>
 #include <variant>
 
 namespace backer {
 
+    outcome::result<std::string> createTemporaryDir() {
+        std::string dirTemplate = "/tmp/katla-test-XXXXXX";
+        if (mkdtemp(dirTemplate.data()) == NULL) {
+            return std::make_error_code(static_cast<std::errc>(errno));
+        }
+        return dirTemplate;
+    }
+
+    // Unique directory for the files of one test, removed with everything in it when the test ends, also when an
+    // assertion fails
+    class TemporaryDir {
+    public:
+        TemporaryDir() {
+            auto result = createTemporaryDir();
+            if (!result) {
+                throw std::runtime_error(katla::format("Failed creating temporary dir: {}", result.error().message()));
+            }
+            m_path = result.value();
+        }
+
+        ~TemporaryDir() {
+            std::error_code error;
+            std::filesystem::remove_all(m_path, error);
+        }
+
+        TemporaryDir(const TemporaryDir&) = delete;
+        TemporaryDir& operator=(const TemporaryDir&) = delete;
+
+        const std::filesystem::path& path() const {
+            return m_path;
+        }
+
+    private:
+        std::filesystem::path m_path;
+    };
+
+    TEST(BackerTests, HashKnownAnswerTest) {
+        struct KnownAnswer
+        {
+            HashAlgorithm algorithm;
+            std::string message;
+            std::string hash;
+        };
+
+        std::vector<KnownAnswer> knownAnswers = {
+            {HashAlgorithm::Sha256, "", "E3B0C44298FC1C149AFBF4C8996FB92427AE41E4649B934CA495991B7852B855"},
+            {HashAlgorithm::Sha256, "abc", "BA7816BF8F01CFEA414140DE5DAE2223B00361A396177A9CB410FF61F20015AD"},
+            {HashAlgorithm::Xxh3_128, "", "99AA06D3014798D86001C324468D497F"},
+            {HashAlgorithm::Blake3, "", "AF1349B9F5F9A1A6A0404DEA36DCC9499BCB25C9ADC112B7CC9A93CAE41F3262"},
+            {HashAlgorithm::Blake3, "abc", "6437B3AC38465133FFB63B75273A8DB548C558465D79DB03FD359C6CD5BD9D85"}};
+
+        TemporaryDir temporaryDir;
+        auto path = (temporaryDir.path() / "message").string();
+
+        for (auto& knownAnswer : knownAnswers) {
+            // Algorithms backer was built without are not tested
+            if (!Hasher::isAvailable(knownAnswer.algorithm)) {
+                continue;
+            }
+
+            auto hasher = Hasher::create(knownAnswer.algorithm);
+            hasher->update(reinterpret_cast<const std::byte*>(knownAnswer.message.data()), knownAnswer.message.size());
+            auto hash = hasher->final();
+            ASSERT_EQ(hash.size(), Hasher::digestSize(knownAnswer.algorithm));
+            ASSERT_EQ(Backer::formatHash(hash), knownAnswer.hash) << Hasher::algorithmName(knownAnswer.algorithm);
+
+            std::ofstream(path, std::ios::binary | std::ios::trunc) << knownAnswer.message;
+            ASSERT_EQ(Backer::formatHash(Backer::hashFile(path, knownAnswer.algorithm)), knownAnswer.hash);
+        }
+    }
+
     TEST(BackerTests, DuplicateFileTest) {
         auto hash1 = Backer::sha256(katla::format("{}/{}", CMAKE_SOURCE_DIR, "tests/test-sets/duplicate-test/dup1"));
         auto hash2 = Backer::sha256(katla::format("{}/{}", CMAKE_SOURCE_DIR, "tests/test-sets/duplicate-test/dup2"));
@@ -41,19 +143,1064 @@ namespace backer {
 
     TEST(BackerTests, GroupPotentialDuplicateFileTest) {
         auto fileGroupSet = FileGroupSet::create((katla::format("{}/{}", CMAKE_SOURCE_DIR, "tests/test-sets/group-potential-duplicates")));
-        auto fileMap = fileGroupSet.fileMap();
-        ASSERT_TRUE(fileMap.size() == 3) << "Expected 3 groups";
-        ASSERT_TRUE(fileMap["diff1-6"].size() == 1);
-        ASSERT_TRUE(fileMap["diff2-6"].size() == 1);
-        ASSERT_TRUE(fileMap["dup-4"].size() == 2);
+        ASSERT_TRUE(fileGroupSet.nrOfGroups() == 3) << "Expected 3 groups";
+        ASSERT_TRUE(fileGroupSet.group("diff1", 6).size() == 1);
+        ASSERT_TRUE(fileGroupSet.group("diff2", 6).size() == 1);
+        ASSERT_TRUE(fileGroupSet.group("dup", 4).size() == 2);
+        ASSERT_TRUE(fileGroupSet.group("dup", 5).size() == 0);
     }
 
-    outcome::result<std::string> createTemporaryDir() {
-        std::string dirTemplate = "/tmp/katla-test-XXXXXX";
-        if (mkdtemp(dirTemplate.data()) == NULL) {
-            return std::make_error_code(static_cast<std::errc>(errno));
+    TEST(BackerTests, DuplicateFinderTest) {
+        auto fileGroupSet = FileGroupSet::create((katla::format("{}/{}", CMAKE_SOURCE_DIR, "tests/test-sets/duplicate-test")));
+
+        auto files = fileGroupSet.entries();
+
+        DuplicateFinder duplicateFinder;
+        auto groups = duplicateFinder.group(files);
+
+        ASSERT_EQ(groups.size(), 3) << "Expected dup1 and dup2 in one group";
+        for (auto& group : groups) {
+            if (group.size() == 2) {
+                ASSERT_EQ(group[0].hash, group[1].hash);
+            }
         }
-        return dirTemplate;
+    }
+
+    TEST(BackerTests, DuplicatePairTest) {
+        TemporaryDir temporaryDir;
+        auto path = (temporaryDir.path() / "tree").string();
+        std::filesystem::create_directories(path);
+        std::ofstream(path + "/first") << "pair content";
+        std::ofstream(path + "/second") << "pair content";
+        std::ofstream(path + "/empty-first");
+        std::ofstream(path + "/empty-second");
+
+        auto tree = FileTree::create(path);
+        std::vector<FileSystemEntry> files;
+        tree.forEachFile([&](NodeIndex index) {
+            files.push_back(tree.entry(index));
+        });
+
+        DuplicateFinder duplicateFinder;
+        auto groups = duplicateFinder.group(files);
+
+        // A group of exactly two distinct files is reported as duplicates
+        ASSERT_EQ(groups.size(), 2);
+        std::sort(groups.begin(), groups.end(), [](auto& left, auto& right) { return left[0].size < right[0].size; });
+        ASSERT_EQ(groups[1].size(), 2);
+        ASSERT_GE(DuplicateFinder::nrOfInodes(groups[1]), 2);
+        ASSERT_EQ(groups[1][0].hash, Hasher::toDigest(Backer::hashFile(path + "/first", HashAlgorithm::Sha256)));
+
+        // Empty files are never read, they still get the hash of empty content
+        ASSERT_EQ(groups[0].size(), 2);
+        for (auto& file : groups[0]) {
+            ASSERT_EQ(file.hash, Hasher::toDigest(Backer::hashFile(path + "/empty-first", HashAlgorithm::Sha256)));
+        }
+    }
+
+    TEST(BackerTests, CompareAndHashTest) {
+        TemporaryDir temporaryDir;
+        auto path = (temporaryDir.path() / "files").string();
+        std::filesystem::create_directories(path);
+
+        // Three and a half blocks, so the last block is a short one
+        size_t blockSize = 4096;
+        std::string content(blockSize * 7 / 2, '\0');
+        std::mt19937 random(7);
+        for (auto& c : content) {
+            c = static_cast<char>(random());
+        }
+        std::string lastBlockDiffers = content;
+        lastBlockDiffers.back() ^= 1;
+
+        std::ofstream(path + "/original", std::ios::binary) << content;
+        std::ofstream(path + "/copy", std::ios::binary) << content;
+        std::ofstream(path + "/last-block-differs", std::ios::binary) << lastBlockDiffers;
+
+        uint64_t bytesRead = 0;
+        auto hash = DuplicateFinder::compareAndHash(path + "/original", path + "/copy", blockSize, HashAlgorithm::Sha256, bytesRead);
+        ASSERT_TRUE(hash.has_value());
+        ASSERT_EQ(*hash, Backer::hashFile(path + "/original", HashAlgorithm::Sha256));
+        ASSERT_EQ(bytesRead, 2 * content.size());
+
+        bytesRead = 0;
+        hash = DuplicateFinder::compareAndHash(path + "/original", path + "/last-block-differs", blockSize, HashAlgorithm::Sha256, bytesRead);
+        ASSERT_FALSE(hash.has_value());
+        ASSERT_EQ(bytesRead, 2 * content.size());
+    }
+
+    TEST(BackerTests, HardLinkTest) {
+        TemporaryDir temporaryDir;
+        auto path = (temporaryDir.path() / "tree").string();
+        std::filesystem::create_directories(path);
+        std::ofstream(path + "/original") << "linked content";
+        std::ofstream(path + "/copy") << "linked content";
+        std::filesystem::create_hard_link(path + "/original", path + "/link");
+
+        auto tree = FileTree::create(path);
+        std::vector<FileSystemEntry> files;
+        tree.forEachFile([&](NodeIndex index) {
+            files.push_back(tree.entry(index));
+        });
+
+        DuplicateFinderOptions options;
+        options.lockstepCompare = false;
+        DuplicateFinder duplicateFinder(options);
+        auto groups = duplicateFinder.group(files);
+
+        ASSERT_EQ(groups.size(), 1);
+        ASSERT_EQ(groups[0].size(), 3);
+        ASSERT_EQ(DuplicateFinder::nrOfInodes(groups[0]), 2);
+        ASSERT_EQ(duplicateFinder.hardLinkGroups().size(), 1);
+        ASSERT_EQ(duplicateFinder.hardLinkGroups()[0].size(), 2);
+        ASSERT_EQ(duplicateFinder.statistics().hardLinkBytesAvoided, 14);
+
+        // Both paths of the inode are in the index with the same hash
+        auto indexPath = path + ".db";
+        FileIndexDatabase::create(indexPath, path);
+        auto records = FileIndexReader::open(indexPath).readRecords();
+        ASSERT_EQ(records.at("link").hash, records.at("original").hash);
+        ASSERT_EQ(records.at("copy").hash, records.at("original").hash);
+    }
+
+    TEST(BackerTests, FileDeduplicatorTest) {
+        TemporaryDir temporaryDir;
+        auto path = (temporaryDir.path() / "tree").string();
+        std::filesystem::create_directories(path);
+        std::ofstream(path + "/copy") << "linked content";
+        std::ofstream(path + "/original") << "linked content";
+        std::ofstream(path + "/zchanged") << "linked content";
+        std::filesystem::create_hard_link(path + "/copy", path + "/link");
+
+        auto tree = FileTree::create(path);
+        std::vector<FileSystemEntry> files;
+        tree.forEachFile([&](NodeIndex index) {
+            files.push_back(tree.entry(index));
+        });
+
+        auto groups = DuplicateFinder().group(files);
+        ASSERT_EQ(groups.size(), 1);
+        std::sort(groups[0].begin(), groups[0].end(), [](auto& left, auto& right) { return left.relativePath < right.relativePath; });
+
+        // A file written after it was hashed is left alone, its size changes so this doesn't depend on the
+        // timestamp resolution
+        std::ofstream(path + "/zchanged") << "other longer content";
+
+        FileDeduplicator deduplicator(DedupeMode::Hardlink);
+        deduplicator.deduplicate(groups);
+        ASSERT_EQ(deduplicator.statistics().nrOfGroups, 1);
+        ASSERT_EQ(deduplicator.statistics().nrOfDeduplicated, 1);
+        ASSERT_EQ(deduplicator.statistics().nrOfSkipped, 1);
+        ASSERT_EQ(deduplicator.statistics().bytesReclaimed, 14);
+
+        ASSERT_TRUE(std::filesystem::equivalent(path + "/original", path + "/copy"));
+        ASSERT_EQ(std::filesystem::hard_link_count(path + "/copy"), 3);
+        ASSERT_FALSE(std::filesystem::equivalent(path + "/zchanged", path + "/copy"));
+
+        ASSERT_THROW(FileDeduplicator::parseMode("symlink"), std::runtime_error);
+    }
+
+    TEST(BackerTests, FileDeduplicatorReflinkTest) {
+        TemporaryDir temporaryDir;
+        auto path = (temporaryDir.path() / "tree").string();
+        std::filesystem::create_directories(path);
+
+        std::string content(3 * 4096, '\0');
+        std::mt19937 random(11);
+        for (auto& c : content) {
+            c = static_cast<char>(random());
+        }
+        std::ofstream(path + "/copy", std::ios::binary) << content;
+        std::ofstream(path + "/original", std::ios::binary) << content;
+        std::ofstream(path + "/zchanged", std::ios::binary) << content;
+
+        auto groupFiles = [&]() {
+            auto tree = FileTree::create(path);
+            std::vector<FileSystemEntry> files;
+            tree.forEachFile([&](NodeIndex index) {
+                files.push_back(tree.entry(index));
+            });
+
+            auto groups = DuplicateFinder().group(files);
+            for (auto& group : groups) {
+                std::sort(group.begin(), group.end(), [](auto& left, auto& right) { return left.relativePath < right.relativePath; });
+            }
+            return groups;
+        };
+
+        {
+            int src = ::open((path + "/original").c_str(), O_RDONLY);
+            int dest = ::open((path + "/copy").c_str(), O_RDWR);
+            std::vector<std::byte> request(sizeof(file_dedupe_range) + sizeof(file_dedupe_range_info));
+            auto range = reinterpret_cast<file_dedupe_range*>(request.data());
+            range->src_length = content.size();
+            range->dest_count = 1;
+            range->info[0].dest_fd = dest;
+            int result = ::ioctl(src, FIDEDUPERANGE, range);
+            int error = errno;
+            ::close(src);
+            ::close(dest);
+            if (result != 0 && (error == EOPNOTSUPP || error == ENOTTY)) {
+                // Without reflinks every group fails, the run itself goes on
+                FileDeduplicator deduplicator(DedupeMode::Reflink);
+                ASSERT_NO_THROW(deduplicator.deduplicate(groupFiles()));
+                ASSERT_EQ(deduplicator.statistics().nrOfFailed, 2);
+                ASSERT_EQ(deduplicator.statistics().nrOfDeduplicated, 0);
+
+                GTEST_SKIP() << "File system of " << path << " does not support FIDEDUPERANGE";
+            }
+            ASSERT_EQ(result, 0) << std::strerror(error);
+        }
+
+        // The probe shared the extents of copy already, write it again so the deduplicator starts from unshared files
+        std::filesystem::remove(path + "/copy");
+        std::ofstream(path + "/copy", std::ios::binary) << content;
+
+        auto groups = groupFiles();
+        ASSERT_EQ(groups.size(), 1);
+
+        // The kernel finds that a file written after it was hashed differs, even at the same size and time
+        content.back() ^= 1;
+        std::ofstream(path + "/zchanged", std::ios::binary) << content;
+
+        FileDeduplicator deduplicator(DedupeMode::Reflink);
+        deduplicator.deduplicate(groups);
+        ASSERT_EQ(deduplicator.statistics().nrOfGroups, 1);
+        ASSERT_EQ(deduplicator.statistics().nrOfDeduplicated, 1);
+        ASSERT_EQ(deduplicator.statistics().nrOfSkipped, 1);
+        ASSERT_EQ(deduplicator.statistics().nrOfFailed, 0);
+        ASSERT_EQ(deduplicator.statistics().bytesReclaimed, content.size());
+
+        // Sharing extents that are shared already reclaims nothing
+        deduplicator.deduplicate(groups);
+        ASSERT_EQ(deduplicator.statistics().nrOfDeduplicated, 1);
+        ASSERT_EQ(deduplicator.statistics().bytesReclaimed, 0);
+    }
+
+    TEST(BackerTests, DirectoryScannerTest) {
+        auto path = katla::format("{}/{}", CMAKE_SOURCE_DIR, "tests/test-sets");
+
+        std::set<std::string> expected;
+        for (auto& entry : std::filesystem::recursive_directory_iterator(path)) {
+            if (entry.is_regular_file() && !entry.is_symlink()) {
+                expected.insert(std::filesystem::relative(entry.path(), path).string());
+            }
+        }
+
+        auto tree = DirectoryScanner(4).scan(path);
+        ASSERT_EQ(tree.relativePath(FileTree::root()), ".");
+        ASSERT_EQ(tree.absolutePath(FileTree::root()), path);
+
+        std::set<std::string> scanned;
+        tree.forEachFile([&](NodeIndex index) {
+            auto file = tree.entry(index);
+            scanned.insert(file.relativePath);
+            ASSERT_EQ(file.absolutePath, katla::format("{}/{}", path, file.relativePath));
+            ASSERT_EQ(file.size, std::filesystem::file_size(file.absolutePath));
+        });
+
+        ASSERT_EQ(scanned, expected);
+
+        // Children follow their parent in one block and directory sizes add up
+        for (NodeIndex index = 0; index < tree.size(); index++) {
+            auto& node = tree.node(index);
+            if (node.type != FileSystemEntryType::Dir) {
+                continue;
+            }
+
+            uint64_t size = 0;
+            for (NodeIndex child = node.firstChild; child < node.firstChild + node.childCount; child++) {
+                ASSERT_GT(child, index);
+                ASSERT_EQ(tree.node(child).parent, index);
+                size += tree.node(child).size;
+            }
+            ASSERT_EQ(node.size, size);
+        }
+
+        // A file-index in the root isn't part of the tree it indexes, one further down is an ordinary file
+        TemporaryDir temporaryDir;
+        auto indexedPath = temporaryDir.path() / "tree";
+        std::filesystem::create_directories(indexedPath / "dir");
+        std::ofstream(indexedPath / DefaultFileIndexName) << "index";
+        std::ofstream(indexedPath / katla::format("{}-wal", DefaultFileIndexName)) << "log";
+        std::ofstream(indexedPath / "dir" / DefaultFileIndexName) << "nested";
+
+        auto indexedTree = DirectoryScanner(2).scan(indexedPath.string());
+        std::set<std::string> indexedFiles;
+        indexedTree.forEachFile([&](NodeIndex index) {
+            indexedFiles.insert(indexedTree.relativePath(index));
+        });
+        ASSERT_EQ(indexedFiles, std::set<std::string>({katla::format("dir/{}", DefaultFileIndexName)}));
+    }
+
+    TEST(BackerTests, FileTreeTraversalTest) {
+        auto tree = FileTree::create(katla::format("{}/{}", CMAKE_SOURCE_DIR, "tests/test-sets"));
+
+        size_t nrOfFiles = 0;
+        tree.forEachFile([&](NodeIndex) {
+            nrOfFiles++;
+        });
+        ASSERT_EQ(tree.nrOfFiles(), nrOfFiles);
+        ASSERT_EQ(tree.nrOfFiles() + tree.nrOfDirectories(), tree.size());
+
+        std::vector<size_t> preOrder(tree.size(), 0);
+        std::vector<size_t> postOrder(tree.size(), 0);
+        size_t position = 0;
+        tree.visitPreOrder(FileTree::root(), [&](NodeIndex index) {
+            preOrder[index] = position++;
+        });
+        ASSERT_EQ(position, tree.size());
+
+        position = 0;
+        tree.visitPostOrder(FileTree::root(), [&](NodeIndex index) {
+            postOrder[index] = position++;
+        });
+        ASSERT_EQ(position, tree.size());
+
+        for (NodeIndex index = 1; index < tree.size(); index++) {
+            auto parent = tree.node(index).parent;
+            ASSERT_LT(preOrder[parent], preOrder[index]);
+            ASSERT_GT(postOrder[parent], postOrder[index]);
+        }
+    }
+
+    TEST(BackerTests, FileIndexRoundTripTest) {
+        TemporaryDir temporaryDir;
+        auto path = temporaryDir.path() / "tree";
+        auto indexPath = (temporaryDir.path() / "index.db").string();
+        std::filesystem::create_directories(path);
+        std::ofstream(path / "file") << "content";
+
+        // Hashes are stored as blobs of the digest size of the algorithm, shorter digests are zero padded
+        for (auto algorithm : {HashAlgorithm::Sha256, HashAlgorithm::Xxh3_128}) {
+            Digest storedHash {};
+            for (size_t i = 0; i < Hasher::digestSize(algorithm); i++) {
+                storedHash[i] = static_cast<std::byte>(0xa0 + i);
+            }
+
+            {
+                auto tree = FileTree::create(path.string());
+                tree.forEachFile([&](NodeIndex index) {
+                    tree.node(index).hash = storedHash;
+                });
+
+                auto writer = FileIndexWriter::create(indexPath, algorithm, 2);
+                writer.addDirectories(tree);
+                writer.commit();
+                for (NodeIndex index = 0; index < tree.size(); index++) {
+                    writer.write(tree, index);
+                }
+                writer.finish();
+            }
+
+            auto reader = FileIndexReader::open(indexPath);
+            ASSERT_TRUE(reader.isComplete());
+            ASSERT_EQ(reader.hashAlgorithm(), Hasher::algorithmName(algorithm));
+            ASSERT_EQ(reader.readRecords().at("file").hash, storedHash) << Hasher::algorithmName(algorithm);
+        }
+
+        // Indexes before the dirs and files tables had a single table with hashes as hex text
+        std::filesystem::remove(indexPath);
+        {
+            sqlite3* database = nullptr;
+            ASSERT_EQ(sqlite3_open(indexPath.c_str(), &database), SQLITE_OK);
+            auto execResult = sqlite3_exec(database,
+                "CREATE TABLE fileIndex (id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, file TEXT, hash TEXT, size INTEGER, mtime INTEGER, ctime INTEGER, inode INTEGER);"
+                "INSERT INTO fileIndex (file, hash, size, mtime, ctime, inode) VALUES "
+                "('file', 'ED7002B439E9AC845F22357D822BAC1444730FBDB6016D3EC9432297B9EC9F73', 7, 1, 2, 3);",
+                nullptr, nullptr, nullptr);
+            sqlite3_close(database);
+            ASSERT_EQ(execResult, SQLITE_OK);
+        }
+
+        auto reader = FileIndexReader::open(indexPath);
+        ASSERT_EQ(reader.hashAlgorithm(), Hasher::algorithmName(HashAlgorithm::Sha256));
+        auto record = reader.readRecords().at("file");
+        ASSERT_EQ(Backer::formatHash(record.hash, HashAlgorithm::Sha256), "ED7002B439E9AC845F22357D822BAC1444730FBDB6016D3EC9432297B9EC9F73");
+        ASSERT_EQ(record.size, 7);
+        ASSERT_EQ(record.inode, 3);
+    }
+
+    TEST(BackerTests, FileIndexUpdateTest) {
+        TemporaryDir temporaryDir;
+        auto path = temporaryDir.path() / "tree";
+        auto indexPath = (temporaryDir.path() / "index.db").string();
+        std::filesystem::create_directories(path);
+        std::ofstream(path / "unchanged") << "unchanged content";
+        std::ofstream(path / "modified") << "old content";
+
+        // An index with a made up hash for every file, only files that are read again get their real hash
+        Digest storedHash {};
+        storedHash[0] = std::byte {0x42};
+        {
+            auto tree = FileTree::create(path.string());
+            tree.forEachFile([&](NodeIndex index) {
+                tree.node(index).hash = storedHash;
+            });
+
+            auto writer = FileIndexWriter::create(indexPath, HashAlgorithm::Sha256);
+            writer.addDirectories(tree);
+            writer.commit();
+            for (NodeIndex index = 0; index < tree.size(); index++) {
+                writer.write(tree, index);
+            }
+            writer.finish();
+        }
+
+        std::ofstream(path / "modified") << "new content, longer than before";
+
+        FileIndexOptions options;
+        options.update = true;
+        FileIndexDatabase::create(indexPath, path.string(), options);
+
+        auto records = FileIndexReader::open(indexPath).readRecords();
+        ASSERT_EQ(records.at("unchanged").hash, storedHash);
+        ASSERT_EQ(records.at("modified").hash, Hasher::toDigest(Backer::hashFile((path / "modified").string(), HashAlgorithm::Sha256)));
+        ASSERT_NE(records.at(".").hash, Digest {});
+    }
+
+    TEST(BackerTests, FileIndexAlgorithmMismatchTest) {
+        TemporaryDir temporaryDir;
+        auto path = temporaryDir.path() / "tree";
+        auto indexPath = (temporaryDir.path() / "index.db").string();
+        std::filesystem::create_directories(path);
+        std::ofstream(path / "unchanged") << "unchanged content";
+
+        // Made up hashes in an index claiming another algorithm, none of them may be reused
+        Digest storedHash {};
+        storedHash[0] = std::byte {0x42};
+        {
+            auto tree = FileTree::create(path.string());
+            tree.forEachFile([&](NodeIndex index) {
+                tree.node(index).hash = storedHash;
+            });
+
+            auto writer = FileIndexWriter::create(indexPath, HashAlgorithm::Xxh3_128);
+            writer.addDirectories(tree);
+            writer.commit();
+            for (NodeIndex index = 0; index < tree.size(); index++) {
+                writer.write(tree, index);
+            }
+            writer.finish();
+        }
+
+        FileIndexOptions options;
+        options.update = true;
+        FileIndexDatabase::create(indexPath, path.string(), options);
+
+        auto reader = FileIndexReader::open(indexPath);
+        ASSERT_EQ(reader.hashAlgorithm(), Hasher::algorithmName(HashAlgorithm::Sha256));
+        auto records = reader.readRecords();
+        ASSERT_EQ(records.at("unchanged").hash, Hasher::toDigest(Backer::hashFile((path / "unchanged").string(), HashAlgorithm::Sha256)));
+    }
+
+    TEST(BackerTests, FileIndexOverwriteTest) {
+        TemporaryDir temporaryDir;
+        auto path = temporaryDir.path() / "tree";
+        auto indexPath = (temporaryDir.path() / "index.db").string();
+        std::filesystem::create_directories(path);
+        std::ofstream(path / "file") << "content";
+
+        auto countNotes = [&]() {
+            sqlite3* database = nullptr;
+            sqlite3_open(indexPath.c_str(), &database);
+            int count = -1;
+            sqlite3_exec(database, "SELECT COUNT(*) FROM notes;", [](void* data, int, char** values, char**) {
+                *static_cast<int*>(data) = std::stoi(values[0]);
+                return 0;
+            }, &count, nullptr);
+            sqlite3_close(database);
+            return count;
+        };
+
+        // A database that isn't a file-index is never overwritten
+        {
+            sqlite3* database = nullptr;
+            ASSERT_EQ(sqlite3_open(indexPath.c_str(), &database), SQLITE_OK);
+            auto execResult = sqlite3_exec(database, "CREATE TABLE notes (text TEXT); INSERT INTO notes (text) VALUES ('keep');",
+                                           nullptr, nullptr, nullptr);
+            sqlite3_close(database);
+            ASSERT_EQ(execResult, SQLITE_OK);
+        }
+
+        ASSERT_THROW(FileIndexDatabase::create(indexPath, path.string()), std::runtime_error);
+        ASSERT_EQ(countNotes(), 1);
+
+        // Rewriting an index only replaces its own tables
+        std::filesystem::remove(indexPath);
+        FileIndexDatabase::create(indexPath, path.string());
+        {
+            sqlite3* database = nullptr;
+            ASSERT_EQ(sqlite3_open(indexPath.c_str(), &database), SQLITE_OK);
+            auto execResult = sqlite3_exec(database, "CREATE TABLE notes (text TEXT); INSERT INTO notes (text) VALUES ('keep');",
+                                           nullptr, nullptr, nullptr);
+            sqlite3_close(database);
+            ASSERT_EQ(execResult, SQLITE_OK);
+        }
+
+        FileIndexDatabase::create(indexPath, path.string());
+        ASSERT_EQ(countNotes(), 1);
+        ASSERT_EQ(FileIndexReader::open(indexPath).readRecords().count("file"), 1);
+    }
+
+    TEST(BackerTests, FileIndexResumeTest) {
+        TemporaryDir temporaryDir;
+        auto path = katla::format("{}/{}", CMAKE_SOURCE_DIR, "tests/test-sets/duplicate-test");
+        auto indexPath = (temporaryDir.path() / "index.db").string();
+
+        auto tree = FileTree::create(path);
+        NodeIndex firstFile = NoNode;
+        tree.forEachFile([&](NodeIndex index) {
+            if (firstFile == NoNode) {
+                firstFile = index;
+            }
+        });
+
+        // Stops after the first file, like a run that got killed. Its made up hash shows whether it is read again.
+        Digest storedHash {};
+        storedHash[0] = std::byte {0x42};
+        tree.node(firstFile).hash = storedHash;
+        {
+            auto writer = FileIndexWriter::create(indexPath, HashAlgorithm::Sha256);
+            writer.addDirectories(tree);
+            writer.write(tree, firstFile);
+            writer.commit();
+        }
+
+        {
+            auto reader = FileIndexReader::open(indexPath);
+            ASSERT_FALSE(reader.isComplete());
+            ASSERT_TRUE(FileIndexReader::isIncompleteIndex(indexPath));
+
+            auto records = reader.readRecords();
+            ASSERT_EQ(records.size(), 1);
+            ASSERT_TRUE(records.count(tree.relativePath(firstFile)));
+        }
+
+        FileIndexDatabase::create(indexPath, path);
+
+        auto reader = FileIndexReader::open(indexPath);
+        ASSERT_TRUE(reader.isComplete());
+        ASSERT_FALSE(FileIndexReader::isIncompleteIndex(indexPath));
+
+        auto records = reader.readRecords();
+        ASSERT_EQ(records.size(), tree.size());
+        ASSERT_EQ(records.at(tree.relativePath(firstFile)).hash, storedHash);
+        tree.forEachFile([&](NodeIndex index) {
+            if (index != firstFile) {
+                ASSERT_EQ(records.at(tree.relativePath(index)).hash, Hasher::toDigest(Backer::hashFile(tree.absolutePath(index), HashAlgorithm::Sha256)));
+            }
+        });
+
+        // A file at the output path that isn't an interrupted index is never read without updating
+        std::ofstream(indexPath, std::ios::trunc) << "not a file index";
+        ASSERT_FALSE(FileIndexReader::isIncompleteIndex(indexPath));
+    }
+
+    TEST(BackerTests, FileIndexCompareTest) {
+        TemporaryDir temporaryDir;
+        auto srcPath = katla::format("{}/{}", CMAKE_SOURCE_DIR, "tests/test-sets/src");
+        auto destPath = katla::format("{}/{}", CMAKE_SOURCE_DIR, "tests/test-sets/dest");
+        auto srcIndexPath = (temporaryDir.path() / "src.db").string();
+        auto destIndexPath = (temporaryDir.path() / "dest.db").string();
+
+        FileIndexDatabase::create(srcIndexPath, srcPath);
+        FileIndexDatabase::create(destIndexPath, destPath);
+
+        auto comparison = FileIndexCompare::compare(srcIndexPath, destIndexPath);
+        ASSERT_EQ(comparison.onlyAtSrc, std::vector<std::string>({"diff1", "diff3", "diff5"}));
+        ASSERT_EQ(comparison.onlyAtDest, std::vector<std::string>({"diff2", "diff3"}));
+
+        // Both copies of dup at dest have the same content, the one at the same path is preferred
+        std::vector<std::pair<std::string, std::string>> atBoth = {{"dup", "dup"}, {"same", "same"}};
+        ASSERT_EQ(comparison.atBoth, atBoth);
+    }
+
+    TEST(BackerTests, FileIndexDiffTest) {
+        TemporaryDir temporaryDir;
+        auto srcPath = katla::format("{}/{}", CMAKE_SOURCE_DIR, "tests/test-sets/src");
+        auto destPath = katla::format("{}/{}", CMAKE_SOURCE_DIR, "tests/test-sets/dest");
+        auto srcIndexPath = (temporaryDir.path() / "src.db").string();
+        auto destIndexPath = (temporaryDir.path() / "dest.db").string();
+
+        FileIndexDatabase::create(srcIndexPath, srcPath);
+        FileIndexDatabase::create(destIndexPath, destPath);
+
+        auto diff = FileIndexDiff::diff(srcIndexPath, destIndexPath);
+
+        std::vector<std::string> changes;
+        for (auto& change : diff.changes) {
+            changes.push_back(katla::format("{} {}", FileIndexDiff::changeTypeName(change.type), change.path));
+        }
+        ASSERT_EQ(changes, std::vector<std::string>({"Removed diff1", "Added diff2", "Modified diff3", "Removed diff5", "Added dup-dir"}));
+        ASSERT_EQ(diff.changes[4].entryType, FileSystemEntryType::Dir);
+
+        // Identical trees are decided by the hash of their root alone
+        FileIndexDatabase::create(destIndexPath, srcPath);
+        diff = FileIndexDiff::diff(srcIndexPath, destIndexPath);
+        ASSERT_TRUE(diff.changes.empty());
+        ASSERT_EQ(diff.nrOfDirectoriesVisited, 0);
+    }
+
+    TEST(BackerTests, FileIndexSnapshotTest) {
+        TemporaryDir temporaryDir;
+        auto srcIndexPath = (temporaryDir.path() / "src.db").string();
+        auto destIndexPath = (temporaryDir.path() / "dest.db").string();
+        auto snapshotPath = (temporaryDir.path() / "dest.snapshot").string();
+
+        FileIndexDatabase::create(srcIndexPath, katla::format("{}/{}", CMAKE_SOURCE_DIR, "tests/test-sets/src"));
+        FileIndexDatabase::create(destIndexPath, katla::format("{}/{}", CMAKE_SOURCE_DIR, "tests/test-sets/dest"));
+        FileIndexSnapshot::create(destIndexPath, snapshotPath);
+
+        ASSERT_TRUE(FileIndexSnapshot::isSnapshot(snapshotPath));
+        ASSERT_FALSE(FileIndexSnapshot::isSnapshot(destIndexPath));
+        ASSERT_THROW(FileIndexSnapshot::open(destIndexPath), std::runtime_error);
+
+        // Comparing with the snapshot gives the same result as comparing with the index it was made from
+        auto expected = FileIndexCompare::compare(srcIndexPath, destIndexPath);
+        auto comparison = FileIndexCompare::compare(srcIndexPath, snapshotPath);
+        ASSERT_EQ(comparison.onlyAtSrc, expected.onlyAtSrc);
+        ASSERT_EQ(comparison.onlyAtDest, expected.onlyAtDest);
+        ASSERT_EQ(comparison.atBoth, expected.atBoth);
+
+        auto snapshot = FileIndexSnapshot::open(snapshotPath);
+        auto records = FileIndexReader::open(destIndexPath).readRecords();
+        ASSERT_EQ(snapshot.hashAlgorithm(), "sha256");
+        ASSERT_EQ(snapshot.size(), 5);
+        for (size_t i = 0; i < snapshot.size(); i++) {
+            auto& record = snapshot.record(i);
+            auto& expectedRecord = records.at(std::string(snapshot.path(record)));
+            ASSERT_EQ(record.hash, expectedRecord.hash);
+            ASSERT_EQ(record.size, expectedRecord.size);
+            ASSERT_TRUE(snapshot.contains(record.hash));
+            ASSERT_EQ(snapshot.findPath(snapshot.path(record)), record.pathIndex);
+        }
+        ASSERT_FALSE(snapshot.contains(Digest {}));
+        ASSERT_FALSE(snapshot.findPath("missing").has_value());
+
+        // Of many files with one hash the one at the same path is matched, as with records
+        std::unordered_map<std::string, FileIndexRecord> commonRecords;
+        Digest commonHash {};
+        commonHash[0] = std::byte(0x42);
+        for (int i = 0; i < 1000; i++) {
+            FileIndexRecord record;
+            record.file = katla::format("dir/file-{:04}", i);
+            record.hash = commonHash;
+            record.size = 1;
+            commonRecords[record.file] = record;
+        }
+        FileIndexSnapshot::write(commonRecords, "sha256", snapshotPath);
+        auto commonSnapshot = FileIndexSnapshot::open(snapshotPath);
+        std::unordered_map<std::string, FileIndexRecord> srcCommonRecords = {{"dir/file-0777", commonRecords.at("dir/file-0777")},
+                                                                             {"other/file", commonRecords.at("dir/file-0001")}};
+        srcCommonRecords.at("other/file").file = "other/file";
+        ASSERT_EQ(commonSnapshot.find(commonHash).second - commonSnapshot.find(commonHash).first, 1000);
+        auto commonComparison = FileIndexCompare::compare(srcCommonRecords, commonSnapshot);
+        ASSERT_EQ(commonComparison.atBoth.size(), 2);
+        ASSERT_EQ(commonComparison.atBoth[0], std::make_pair(std::string("dir/file-0777"), std::string("dir/file-0777")));
+        ASSERT_EQ(commonComparison.atBoth[1], std::make_pair(std::string("other/file"), std::string("dir/file-0000")));
+        ASSERT_TRUE(commonComparison.onlyAtDest.empty());
+
+        // Offsets and counts that would wrap around when added up are rejected
+        auto damage = [&](const std::function<void(FileIndexSnapshotHeader&)>& change) {
+            FileIndexSnapshotHeader header {};
+            std::fstream file(snapshotPath, std::ios::binary | std::ios::in | std::ios::out);
+            file.read(reinterpret_cast<char*>(&header), sizeof(header));
+            change(header);
+            file.seekp(0);
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        };
+        damage([](auto& header) { header.nrOfRecords = UINT64_MAX / sizeof(FileIndexSnapshotRecord) + 2; });
+        ASSERT_THROW(FileIndexSnapshot::open(snapshotPath), std::runtime_error);
+        FileIndexSnapshot::write(commonRecords, "sha256", snapshotPath);
+        damage([](auto& header) { header.recordsOffset = 0; });
+        ASSERT_THROW(FileIndexSnapshot::open(snapshotPath), std::runtime_error);
+        FileIndexSnapshot::write(commonRecords, "sha256", snapshotPath);
+        damage([](auto& header) { header.pathOffsetsOffset = UINT64_MAX - 7; });
+        ASSERT_THROW(FileIndexSnapshot::open(snapshotPath), std::runtime_error);
+    }
+
+    TEST(BackerTests, FastCdcTest) {
+        std::mt19937_64 random(42);
+        std::vector<std::byte> data(4 * 1024 * 1024);
+        for (auto& value : data) {
+            value = static_cast<std::byte>(random());
+        }
+
+        ChunkingOptions options {2048, 8192, 32768};
+        FastCdc chunker(options);
+
+        auto cut = [&](const std::vector<std::byte>& buffer, bool serial) {
+            std::vector<size_t> lengths;
+            for (size_t offset = 0; offset < buffer.size();) {
+                size_t length = serial ? chunker.nextChunkSerial(buffer.data() + offset, buffer.size() - offset)
+                                       : chunker.nextChunk(buffer.data() + offset, buffer.size() - offset);
+                lengths.push_back(length);
+                offset += length;
+            }
+            return lengths;
+        };
+
+        // Both ways of computing the rolling hash find the same boundaries
+        auto lengths = cut(data, false);
+        ASSERT_EQ(lengths, cut(data, true));
+        for (size_t i = 0; i + 1 < lengths.size(); i++) {
+            ASSERT_GE(lengths[i], options.minSize);
+            ASSERT_LE(lengths[i], options.maxSize);
+        }
+        ASSERT_GT(lengths.size(), data.size() / (2 * options.averageSize));
+        ASSERT_LT(lengths.size(), 2 * data.size() / options.averageSize);
+
+        // Chunking from a file larger than its read buffer finds the same boundaries
+        TemporaryDir temporaryDir;
+        auto path = temporaryDir.path() / "data";
+        {
+            std::ofstream file(path, std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(data.data()), data.size());
+        }
+        Digest fileHash {};
+        auto fileChunks = chunker.chunkFile(path.string(), HashAlgorithm::Sha256, fileHash);
+        std::vector<size_t> fileLengths;
+        for (auto& chunk : fileChunks) {
+            fileLengths.push_back(chunk.length);
+        }
+        ASSERT_EQ(fileLengths, lengths);
+        ASSERT_EQ(fileHash, Hasher::toDigest(Backer::hashFile(path.string(), HashAlgorithm::Sha256)));
+
+        // Boundaries move along with inserted bytes, so almost all chunks stay the same
+        auto shifted = data;
+        shifted.insert(shifted.begin() + shifted.size() / 2, 100, std::byte(7));
+        auto shiftedLengths = cut(shifted, false);
+
+        std::multiset<size_t> remaining(lengths.begin(), lengths.end());
+        size_t nrOfShared = 0;
+        for (auto length : shiftedLengths) {
+            auto findIt = remaining.find(length);
+            if (findIt != remaining.end()) {
+                remaining.erase(findIt);
+                nrOfShared++;
+            }
+        }
+        ASSERT_GE(nrOfShared + 3, lengths.size());
+    }
+
+    TEST(BackerTests, FileChunkReportTest) {
+        TemporaryDir temporaryDir;
+        auto treePath = temporaryDir.path() / "tree";
+        auto indexPath = (temporaryDir.path() / "index.db").string();
+        std::filesystem::create_directories(treePath);
+
+        // The second file is the first with a few bytes in front, whole file hashes don't match
+        std::mt19937_64 random(7);
+        std::string content(1024 * 1024, '\0');
+        for (auto& value : content) {
+            value = static_cast<char>(random());
+        }
+        std::ofstream(treePath / "a") << content;
+        std::ofstream(treePath / "b") << "header" << content;
+        // A hard link adds no content, its chunks are stored once
+        std::filesystem::create_hard_link(treePath / "a", treePath / "a-link");
+
+        FileIndexOptions options;
+        options.chunking = true;
+        options.chunkingOptions = {4096, 16384, 65536};
+        FileIndexDatabase::create(indexPath, treePath.string(), options);
+
+        auto report = FileChunkReporter::create({indexPath});
+        ASSERT_EQ(report.indexes[0].nrOfFiles, 2);
+        ASSERT_EQ(report.indexes[0].nrOfSharingFiles, 2);
+        ASSERT_EQ(report.totalBytes, 2 * content.size() + 6);
+        ASSERT_LT(report.uniqueBytes, content.size() + 64 * 1024);
+
+        // Unchanged files take their chunks over from the previous index
+        options.update = true;
+        FileIndexDatabase::create(indexPath, treePath.string(), options);
+        auto updatedReport = FileChunkReporter::create({indexPath});
+        ASSERT_EQ(updatedReport.totalBytes, report.totalBytes);
+        ASSERT_EQ(updatedReport.uniqueBytes, report.uniqueBytes);
+
+        // Indexes without chunks can't be reported on
+        FileIndexDatabase::create(indexPath, treePath.string());
+        ASSERT_THROW(FileChunkReporter::create({indexPath}), std::runtime_error);
+    }
+
+    TEST(BackerTests, FileSyncTest) {
+        TemporaryDir temporaryDir;
+        auto srcPath = temporaryDir.path() / "src";
+        auto destPath = temporaryDir.path() / "dest";
+        auto srcIndexPath = (temporaryDir.path() / "src.db").string();
+        auto destIndexPath = (temporaryDir.path() / "dest.db").string();
+        std::filesystem::create_directories(srcPath / "a" / "b");
+        std::filesystem::create_directories(destPath);
+
+        std::ofstream(srcPath / "a" / "b" / "new") << "only at src";
+        std::ofstream(srcPath / "moved") << "at both";
+        std::ofstream(destPath / "renamed") << "at both";
+        std::filesystem::permissions(srcPath / "a" / "b" / "new", std::filesystem::perms::owner_read | std::filesystem::perms::owner_write);
+        std::filesystem::permissions(srcPath / "a" / "b", std::filesystem::perms::owner_all | std::filesystem::perms::group_read | std::filesystem::perms::group_exec);
+        std::filesystem::last_write_time(srcPath / "a", std::filesystem::last_write_time(srcPath / "a") - std::chrono::hours(24));
+
+        FileIndexDatabase::create(srcIndexPath, srcPath.string());
+        FileIndexDatabase::create(destIndexPath, destPath.string());
+
+        FileSync fileSync;
+        fileSync.sync(srcPath.string(), srcIndexPath, destPath.string(), destIndexPath);
+        ASSERT_EQ(fileSync.statistics().nrOfFiles, 1);
+        ASSERT_EQ(fileSync.statistics().nrOfFailed, 0);
+        ASSERT_EQ(fileSync.statistics().bytesCopied, 11);
+
+        // Content, mode and modification time are those of the source
+        auto copyPath = destPath / "a" / "b" / "new";
+        std::string content;
+        std::getline(std::ifstream(copyPath), content);
+        ASSERT_EQ(content, "only at src");
+        ASSERT_EQ(std::filesystem::status(copyPath).permissions(), std::filesystem::status(srcPath / "a" / "b" / "new").permissions());
+        ASSERT_EQ(std::filesystem::last_write_time(copyPath), std::filesystem::last_write_time(srcPath / "a" / "b" / "new"));
+        ASSERT_FALSE(std::filesystem::exists(destPath / "moved"));
+
+        // Created directories get the mode and times of their source, no temporary is left behind
+        ASSERT_EQ(std::filesystem::status(destPath / "a" / "b").permissions(), std::filesystem::status(srcPath / "a" / "b").permissions());
+        ASSERT_EQ(std::filesystem::last_write_time(destPath / "a"), std::filesystem::last_write_time(srcPath / "a"));
+        ASSERT_EQ(std::distance(std::filesystem::directory_iterator(destPath / "a" / "b"), std::filesystem::directory_iterator()), 1);
+
+        // A copy never writes through a file that is already there
+        ASSERT_THROW(FileSync::copyFile((srcPath / "moved").string(), copyPath.string()), std::runtime_error);
+        std::getline(std::ifstream(copyPath), content);
+        ASSERT_EQ(content, "only at src");
+
+        // Once dest is indexed again there is nothing left to copy
+        FileIndexDatabase::create(destIndexPath, destPath.string());
+        fileSync.sync(srcPath.string(), srcIndexPath, destPath.string(), destIndexPath);
+        ASSERT_EQ(fileSync.statistics().nrOfFiles, 0);
+    }
+
+    TEST(BackerTests, ReadSchedulerTest) {
+        std::vector<InodeId> inodes = {{2, 5}, {1, 9}, {1, 3}, {2, 1}};
+        auto order = ReadScheduler::schedule(ReadOrder::Inode, 1, inodes, [](size_t) { return std::string(); });
+        ASSERT_EQ(order, std::vector<size_t>({2, 1, 3, 0}));
+
+        order = ReadScheduler::schedule(ReadOrder::Scan, 1, inodes, [](size_t) { return std::string(); });
+        ASSERT_EQ(order, std::vector<size_t>({0, 1, 2, 3}));
+
+        // Every file is still read once when extents are looked up
+        auto tree = FileTree::create(katla::format("{}/{}", CMAKE_SOURCE_DIR, "tests/test-sets"));
+        std::vector<NodeIndex> files;
+        inodes.clear();
+        tree.forEachFile([&](NodeIndex index) {
+            files.push_back(index);
+            inodes.push_back(tree.node(index).inodeId());
+        });
+
+        order = ReadScheduler::schedule(ReadOrder::Extent, 2, inodes, [&](size_t i) { return tree.absolutePath(files[i]); });
+        std::sort(order.begin(), order.end());
+        for (size_t i = 0; i < order.size(); i++) {
+            ASSERT_EQ(order[i], i);
+        }
+
+        ASSERT_THROW(ReadScheduler::parseOrder("random"), std::runtime_error);
+    }
+
+    TEST(BackerTests, PerDeviceFileHashReaderTest) {
+        auto tree = FileTree::create(katla::format("{}/{}", CMAKE_SOURCE_DIR, "tests/test-sets"));
+
+        // Spread over made up devices, which are read at the same time
+        std::vector<FileHashRequest> requests;
+        tree.forEachFile([&](NodeIndex index) {
+            requests.push_back({tree.absolutePath(index), tree.node(index).size, requests.size() % 3});
+        });
+
+        PerDeviceFileHashReader reader(2, IoOptions(), HashAlgorithm::Sha256);
+        ASSERT_EQ(reader.jobs(1), 2);
+
+        std::vector<std::atomic<int>> progressCalls(requests.size());
+        auto hashes = reader.hash(requests, [&](size_t i, const std::vector<std::byte>&) {
+            progressCalls[i]++;
+        });
+
+        ASSERT_EQ(hashes.size(), requests.size());
+        for (size_t i = 0; i < requests.size(); i++) {
+            ASSERT_EQ(hashes[i], Backer::sha256(requests[i].path));
+            ASSERT_EQ(progressCalls[i], 1);
+        }
+    }
+
+    TEST(BackerTests, IoUringFileHashReaderTest) {
+        if (!IoUringFileHashReader::isSupported()) {
+            GTEST_SKIP() << "io_uring is not available";
+        }
+
+        TemporaryDir temporaryDir;
+        auto path = (temporaryDir.path() / "files").string();
+        std::filesystem::create_directories(path);
+
+        IoOptions options;
+        options.bufferSize = 4096;
+
+        std::mt19937 random(5);
+        auto content = [&](size_t size) {
+            std::string result(size, '\0');
+            for (auto& c : result) {
+                c = static_cast<char>(random());
+            }
+            return result;
+        };
+
+        // Sizes around the single read of small files and the several reads of large ones
+        std::vector<std::pair<std::string, size_t>> files = {
+            {"empty", 0}, {"small", 100}, {"buffer-size", 4096}, {"large", 4096 * 7 / 2},
+            {"empty-grows", 0}, {"small-grows", 100}, {"buffer-size-grows", 4096}, {"large-grows", 4096 * 3}, {"large-shrinks", 4096 * 3}};
+
+        std::vector<FileHashRequest> requests;
+        for (auto& file : files) {
+            auto filePath = path + "/" + file.first;
+            std::ofstream(filePath, std::ios::binary) << content(file.second);
+            requests.push_back({filePath, file.second, 0});
+        }
+
+        // Changed after the scan, the requests still hold the old sizes
+        std::ofstream(path + "/empty-grows", std::ios::binary | std::ios::app) << content(10);
+        std::ofstream(path + "/small-grows", std::ios::binary | std::ios::app) << content(10);
+        std::ofstream(path + "/buffer-size-grows", std::ios::binary | std::ios::app) << content(1);
+        std::ofstream(path + "/large-grows", std::ios::binary | std::ios::app) << content(4096);
+        std::filesystem::resize_file(path + "/large-shrinks", 4096 * 2);
+
+        auto ioUringHashes = IoUringFileHashReader(2, options, HashAlgorithm::Sha256).hash(requests);
+        auto blockingHashes = BlockingFileHashReader(2, options, HashAlgorithm::Sha256).hash(requests);
+
+        ASSERT_EQ(ioUringHashes.size(), requests.size());
+        for (size_t i = 0; i < requests.size(); i++) {
+            ASSERT_EQ(ioUringHashes[i], blockingHashes[i]) << requests[i].path;
+            ASSERT_EQ(ioUringHashes[i], Backer::hashFile(requests[i].path, HashAlgorithm::Sha256)) << requests[i].path;
+        }
+
+        // An empty file that is gone since the scan is not taken for empty
+        std::filesystem::remove(path + "/empty");
+        ASSERT_THROW(IoUringFileHashReader(2, options, HashAlgorithm::Sha256).hash({requests[0]}), std::runtime_error);
+    }
+
+    TEST(BackerTests, WorkerPoolForEachTest) {
+        WorkerPool workerPool(4);
+
+        std::vector<int> results(1000, 0);
+        std::atomic<int> callCount {0};
+        workerPool.forEach(results.size(), [&](size_t i) {
+            results[i] = static_cast<int>(i) * 2;
+            callCount++;
+        });
+
+        ASSERT_EQ(callCount, 1000);
+        for (size_t i = 0; i < results.size(); i++) {
+            ASSERT_EQ(results[i], static_cast<int>(i) * 2);
+        }
+
+        ASSERT_THROW(workerPool.forEach(10, [](size_t) { throw std::runtime_error("failed"); }), std::runtime_error);
+    }
+
+    TEST(BackerTests, BoundedQueueTest) {
+        BoundedQueue<int> queue(4);
+
+        // The producer is held back by the capacity, items still arrive in order
+        std::thread producer([&]() {
+            for (int i = 0; i < 100; i++) {
+                queue.push(i, 2);
+            }
+            queue.close();
+        });
+
+        int expected = 0;
+        while (auto item = queue.pop()) {
+            EXPECT_EQ(*item, expected++);
+        }
+        producer.join();
+
+        ASSERT_EQ(expected, 100);
+        ASSERT_FALSE(queue.push(100)) << "Closed queue accepted an item";
+    }
+
+    TEST(BackerTests, FileHashCacheTest) {
+        TemporaryDir temporaryDir;
+        auto path = (temporaryDir.path() / "file").string();
+        std::ofstream(path) << "cached content";
+
+        // Hashes of recently modified files are not stored
+        auto modificationTime = std::filesystem::last_write_time(path) - std::chrono::hours(1);
+        std::filesystem::last_write_time(path, modificationTime);
+
+        std::vector<FileHashRequest> requests = {{path, 14}};
+        auto expectedHash = Backer::sha256(path);
+
+        {
+            CachingFileHashReader reader(FileHashReader::create(1, IoOptions()), 1, HashAlgorithm::Sha256);
+            ASSERT_EQ(reader.hash(requests).front(), expectedHash);
+            ASSERT_EQ(reader.cache().nrOfMisses(), 1);
+            if (reader.cache().nrOfStored() == 0) {
+                // No user extended attributes on this file system
+                return;
+            }
+        }
+
+        {
+            CachingFileHashReader reader(FileHashReader::create(1, IoOptions()), 1, HashAlgorithm::Sha256);
+            ASSERT_EQ(reader.hash(requests).front(), expectedHash);
+            ASSERT_EQ(reader.cache().nrOfHits(), 1);
+        }
+
+        // Same size, a different modification time
+        std::ofstream(path) << "cached CONTENT";
+        std::filesystem::last_write_time(path, modificationTime - std::chrono::hours(1));
+
+        CachingFileHashReader reader(FileHashReader::create(1, IoOptions()), 1, HashAlgorithm::Sha256);
+        ASSERT_EQ(reader.hash(requests).front(), Backer::sha256(path));
+        ASSERT_EQ(reader.cache().nrOfHits(), 0);
+
+        // Storing the hash changes the change time of the file, the index has to hold the new one or the next
+        // update takes the file for changed
+        auto treePath = (temporaryDir.path() / "tree").string();
+        auto indexPath = (temporaryDir.path() / "index.db").string();
+        std::filesystem::create_directories(treePath);
+        std::ofstream(treePath + "/file") << "cached content";
+        std::filesystem::last_write_time(treePath + "/file", modificationTime);
+
+        FileIndexOptions options;
+        options.io.hashCache = true;
+        FileIndexDatabase::create(indexPath, treePath, options);
+
+        struct stat statResult {};
+        ASSERT_EQ(::lstat((treePath + "/file").c_str(), &statResult), 0);
+        auto records = FileIndexReader::open(indexPath).readRecords();
+        ASSERT_EQ(records.at("file").changeTime, static_cast<int64_t>(statResult.st_ctim.tv_sec) * 1000000000 + statResult.st_ctim.tv_nsec);
+    }
+
+    TEST(BackerTests, Sha256MultiBufferTest) {
+        auto dup1 = katla::format("{}/{}", CMAKE_SOURCE_DIR, "tests/test-sets/duplicate-test/dup1");
+        auto diff1 = katla::format("{}/{}", CMAKE_SOURCE_DIR, "tests/test-sets/duplicate-test/diff1");
+        auto fileHashes = Backer::sha256Files({dup1, diff1});
+        ASSERT_EQ(fileHashes.size(), 2);
+        ASSERT_EQ(fileHashes[0], Backer::sha256(dup1));
+        ASSERT_EQ(fileHashes[1], Backer::sha256(diff1));
+
+        if (!Sha256MultiBuffer::isAvailable(Sha256MultiBuffer::Implementation::Avx2)) {
+            GTEST_SKIP() << "AVX2 is not available";
+        }
+
+        // Lengths around the block and padding boundaries, so lanes finish after a different number of blocks
+        std::vector<std::vector<std::byte>> contents;
+        for (size_t size : {0, 1, 55, 56, 63, 64, 65, 119, 120, 128, 1000, 4096, 10000}) {
+            std::vector<std::byte> content(size);
+            for (size_t i = 0; i < size; i++) {
+                content[i] = static_cast<std::byte>(i * 31 + size);
+            }
+            contents.push_back(content);
+        }
+
+        std::vector<gsl::span<const std::byte>> messages;
+        for (auto& content : contents) {
+            messages.push_back(gsl::span<const std::byte>(content.data(), content.size()));
+        }
+
+        auto expected = Sha256MultiBuffer::hash(messages, Sha256MultiBuffer::Implementation::OpenSsl);
+        auto hashes = Sha256MultiBuffer::hash(messages, Sha256MultiBuffer::Implementation::Avx2);
+        ASSERT_EQ(hashes, expected);
     }
 }
 